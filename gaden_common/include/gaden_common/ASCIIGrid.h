@@ -0,0 +1,211 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <charconv>
+#include <type_traits>
+#include <algorithm>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "Vector3.h"
+
+// Loader for the ASCII 3D grids (occupancy, wind components).
+// Each line holds the values of every Y index for one X index, and every Z layer ends with a line containing ";".
+//
+// The file is memory-mapped and split at the ";" separators, then the layers are parsed in parallel with std::from_chars,
+// straight into the flat array (index x + y * num_cells.x + z * num_cells.x * num_cells.y). Nothing is allocated per line or value.
+
+namespace Gaden
+{
+	// Read-only memory map of a whole file
+	class MappedFile
+	{
+	public:
+		MappedFile() = default;
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		~MappedFile()
+		{
+			close();
+		}
+
+		bool open(const std::string& path)
+		{
+			close();
+			int fd = ::open(path.c_str(), O_RDONLY);
+			if (fd < 0)
+				return false;
+
+			struct stat info;
+			bool ok = fstat(fd, &info) == 0;
+			if (ok && info.st_size > 0)
+			{
+				void* address = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+				ok = address != MAP_FAILED;
+				if (ok)
+				{
+					madvise(address, info.st_size, MADV_WILLNEED);
+					bytes = (const char*)address;
+					length = info.st_size;
+				}
+			}
+			::close(fd);
+			return ok;
+		}
+
+		void close()
+		{
+			if (bytes)
+				munmap((void*)bytes, length);
+			bytes = nullptr;
+			length = 0;
+		}
+
+		const char* data() const
+		{
+			return bytes;
+		}
+
+		size_t size() const
+		{
+			return length;
+		}
+
+	private:
+		const char* bytes = nullptr;
+		size_t length = 0;
+	};
+
+	inline bool isASCIISpace(char c)
+	{
+		return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+	}
+
+	// One Z layer. Sets error if the layer does not have num_cells.x lines of num_cells.y values
+	template <typename T>
+	inline void parseASCIILayer(const char* p, const char* end, const Vector3i& num_cells, int z, T* grid, std::string& error)
+	{
+		// integer grids (occupancy) are read as int, and the rest as double
+		using Parsed = typename std::conditional<std::is_floating_point<T>::value, double, int>::type;
+		T* layer = grid + (size_t)z * num_cells.x * num_cells.y;
+
+		int x = 0;
+		while (p < end)
+		{
+			const char* line_end = (const char*)memchr(p, '\n', end - p);
+			if (!line_end)
+				line_end = end;
+
+			int y = 0;
+			while (true)
+			{
+				while (p < line_end && isASCIISpace(*p))
+					p++;
+				if (p < line_end && *p == '+') // not accepted by from_chars
+					p++;
+				if (p == line_end)
+					break;
+
+				Parsed value;
+				std::from_chars_result result = std::from_chars(p, line_end, value);
+				if (result.ec != std::errc())
+				{
+					error = "layer " + std::to_string(z) + ", row " + std::to_string(x) + ": invalid value '" + std::string(p, std::min<size_t>(line_end - p, 16)) + "'";
+					return;
+				}
+				if (x < num_cells.x && y < num_cells.y)
+					layer[x + y * num_cells.x] = value;
+				y++;
+				p = result.ptr;
+			}
+
+			if (y > 0) // skip empty lines
+			{
+				if (y != num_cells.y)
+				{
+					error = "layer " + std::to_string(z) + ", row " + std::to_string(x) + ": " + std::to_string(y) + " values, expected " + std::to_string(num_cells.y);
+					return;
+				}
+				x++;
+			}
+			p = line_end + 1;
+		}
+
+		if (x != num_cells.x)
+			error = "layer " + std::to_string(z) + ": " + std::to_string(x) + " rows, expected " + std::to_string(num_cells.x);
+	}
+
+	// Parses [begin, end) into grid (num_cells.x * num_cells.y * num_cells.z values).
+	// Returns false, with a description in error, if a value cannot be parsed or the dimensions do not match num_cells
+	template <typename T>
+	inline bool parseASCIIGrid(const char* begin, const char* end, const Vector3i& num_cells, T* grid, std::string& error)
+	{
+		// 1. Split in layers (the text before each ";", plus whatever follows the last one if it is not blank)
+		std::vector<const char*> layer_begin, layer_end;
+		const char* p = begin;
+		while (p < end)
+		{
+			const char* separator = (const char*)memchr(p, ';', end - p);
+			if (!separator)
+			{
+				const char* rest = p;
+				while (rest < end && isASCIISpace(*rest))
+					rest++;
+				if (rest < end)
+				{
+					layer_begin.push_back(p);
+					layer_end.push_back(end);
+				}
+				break;
+			}
+			layer_begin.push_back(p);
+			layer_end.push_back(separator);
+			p = separator + 1;
+		}
+
+		if ((int)layer_begin.size() != num_cells.z)
+		{
+			error = std::to_string(layer_begin.size()) + " layers, expected " + std::to_string(num_cells.z);
+			return false;
+		}
+
+		// 2. Parse the layers in parallel
+		std::vector<std::string> layer_errors(num_cells.z);
+		#pragma omp parallel for schedule(dynamic)
+		for (int z = 0; z < num_cells.z; z++)
+			parseASCIILayer(layer_begin[z], layer_end[z], num_cells, z, grid, layer_errors[z]);
+
+		for (const std::string& layer_error : layer_errors)
+		{
+			if (!layer_error.empty())
+			{
+				error = layer_error;
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Reads the grid stored in a file, starting at offset (to skip a header). grid is resized to fit
+	template <typename T>
+	inline bool readASCIIGrid(const std::string& path, size_t offset, const Vector3i& num_cells, std::vector<T>& grid, std::string& error)
+	{
+		MappedFile file;
+		if (!file.open(path))
+		{
+			error = "cannot open the file";
+			return false;
+		}
+		if (offset > file.size())
+		{
+			error = "the file is too short";
+			return false;
+		}
+
+		grid.resize((size_t)num_cells.x * num_cells.y * num_cells.z);
+		return parseASCIIGrid(file.data() + offset, file.data() + file.size(), num_cells, grid.data(), error);
+	}
+}
@@ -0,0 +1,221 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+// Farrell's filament model, evaluated in SIMD registers. The concentration of a filament with Q moles of gas and
+// standard deviation sigma [cm], at a distance d [cm] from its center, is
+//     Q / (sqrt(8 pi^3) sigma^3) * exp(-d^2 / (2 sigma^2))     [moles/cm3]
+//
+// Two layouts are supported:
+//   - pointVsFilaments: one point against many filaments (player queries, probes)
+//   - pointsVsFilament: many points against one filament (splatting a filament onto the grid)
+// The exponential is a range reduction to [-ln2/2, ln2/2] plus a degree 11 polynomial, with a max relative error
+// below 1e-14 (the filaments only need it in [-12.5, 0]).
+//
+// The loops are written once with GCC vector extensions and compiled for SSE4.1, AVX2 and AVX-512. The widest one
+// supported by the CPU is picked at runtime (see simdLevel), so the binaries stay portable.
+
+namespace Gaden
+{
+	namespace Kernel
+	{
+		template <int N>
+		struct Vec
+		{
+			typedef double D __attribute__((vector_size(N * sizeof(double))));
+			typedef int64_t L __attribute__((vector_size(N * sizeof(int64_t))));
+		};
+
+		// 1 / (sqrt(8 pi^3))
+		static const double normalization = 0.06349363593424097;
+
+		template <int N>
+		static inline __attribute__((always_inline)) void fastExp(const typename Vec<N>::D& exponent, typename Vec<N>::D& result)
+		{
+			typedef typename Vec<N>::D D;
+			typedef typename Vec<N>::L L;
+			const double shifter = 6755399441055744.0;         // 1.5 * 2^52: adding it rounds to an integer, kept in the low bits
+			D x = exponent < -708.0 ? D{} - 708.0 : exponent; // below that, 2^k is not a normal number
+
+			// x = k ln2 + r
+			D t = x * 1.4426950408889634 + shifter;
+			D k = t - shifter;
+			D r = x - k * 6.93147180369123816490e-01 - k * 1.90821492927058770002e-10;
+
+			// exp(r), Taylor series
+			D p = r * (1.0 / 39916800) + 1.0 / 3628800;
+			p = p * r + 1.0 / 362880;
+			p = p * r + 1.0 / 40320;
+			p = p * r + 1.0 / 5040;
+			p = p * r + 1.0 / 720;
+			p = p * r + 1.0 / 120;
+			p = p * r + 1.0 / 24;
+			p = p * r + 1.0 / 6;
+			p = p * r + 0.5;
+			p = p * r + 1.0;
+			p = p * r + 1.0;
+
+			// 2^k, built directly in the exponent bits
+			L bits = ((L)t + 1023) << 52;
+			result = p * (D)bits;
+		}
+
+		// The vectors are passed by reference: by value, GCC warns about the ABI of the 256 and 512 bit ones
+		template <int N>
+		static inline __attribute__((always_inline)) void load(const double* data, typename Vec<N>::D& v)
+		{
+			memcpy(&v, data, sizeof(v));
+		}
+
+		// d2 [m^2], sigma [cm]. Zero beyond cutoff standard deviations
+		template <int N>
+		static inline __attribute__((always_inline)) void concentration(const typename Vec<N>::D& d2, const typename Vec<N>::D& sigma, double moles, double cutoff,
+			double* out)
+		{
+			typedef typename Vec<N>::D D;
+			D sigma_m2 = sigma * sigma * 0.0001;
+			D gaussian;
+			fastExp<N>(-0.5 * d2 / sigma_m2, gaussian);
+			D value = (moles * normalization) / (sigma * sigma * sigma) * gaussian;
+			value = d2 < cutoff * cutoff * sigma_m2 ? value : D{};
+			memcpy(out, &value, sizeof(value));
+		}
+
+		template <int N>
+		static inline __attribute__((always_inline)) void pointVsFilamentsImpl(double px, double py, double pz, const double* x, const double* y, const double* z,
+			const double* sigma, size_t n, double moles, double cutoff, double* out)
+		{
+			size_t i = 0;
+			typename Vec<N>::D dx, dy, dz, s;
+			for (; i + N <= n; i += N)
+			{
+				load<N>(x + i, dx);
+				load<N>(y + i, dy);
+				load<N>(z + i, dz);
+				load<N>(sigma + i, s);
+				dx -= px;
+				dy -= py;
+				dz -= pz;
+				concentration<N>(dx * dx + dy * dy + dz * dz, s, moles, cutoff, out + i);
+			}
+			for (; i < n; i++)
+			{
+				double d2 = (x[i] - px) * (x[i] - px) + (y[i] - py) * (y[i] - py) + (z[i] - pz) * (z[i] - pz);
+				concentration<1>(typename Vec<1>::D{ d2 }, typename Vec<1>::D{ sigma[i] }, moles, cutoff, out + i);
+			}
+		}
+
+		template <int N>
+		static inline __attribute__((always_inline)) void pointsVsFilamentImpl(const double* x, const double* y, const double* z, size_t n,
+			double fx, double fy, double fz, double sigma, double moles, double cutoff, double* out)
+		{
+			size_t i = 0;
+			typename Vec<N>::D dx, dy, dz, s = typename Vec<N>::D{} + sigma;
+			for (; i + N <= n; i += N)
+			{
+				load<N>(x + i, dx);
+				load<N>(y + i, dy);
+				load<N>(z + i, dz);
+				dx -= fx;
+				dy -= fy;
+				dz -= fz;
+				concentration<N>(dx * dx + dy * dy + dz * dz, s, moles, cutoff, out + i);
+			}
+			for (; i < n; i++)
+			{
+				double d2 = (x[i] - fx) * (x[i] - fx) + (y[i] - fy) * (y[i] - fy) + (z[i] - fz) * (z[i] - fz);
+				concentration<1>(typename Vec<1>::D{ d2 }, typename Vec<1>::D{ sigma }, moles, cutoff, out + i);
+			}
+		}
+
+#define GADEN_KERNEL_VARIANTS(SUFFIX, TARGET, N)                                                                                           \
+	TARGET static inline void pointVsFilaments##SUFFIX(double px, double py, double pz, const double* x, const double* y, const double* z, \
+		const double* sigma, size_t n, double moles, double cutoff, double* out)                                                           \
+	{                                                                                                                                      \
+		pointVsFilamentsImpl<N>(px, py, pz, x, y, z, sigma, n, moles, cutoff, out);                                                        \
+	}                                                                                                                                      \
+	TARGET static inline void pointsVsFilament##SUFFIX(const double* x, const double* y, const double* z, size_t n, double fx, double fy,  \
+		double fz, double sigma, double moles, double cutoff, double* out)                                                                 \
+	{                                                                                                                                      \
+		pointsVsFilamentImpl<N>(x, y, z, n, fx, fy, fz, sigma, moles, cutoff, out);                                                        \
+	}
+
+		GADEN_KERNEL_VARIANTS(Generic, __attribute__((flatten)), 2)
+#if defined(__x86_64__) || defined(__i386__)
+		GADEN_KERNEL_VARIANTS(SSE4, __attribute__((target("sse4.1"), flatten)), 2)
+		GADEN_KERNEL_VARIANTS(AVX2, __attribute__((target("avx2,fma"), flatten)), 4)
+		GADEN_KERNEL_VARIANTS(AVX512, __attribute__((target("avx512f"), flatten)), 8)
+#endif
+#undef GADEN_KERNEL_VARIANTS
+	}
+
+	enum class SimdLevel
+	{
+		GENERIC,
+		SSE4,
+		AVX2,
+		AVX512
+	};
+
+	// Widest instruction set supported by the CPU (detected once)
+	static inline SimdLevel simdLevel()
+	{
+#if defined(__x86_64__) || defined(__i386__)
+		static const SimdLevel level = __builtin_cpu_supports("avx512f") ? SimdLevel::AVX512
+			: (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) ? SimdLevel::AVX2
+			: __builtin_cpu_supports("sse4.1") ? SimdLevel::SSE4
+			: SimdLevel::GENERIC;
+		return level;
+#else
+		return SimdLevel::GENERIC;
+#endif
+	}
+
+	static inline const char* simdLevelName(SimdLevel level)
+	{
+		const char* names[] = { "generic", "SSE4.1", "AVX2", "AVX-512" };
+		return names[(int)level];
+	}
+
+	// out[i] = concentration [moles/cm3] of filament i (x, y, z [m], sigma [cm]) at (px, py, pz), or 0 if it is farther
+	// than cutoff standard deviations
+	static inline void pointVsFilaments(double px, double py, double pz, const double* x, const double* y, const double* z, const double* sigma,
+		size_t n, double moles, double cutoff, double* out)
+	{
+		switch (simdLevel())
+		{
+#if defined(__x86_64__) || defined(__i386__)
+		case SimdLevel::AVX512:
+			return Kernel::pointVsFilamentsAVX512(px, py, pz, x, y, z, sigma, n, moles, cutoff, out);
+		case SimdLevel::AVX2:
+			return Kernel::pointVsFilamentsAVX2(px, py, pz, x, y, z, sigma, n, moles, cutoff, out);
+		case SimdLevel::SSE4:
+			return Kernel::pointVsFilamentsSSE4(px, py, pz, x, y, z, sigma, n, moles, cutoff, out);
+#endif
+		default:
+			return Kernel::pointVsFilamentsGeneric(px, py, pz, x, y, z, sigma, n, moles, cutoff, out);
+		}
+	}
+
+	// out[i] = concentration [moles/cm3] at (x[i], y[i], z[i]) of the filament at (fx, fy, fz), or 0 if it is farther
+	// than cutoff standard deviations
+	static inline void pointsVsFilament(const double* x, const double* y, const double* z, size_t n, double fx, double fy, double fz, double sigma,
+		double moles, double cutoff, double* out)
+	{
+		switch (simdLevel())
+		{
+#if defined(__x86_64__) || defined(__i386__)
+		case SimdLevel::AVX512:
+			return Kernel::pointsVsFilamentAVX512(x, y, z, n, fx, fy, fz, sigma, moles, cutoff, out);
+		case SimdLevel::AVX2:
+			return Kernel::pointsVsFilamentAVX2(x, y, z, n, fx, fy, fz, sigma, moles, cutoff, out);
+		case SimdLevel::SSE4:
+			return Kernel::pointsVsFilamentSSE4(x, y, z, n, fx, fy, fz, sigma, moles, cutoff, out);
+#endif
+		default:
+			return Kernel::pointsVsFilamentGeneric(x, y, z, n, fx, fy, fz, sigma, moles, cutoff, out);
+		}
+	}
+}
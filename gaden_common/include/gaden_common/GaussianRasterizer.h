@@ -0,0 +1,282 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <math.h>
+#include <omp.h>
+#include "ReadEnvironment.h"
+
+// Computes the gas in every cell of the environment from a set of 3D gaussians (filaments), without evaluating each one separately.
+//
+//   1. The filaments are grouped in bins of similar sigma
+//   2. The moles of each bin are deposited on the grid with cloud-in-cell (trilinear weights over the 8 closest cell centers)
+//   3. Each bin is convolved with a single gaussian, as three separable 1D passes (X, then Y, then Z)
+//   4. The bins are added up
+//
+// The cost depends on the number of bins and the size of the region covered by each of them, instead of on the number
+// of filaments times their volume.
+// Obstacles: the 1D passes do not go through occupied cells, so gas does not leak through walls (the gas that would reach
+// them is lost, as when evaluating each filament with a line-of-sight check). This is only an approximation of the
+// line-of-sight check: gas can still reach cells that are visible through an X-Y-Z path along free cells.
+
+namespace Gaden
+{
+	struct GaussianSource
+	{
+		double x, y, z; //[m] center
+		double sigma;   //[cm]
+		double moles;
+	};
+
+	class GaussianRasterizer
+	{
+	public:
+		// sigma_bin_ratio: max ratio between the largest and smallest sigma of a bin. Smaller values are more accurate and slower
+		GaussianRasterizer(double sigma_bin_ratio = 1.1)
+			: bin_ratio(std::max(sigma_bin_ratio, 1.0001))
+		{
+		}
+
+		// Fills grid with the moles of gas in each cell
+		template <typename T>
+		void rasterize(const EnvironmentDescription& env, const std::vector<GaussianSource>& sources, std::vector<T>& grid)
+		{
+			size_t num_cells = (size_t)env.num_cells.x * env.num_cells.y * env.num_cells.z;
+			grid.assign(num_cells, 0.0);
+			if (sources.empty())
+				return;
+			if (buffer.size() != num_cells)
+			{
+				buffer.assign(num_cells, 0.0);
+				aux.assign(num_cells, 0.0);
+			}
+
+			// Sort by sigma and group in bins
+			order.resize(sources.size());
+			for (size_t i = 0; i < sources.size(); i++)
+				order[i] = i;
+			std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return sources[a].sigma < sources[b].sigma; });
+
+			size_t first = 0;
+			while (first < order.size())
+			{
+				size_t last = first;
+				double max_sigma = sources[order[first]].sigma * bin_ratio;
+				while (last < order.size() && sources[order[last]].sigma <= max_sigma)
+					last++;
+				rasterizeBin(env, sources, first, last, grid);
+				first = last;
+			}
+		}
+
+	private:
+		double bin_ratio;
+		std::vector<size_t> order;
+		std::vector<double> buffer, aux; // Full grids, but only the region covered by the current bin is used. Zero outside rasterizeBin
+		std::vector<double> kernel;
+
+		struct Region
+		{
+			int min[3], max[3]; // inclusive
+		};
+
+		static bool isFree(const EnvironmentDescription& env, int x, int y, int z)
+		{
+			return env.Env[indexFrom3D(Vector3i(x, y, z), env.num_cells)] == 0;
+		}
+
+		template <typename T>
+		void rasterizeBin(const EnvironmentDescription& env, const std::vector<GaussianSource>& sources, size_t first, size_t last, std::vector<T>& grid)
+		{
+			const int num_cells[3] = { env.num_cells.x, env.num_cells.y, env.num_cells.z };
+			const double min_coord[3] = { env.min_coord.x, env.min_coord.y, env.min_coord.z };
+			const double h = env.cell_size;
+
+			// The gaussian of the bin keeps the mean variance of its filaments
+			double variance = 0;
+			for (size_t n = first; n < last; n++)
+				variance += pow(sources[order[n]].sigma / 100, 2);
+			variance /= (last - first);
+
+			// The cloud-in-cell deposit already spreads the mass (triangle of variance h²/6 on each axis)
+			double kernel_sigma = sqrt(std::max(variance - h * h / 6, 0.0));
+			int radius = (int)ceil(3 * kernel_sigma / h);
+
+			// 1. Deposit
+			Region region;
+			for (int axis = 0; axis < 3; axis++)
+			{
+				region.min[axis] = num_cells[axis];
+				region.max[axis] = -1;
+			}
+			for (size_t n = first; n < last; n++)
+			{
+				const GaussianSource& source = sources[order[n]];
+				const double pos[3] = { source.x, source.y, source.z };
+				int cell[3];
+				double frac[3];
+				for (int axis = 0; axis < 3; axis++)
+				{
+					double u = (pos[axis] - min_coord[axis]) / h - 0.5; // relative to the cell centers
+					cell[axis] = (int)floor(u);
+					frac[axis] = u - cell[axis];
+				}
+
+				// Only the free cells get mass
+				double weights[8];
+				double total_weight = 0;
+				for (int corner = 0; corner < 8; corner++)
+				{
+					int c[3];
+					double w = 1;
+					for (int axis = 0; axis < 3; axis++)
+					{
+						int offset = (corner >> axis) & 1;
+						c[axis] = cell[axis] + offset;
+						w *= offset ? frac[axis] : 1 - frac[axis];
+					}
+					bool inside = c[0] >= 0 && c[0] < num_cells[0] && c[1] >= 0 && c[1] < num_cells[1] && c[2] >= 0 && c[2] < num_cells[2];
+					weights[corner] = (inside && isFree(env, c[0], c[1], c[2])) ? w : 0;
+					total_weight += weights[corner];
+				}
+
+				if (total_weight <= 0)
+				{
+					// All the neighbour centers are blocked. Put everything in the cell that contains the filament
+					int c[3];
+					for (int axis = 0; axis < 3; axis++)
+						c[axis] = std::clamp((int)floor((pos[axis] - min_coord[axis]) / h), 0, num_cells[axis] - 1);
+					depositAt(env, c, source.moles, region);
+					continue;
+				}
+
+				for (int corner = 0; corner < 8; corner++)
+				{
+					if (weights[corner] <= 0)
+						continue;
+					int c[3];
+					for (int axis = 0; axis < 3; axis++)
+						c[axis] = cell[axis] + ((corner >> axis) & 1);
+					depositAt(env, c, source.moles * weights[corner] / total_weight, region);
+				}
+			}
+
+			// 2. Convolve (only the region covered by the bin)
+			for (int axis = 0; axis < 3; axis++)
+			{
+				region.min[axis] = std::max(region.min[axis] - radius, 0);
+				region.max[axis] = std::min(region.max[axis] + radius, num_cells[axis] - 1);
+			}
+			if (radius > 0)
+			{
+				computeKernel(kernel_sigma / h, radius);
+				for (int axis = 0; axis < 3; axis++)
+				{
+					convolveAxis(env, region, axis, radius);
+					buffer.swap(aux);
+				}
+			}
+
+			// 3. Accumulate (and clear both buffers for the next bin)
+			for (int k = region.min[2]; k <= region.max[2]; k++)
+				for (int j = region.min[1]; j <= region.max[1]; j++)
+					for (int i = region.min[0]; i <= region.max[0]; i++)
+					{
+						int idx = indexFrom3D(Vector3i(i, j, k), env.num_cells);
+						grid[idx] += buffer[idx];
+						buffer[idx] = 0;
+						aux[idx] = 0;
+					}
+		}
+
+		void depositAt(const EnvironmentDescription& env, const int c[3], double moles, Region& region)
+		{
+			buffer[indexFrom3D(Vector3i(c[0], c[1], c[2]), env.num_cells)] += moles;
+			for (int axis = 0; axis < 3; axis++)
+			{
+				region.min[axis] = std::min(region.min[axis], c[axis]);
+				region.max[axis] = std::max(region.max[axis], c[axis]);
+			}
+		}
+
+		// Fraction of a 1D gaussian (sigma in cells) that falls in each cell, normalized so the truncated kernel keeps the mass
+		void computeKernel(double sigma_cells, int radius)
+		{
+			kernel.resize(radius + 1);
+			double total = 0;
+			for (int d = 0; d <= radius; d++)
+			{
+				kernel[d] = 0.5 * (erf((d + 0.5) / (sigma_cells * M_SQRT2)) - erf((d - 0.5) / (sigma_cells * M_SQRT2)));
+				total += d == 0 ? kernel[d] : 2 * kernel[d];
+			}
+			for (double& k : kernel)
+				k /= total;
+		}
+
+		// buffer -> aux, along one axis. Every line is split in runs of free cells, and each run is convolved on its own.
+		// Called from a parallel region (the step loop of the simulator), the lines are tasks of that team
+		void convolveAxis(const EnvironmentDescription& env, const Region& region, int axis, int radius)
+		{
+			const int a1 = (axis + 1) % 3, a2 = (axis + 2) % 3;
+			if (omp_in_parallel())
+			{
+				#pragma omp taskloop collapse(2)
+				for (int p2 = region.min[a2]; p2 <= region.max[a2]; p2++)
+					for (int p1 = region.min[a1]; p1 <= region.max[a1]; p1++)
+						convolveLine(env, region, axis, radius, p1, p2);
+			}
+			else
+			{
+				#pragma omp parallel for collapse(2)
+				for (int p2 = region.min[a2]; p2 <= region.max[a2]; p2++)
+					for (int p1 = region.min[a1]; p1 <= region.max[a1]; p1++)
+						convolveLine(env, region, axis, radius, p1, p2);
+			}
+		}
+
+		// The line along axis through p1 (on the next axis) and p2 (on the one after)
+		void convolveLine(const EnvironmentDescription& env, const Region& region, int axis, int radius, int p1, int p2)
+		{
+			const int a1 = (axis + 1) % 3, a2 = (axis + 2) % 3;
+			const int stride[3] = { 1, env.num_cells.x, env.num_cells.x * env.num_cells.y };
+			int base = p1 * stride[a1] + p2 * stride[a2];
+			for (int p = region.min[axis]; p <= region.max[axis]; p++)
+				aux[base + p * stride[axis]] = 0;
+
+			int p = region.min[axis];
+			while (p <= region.max[axis])
+			{
+				// find the next run of free cells [start, end]
+				int cell[3];
+				cell[a1] = p1;
+				cell[a2] = p2;
+				cell[axis] = p;
+				if (!isFree(env, cell[0], cell[1], cell[2]))
+				{
+					p++;
+					continue;
+				}
+				int start = p;
+				int end = p;
+				while (end + 1 <= region.max[axis])
+				{
+					cell[axis] = end + 1;
+					if (!isFree(env, cell[0], cell[1], cell[2]))
+						break;
+					end++;
+				}
+
+				for (int src = start; src <= end; src++)
+				{
+					double value = buffer[base + src * stride[axis]];
+					if (value == 0)
+						continue;
+					int from = std::max(src - radius, start);
+					int to = std::min(src + radius, end);
+					for (int dst = from; dst <= to; dst++)
+						aux[base + dst * stride[axis]] += value * kernel[std::abs(dst - src)];
+				}
+				p = end + 1;
+			}
+		}
+	};
+}
@@ -0,0 +1,320 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <new>
+#include <chrono>
+#include <unistd.h>
+#include <boost/interprocess/shared_memory_object.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/interprocess/sync/interprocess_mutex.hpp>
+#include <boost/interprocess/sync/scoped_lock.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include "Wind.h"
+#include "SimulationArchive.h"
+
+// Shared memory segment where a running filament simulator leaves its current state (filaments + wind + far field), so the
+// player can serve queries from it directly instead of waiting for the results to be written to disk and read back.
+//
+// Layout:
+//   LiveExchangeHeader | wind: U,V,W doubles per cell (interleaved) | far field: moles per cell (doubles, only if the
+//   simulator has one) | LiveFilament[filament_capacity]
+//
+// The simulator overwrites the segment on every step, under the mutex of the header. Readers copy out what they need
+// (also under the mutex) only when the sequence number changed since their last read.
+// The segment is removed when the simulator closes; readers that already mapped it keep the last state. A simulator that
+// starts again under the same name creates a new segment: readers that stop getting new states check for it and reopen.
+
+namespace Gaden
+{
+	struct LiveFilament
+	{
+		int32_t id;
+		int32_t padding;
+		double x, y, z; //[m]
+		double sigma;   //[cm]
+	};
+
+	struct LiveExchangeHeader
+	{
+		char magic[8];
+		uint64_t writer_id;         // different for every segment created, to tell a replaced one
+		boost::interprocess::interprocess_mutex mutex;
+		ArchiveHeader info;         // environment and gas constants (same as the header of an archive)
+		uint64_t num_cells;
+		uint64_t far_field_cells;   // num_cells if the simulator has a far field, 0 otherwise
+		uint64_t filament_capacity;
+		uint64_t sequence;          // incremented on every publish
+		double sim_time;            //(sec)
+		int32_t wind_idx;           // wind snapshot currently stored in the segment
+		int32_t num_filaments;
+	};
+
+	static const char liveExchangeMagic[8] = { 'G', 'A', 'D', 'E', 'N', 'L', 'I', 'V' };
+
+	inline size_t liveWindOffset()
+	{
+		return (sizeof(LiveExchangeHeader) + 63) / 64 * 64;
+	}
+
+	inline size_t liveFarFieldOffset(uint64_t num_cells)
+	{
+		return liveWindOffset() + num_cells * 3 * sizeof(double);
+	}
+
+	inline size_t liveFilamentsOffset(uint64_t num_cells, uint64_t far_field_cells)
+	{
+		return liveFarFieldOffset(num_cells) + far_field_cells * sizeof(double);
+	}
+
+	class LiveExchangeWriter
+	{
+	public:
+		~LiveExchangeWriter()
+		{
+			close();
+		}
+
+		// Creates (or replaces) the segment. filament_capacity is the max number of filaments that can be published. far_field:
+		// whether there is room for the far field of the simulator
+		bool open(const std::string& segment_name, const ArchiveHeader& info, size_t filament_capacity, bool far_field = false)
+		{
+			using namespace boost::interprocess;
+			close();
+			try
+			{
+				uint64_t num_cells = (uint64_t)info.num_cells[0] * info.num_cells[1] * info.num_cells[2];
+				uint64_t far_field_cells = far_field ? num_cells : 0;
+				shared_memory_object::remove(segment_name.c_str());
+				shared_memory_object shm(create_only, segment_name.c_str(), read_write);
+				shm.truncate(liveFilamentsOffset(num_cells, far_field_cells) + filament_capacity * sizeof(LiveFilament));
+				region = mapped_region(shm, read_write);
+				name = segment_name;
+
+				header = new (region.get_address()) LiveExchangeHeader;
+				header->writer_id = (uint64_t)std::chrono::system_clock::now().time_since_epoch().count() ^ ((uint64_t)getpid() << 48);
+				header->info = info;
+				header->num_cells = num_cells;
+				header->far_field_cells = far_field_cells;
+				header->filament_capacity = filament_capacity;
+				header->sequence = 0;
+				header->sim_time = 0;
+				header->wind_idx = -1;
+				header->num_filaments = 0;
+				memcpy(header->magic, liveExchangeMagic, sizeof(liveExchangeMagic)); // last: readers check it before using the rest
+			}
+			catch (const interprocess_exception&)
+			{
+				header = nullptr;
+				return false;
+			}
+			return true;
+		}
+
+		bool is_open() const
+		{
+			return header != nullptr;
+		}
+
+		void close()
+		{
+			if (!header)
+				return;
+			boost::interprocess::shared_memory_object::remove(name.c_str());
+			region = boost::interprocess::mapped_region();
+			header = nullptr;
+		}
+
+		// Replaces the published state. The wind is only copied when wind_idx changes.
+		// Filament can be any type with the fields id, valid, pose_x, pose_y, pose_z and sigma. far_field: moles in every cell
+		// (null if the simulator has none). dropped: filaments that did not fit. The mutex is not robust (a reader that dies
+		// while holding it never releases it), so the wait is bounded: false if the lock could not be taken within timeout_ms,
+		// and this state is skipped
+		template <typename Filament>
+		bool publish(double sim_time, int wind_idx, const WindField& wind, const std::vector<Filament>& filaments,
+			const std::vector<Real>* far_field, size_t& dropped, int timeout_ms = 1)
+		{
+			dropped = 0;
+			char* base = (char*)region.get_address();
+			boost::interprocess::scoped_lock<boost::interprocess::interprocess_mutex> lock(header->mutex,
+				boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(timeout_ms));
+			if (!lock.owns())
+				return false;
+
+			if (wind_idx != header->wind_idx && wind.size() == header->num_cells)
+			{
+				double* values = (double*)(base + liveWindOffset());
+				wind.forEachCell([values](size_t i, const WindVector& vector) {
+					values[3 * i] = vector.u;
+					values[3 * i + 1] = vector.v;
+					values[3 * i + 2] = vector.w;
+				});
+				header->wind_idx = wind_idx;
+			}
+
+			if (far_field && far_field->size() == header->far_field_cells)
+				std::copy(far_field->begin(), far_field->end(), (double*)(base + liveFarFieldOffset(header->num_cells)));
+
+			LiveFilament* out = (LiveFilament*)(base + liveFilamentsOffset(header->num_cells, header->far_field_cells));
+			size_t count = 0;
+			for (const Filament& filament : filaments)
+			{
+				if (!filament.valid)
+					continue;
+				if (count == header->filament_capacity)
+				{
+					dropped++;
+					continue;
+				}
+				out[count++] = { filament.id, 0, filament.pose_x, filament.pose_y, filament.pose_z, filament.sigma };
+			}
+			header->num_filaments = count;
+			header->sim_time = sim_time;
+			header->sequence++;
+			return true;
+		}
+
+	private:
+		std::string name;
+		boost::interprocess::mapped_region region;
+		LiveExchangeHeader* header = nullptr;
+	};
+
+	class LiveExchangeReader
+	{
+	public:
+		// False if the segment does not exist (yet)
+		bool open(const std::string& segment_name)
+		{
+			using namespace boost::interprocess;
+			try
+			{
+				shared_memory_object shm(open_only, segment_name.c_str(), read_write); // the mutex needs write access
+				offset_t size = 0;
+				if (!shm.get_size(size) || (size_t)size < sizeof(LiveExchangeHeader))
+					return false;
+				region = mapped_region(shm, read_write);
+			}
+			catch (const interprocess_exception&)
+			{
+				return false;
+			}
+
+			header = (LiveExchangeHeader*)region.get_address();
+			if (memcmp(header->magic, liveExchangeMagic, sizeof(liveExchangeMagic)) != 0)
+			{
+				header = nullptr;
+				return false;
+			}
+			name = segment_name;
+			last_sequence = 0;
+			last_wind_idx = -1;
+			last_update = last_check = std::chrono::steady_clock::now();
+			return true;
+		}
+
+		// No new state for stall_seconds. The simulator might be slow, paused, finished, or replaced by a new one
+		bool stalled(double stall_seconds = 1) const
+		{
+			return std::chrono::steady_clock::now() - last_update > std::chrono::duration<double>(stall_seconds);
+		}
+
+		// If another segment was created under the same name since this one was opened (the simulator was started again),
+		// switches to it and returns true. Then its environment may be different (getInfo), and the next read copies the
+		// whole state. Checked at most once every check_seconds
+		bool reopen_if_replaced(double check_seconds = 1)
+		{
+			using namespace boost::interprocess;
+			auto now = std::chrono::steady_clock::now();
+			if (!header || now - last_check < std::chrono::duration<double>(check_seconds))
+				return false;
+			last_check = now;
+
+			uint64_t current_id;
+			try
+			{
+				shared_memory_object shm(open_only, name.c_str(), read_only);
+				offset_t size = 0;
+				if (!shm.get_size(size) || (size_t)size < sizeof(LiveExchangeHeader))
+					return false;
+				mapped_region current(shm, read_only, 0, sizeof(LiveExchangeHeader));
+				const LiveExchangeHeader* current_header = (const LiveExchangeHeader*)current.get_address();
+				if (memcmp(current_header->magic, liveExchangeMagic, sizeof(liveExchangeMagic)) != 0)
+					return false; // still being created
+				current_id = current_header->writer_id;
+			}
+			catch (const interprocess_exception&)
+			{
+				return false; // removed, and not created again (yet)
+			}
+			if (current_id == header->writer_id)
+				return false;
+
+			std::string segment_name = name;
+			region = mapped_region();
+			header = nullptr;
+			return open(segment_name);
+		}
+
+		bool is_open() const
+		{
+			return header != nullptr;
+		}
+
+		const ArchiveHeader& getInfo() const
+		{
+			return header->info;
+		}
+
+		// Copies the current state, if it changed since the last call (false otherwise, or if the simulator is holding the lock).
+		// wind is only written when its snapshot changed (wind_changed), and can be null if it is not needed. far_field gets
+		// the moles in every cell, or is left empty if the simulator has no far field
+		bool read(double& sim_time, int& wind_idx, std::vector<LiveFilament>& filaments, std::vector<double>& far_field, WindField* wind,
+			bool& wind_changed)
+		{
+			wind_changed = false;
+			const char* base = (const char*)region.get_address();
+			boost::interprocess::scoped_lock<boost::interprocess::interprocess_mutex> lock(header->mutex,
+				boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(100));
+			if (!lock.owns() || header->sequence == last_sequence)
+				return false;
+
+			if (wind && header->wind_idx != last_wind_idx && header->wind_idx >= 0)
+			{
+				const double* values = (const double*)(base + liveWindOffset());
+				const int32_t* num_cells = header->info.num_cells;
+				wind->build(Vector3i(num_cells[0], num_cells[1], num_cells[2]), [values](size_t i) {
+					WindVector vector;
+					vector.u = values[3 * i];
+					vector.v = values[3 * i + 1];
+					vector.w = values[3 * i + 2];
+					return vector;
+				});
+				last_wind_idx = header->wind_idx;
+				wind_changed = true;
+			}
+
+			const double* far_field_moles = (const double*)(base + liveFarFieldOffset(header->num_cells));
+			far_field.assign(far_field_moles, far_field_moles + header->far_field_cells);
+
+			const LiveFilament* in = (const LiveFilament*)(base + liveFilamentsOffset(header->num_cells, header->far_field_cells));
+			filaments.assign(in, in + header->num_filaments);
+			sim_time = header->sim_time;
+			wind_idx = header->wind_idx;
+			last_sequence = header->sequence;
+			last_update = std::chrono::steady_clock::now();
+			return true;
+		}
+
+	private:
+		std::string name;
+		boost::interprocess::mapped_region region;
+		LiveExchangeHeader* header = nullptr;
+		uint64_t last_sequence = 0;
+		int last_wind_idx = -1;
+		std::chrono::steady_clock::time_point last_update; // last read that got a new state
+		std::chrono::steady_clock::time_point last_check;  // of reopen_if_replaced
+	};
+}
@@ -0,0 +1,153 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <fstream>
+#include <stdint.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <omp.h>
+
+// Placement of the big arrays on NUMA machines, and pinning of the OpenMP threads.
+//
+// Everything is allocated and filled by the main thread, so by default all the pages end up in its node and the threads
+// of the other sockets read remote memory for the whole run. These move the pages of an existing array (mbind with
+// MPOL_MF_MOVE, through the raw system call so libnuma is not needed). interleavePages spreads them round-robin over all
+// the nodes, which suits data that every thread reads at any position: the grids, and also the filaments, which are
+// processed as tasks (no thread keeps the same share of them from one step to the next) and reordered by the Morton sort.
+// On machines with a single node it does nothing.
+
+namespace Gaden
+{
+	enum class MemoryPolicy
+	{
+		DEFAULT,    // leave the pages where they were first touched
+		INTERLEAVE  // round-robin over the nodes
+	};
+
+	enum class ThreadAffinity
+	{
+		NONE,  // leave it to the OpenMP runtime (OMP_PROC_BIND, OMP_PLACES)
+		CLOSE, // thread i on the i-th available CPU
+		SPREAD // threads evenly distributed over the available CPUs
+	};
+
+	// Linux constants (numaif.h)
+	static const int mpolInterleave = 3;
+	static const unsigned mpolMoveFlag = 1 << 1; // MPOL_MF_MOVE
+
+	// Nodes with memory, from sysfs (e.g. "0-1" or "0,2")
+	inline std::vector<int> numaNodes()
+	{
+		std::vector<int> nodes;
+		std::ifstream file("/sys/devices/system/node/has_memory");
+		std::string list;
+		if (!std::getline(file, list))
+			return nodes;
+
+		size_t pos = 0;
+		while (pos < list.size())
+		{
+			size_t end = list.find(',', pos);
+			if (end == std::string::npos)
+				end = list.size();
+			std::string range = list.substr(pos, end - pos);
+			size_t dash = range.find('-');
+			int first = atoi(range.c_str());
+			int last = dash == std::string::npos ? first : atoi(range.c_str() + dash + 1);
+			for (int node = first; node <= last; node++)
+				nodes.push_back(node);
+			pos = end + 1;
+		}
+		return nodes;
+	}
+
+	// Whole pages within [data, data + bytes)
+	inline bool pageRange(const void* data, size_t bytes, char*& begin, size_t& length)
+	{
+		uintptr_t page = sysconf(_SC_PAGESIZE);
+		uintptr_t first = ((uintptr_t)data + page - 1) / page * page;
+		uintptr_t last = ((uintptr_t)data + bytes) / page * page;
+		if (last <= first)
+			return false;
+		begin = (char*)first;
+		length = last - first;
+		return true;
+	}
+
+	inline bool bindPages(char* begin, size_t length, int mode, const std::vector<int>& nodes, unsigned flags)
+	{
+		const int max_node = 1024;
+		unsigned long mask[max_node / (8 * sizeof(unsigned long))] = { 0 };
+		for (int node : nodes)
+			if (node >= 0 && node < max_node)
+				mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+		return syscall(SYS_mbind, begin, length, mode, nodes.empty() ? nullptr : mask, nodes.empty() ? 0 : max_node, flags) == 0;
+	}
+
+	inline bool interleavePages(const void* data, size_t bytes)
+	{
+		std::vector<int> nodes = numaNodes();
+		char* begin;
+		size_t length;
+		if (nodes.size() < 2 || !pageRange(data, bytes, begin, length))
+			return false;
+		return bindPages(begin, length, mpolInterleave, nodes, mpolMoveFlag);
+	}
+
+	// Transparent huge pages for the range. The pages that already exist are collapsed right away if the kernel supports it
+	inline bool adviseHugePages(const void* data, size_t bytes)
+	{
+		char* begin;
+		size_t length;
+		if (!pageRange(data, bytes, begin, length))
+			return false;
+		bool ok = madvise(begin, length, MADV_HUGEPAGE) == 0;
+#ifdef MADV_COLLAPSE
+		madvise(begin, length, MADV_COLLAPSE); // best effort (Linux >= 6.1)
+#endif
+		return ok;
+	}
+
+	template <typename T>
+	inline void placeArray(const std::vector<T>& array, MemoryPolicy policy, bool huge_pages)
+	{
+		if (huge_pages)
+			adviseHugePages(array.data(), array.size() * sizeof(T));
+		if (policy == MemoryPolicy::INTERLEAVE)
+			interleavePages(array.data(), array.size() * sizeof(T));
+	}
+
+	// Pins every thread of the OpenMP team to one of the CPUs the process is allowed to use. Returns the number of threads pinned
+	inline int pinOpenMPThreads(ThreadAffinity affinity)
+	{
+		if (affinity == ThreadAffinity::NONE)
+			return 0;
+
+		cpu_set_t allowed;
+		if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+			return 0;
+		std::vector<int> cpus;
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+			if (CPU_ISSET(cpu, &allowed))
+				cpus.push_back(cpu);
+		if (cpus.empty())
+			return 0;
+
+		int pinned = 0;
+		#pragma omp parallel reduction(+ : pinned)
+		{
+			int thread = omp_get_thread_num();
+			int num_threads = omp_get_num_threads();
+			size_t slot = affinity == ThreadAffinity::CLOSE ? thread : (size_t)thread * cpus.size() / num_threads;
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cpus[slot % cpus.size()], &set);
+			if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0)
+				pinned++;
+		}
+		return pinned;
+	}
+}
@@ -5,6 +5,7 @@
 #include <fstream>
 #include <sstream>
 #include "Vector3.h"
+#include "ASCIIGrid.h"
 
 namespace Gaden
 {
@@ -19,7 +20,7 @@ namespace Gaden
 		std::vector<uint8_t> Env;
 	};
 
-	static int indexFrom3D(const Vector3i& index, const Vector3i& num_cells_env)
+	inline int indexFrom3D(const Vector3i& index, const Vector3i& num_cells_env)
 	{
 		return index.x + index.y * num_cells_env.x + index.z * num_cells_env.x * num_cells_env.y;
 	}
@@ -31,7 +32,7 @@ namespace Gaden
 		READING_FAILED
 	};
 
-	static ReadResult readEnvFile(const std::string& filePath, EnvironmentDescription& desc)
+	inline ReadResult readEnvFile(const std::string& filePath, EnvironmentDescription& desc)
 	{
 		if (filePath == "")
 			return ReadResult::NO_FILE;
@@ -81,47 +82,18 @@ namespace Gaden
 			desc.cell_size = atof(line.substr(pos + 1).c_str());
 		}
 
-		desc.Env.resize(desc.num_cells.x * desc.num_cells.y * desc.num_cells.z);
-
-		int x_idx = 0;
-		int y_idx = 0;
-		int z_idx = 0;
+		// the cells follow the header
+		std::streamoff body_offset = infile.tellg();
+		infile.close();
+		if (body_offset < 0)
+			return ReadResult::READING_FAILED;
 
-		while (std::getline(infile, line))
+		std::string error;
+		if (!readASCIIGrid(filePath, body_offset, desc.num_cells, desc.Env, error))
 		{
-			std::stringstream ss(line);
-			if (z_idx >= desc.num_cells.z)
-			{
-				printf("Too many lines! z_idx=%d but num_cells_z=%d", z_idx, desc.num_cells.z);
-				return ReadResult::READING_FAILED;
-			}
-
-			if (line == ";")
-			{
-				// New Z-layer
-				z_idx++;
-				x_idx = 0;
-				y_idx = 0;
-			}
-			else
-			{ // New line with constant x_idx and all the y_idx values
-				while (ss)
-				{
-					int f;
-					ss >> std::skipws >> f;
-					if (!ss.fail())
-					{
-						desc.Env[indexFrom3D(Vector3i(x_idx, y_idx, z_idx), desc.num_cells)] = f;
-						y_idx++;
-					}
-				}
-
-				// Line has ended
-				x_idx++;
-				y_idx = 0;
-			}
+			printf("Error reading %s: %s\n", filePath.c_str(), error.c_str());
+			return ReadResult::READING_FAILED;
 		}
-		infile.close();
 		return ReadResult::OK;
 	}
 
@@ -0,0 +1,13 @@
+#pragma once
+
+namespace Gaden
+{
+	// Floating point type of the wind and concentration grids and of the filaments.
+	// Single precision halves the memory traffic and is accurate enough for the usual cell sizes.
+	// Build with GADEN_SINGLE_PRECISION defined to use it (see the *_float targets). Files are always written in double.
+#ifdef GADEN_SINGLE_PRECISION
+	using Real = float;
+#else
+	using Real = double;
+#endif
+}
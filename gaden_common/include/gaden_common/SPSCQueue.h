@@ -0,0 +1,53 @@
+#pragma once
+#include <atomic>
+#include <vector>
+#include <stddef.h>
+
+namespace Gaden
+{
+	// Bounded lock-free queue for exactly one producer thread and one consumer thread.
+	// Neither side ever blocks: push fails when the queue is full, and pop fails when it is empty
+	template <typename T>
+	class SPSCQueue
+	{
+	public:
+		SPSCQueue(size_t capacity)
+			: buffer(capacity + 1)
+		{
+		}
+
+		bool push(T value)
+		{
+			size_t tail = tail_idx.load(std::memory_order_relaxed);
+			size_t next = (tail + 1) % buffer.size();
+			if (next == head_idx.load(std::memory_order_acquire))
+				return false;
+
+			buffer[tail] = std::move(value);
+			tail_idx.store(next, std::memory_order_release);
+			return true;
+		}
+
+		bool pop(T& value)
+		{
+			size_t head = head_idx.load(std::memory_order_relaxed);
+			if (head == tail_idx.load(std::memory_order_acquire))
+				return false;
+
+			value = std::move(buffer[head]);
+			buffer[head] = T();
+			head_idx.store((head + 1) % buffer.size(), std::memory_order_release);
+			return true;
+		}
+
+		bool full() const
+		{
+			return (tail_idx.load(std::memory_order_relaxed) + 1) % buffer.size() == head_idx.load(std::memory_order_acquire);
+		}
+
+	private:
+		std::vector<T> buffer;
+		alignas(64) std::atomic<size_t> head_idx{ 0 };
+		alignas(64) std::atomic<size_t> tail_idx{ 0 };
+	};
+}
@@ -0,0 +1,311 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <fstream>
+#include <sstream>
+#include <boost/iostreams/filter/zlib.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/copy.hpp>
+
+// Single-file storage for the results of a simulation (instead of one iteration_<n> file per save + the wind/ folder)
+//
+// Layout:
+//   "GADENARC" | version | ArchiveHeader                        (written once)
+//   ChunkHeader | zlib data                                     (one per saved iteration, wind snapshot, far field or metadata, appended)
+//   ArchiveIndexEntry[num_entries] | index_offset | num_entries | "GADENIDX"   (written when the archive is closed)
+//
+// The trailing index allows seeking directly to any iteration. If it is missing (the simulation is still running,
+// or it crashed) the reader rebuilds it by walking the chunk headers.
+
+namespace Gaden
+{
+	struct ArchiveHeader
+	{
+		double min_coord[3];
+		double max_coord[3];
+		int32_t num_cells[3];
+		int32_t gas_type;
+		double cell_size;
+		double source_position[3];
+		double filament_moles_of_gas;    // constants to work out the gas concentration from the filaments
+		double num_moles_all_gases_in_cm3;
+	};
+
+	enum ChunkType : int32_t
+	{
+		ITERATION = 1, // filaments: (int id, double x, y, z, sigma) for every active filament
+		WIND = 2,      // wind snapshot: U, V and W arrays of doubles
+		METADATA = 3,  // text describing how the results were produced (e.g. output filters)
+		FAR_FIELD = 4  // far field grid of an iteration (see filament_simulator/far_field.h), written before the iteration
+	};
+
+	struct ChunkHeader
+	{
+		int32_t type;
+		int32_t id;            // iteration number, or wind snapshot index
+		double sim_time;       //(sec)
+		int32_t wind_idx;      // wind snapshot active at this iteration
+		int32_t num_filaments;
+		double bbox_min[3];    // bounding box of the active filaments [m]
+		double bbox_max[3];
+		uint64_t data_size;    // size of the compressed data following this header
+	};
+	static_assert(sizeof(ChunkHeader) == 80, "ChunkHeader must not contain padding");
+
+	struct ArchiveIndexEntry
+	{
+		ChunkHeader header;
+		uint64_t offset; // position of the chunk header in the file
+	};
+
+	static const char archiveMagic[8] = { 'G', 'A', 'D', 'E', 'N', 'A', 'R', 'C' };
+	static const char archiveIndexMagic[8] = { 'G', 'A', 'D', 'E', 'N', 'I', 'D', 'X' };
+	static const int32_t archiveVersion = 1;
+
+	inline std::string zlibCompress(const std::string& data)
+	{
+		std::stringstream input(data), output;
+		boost::iostreams::filtering_streambuf<boost::iostreams::input> inbuf;
+		inbuf.push(boost::iostreams::zlib_compressor());
+		inbuf.push(input);
+		boost::iostreams::copy(inbuf, output);
+		return output.str();
+	}
+
+	inline void zlibDecompress(const std::string& data, std::stringstream& output)
+	{
+		std::stringstream input(data);
+		boost::iostreams::filtering_streambuf<boost::iostreams::input> inbuf;
+		inbuf.push(boost::iostreams::zlib_decompressor());
+		inbuf.push(input);
+		boost::iostreams::copy(inbuf, output);
+	}
+
+	// Append-only writer. Chunks can be appended from several threads
+	class ArchiveWriter
+	{
+	public:
+		~ArchiveWriter()
+		{
+			close();
+		}
+
+		bool open(const std::string& path, const ArchiveHeader& header)
+		{
+			file.open(path, std::ios_base::binary | std::ios_base::trunc);
+			if (!file.is_open())
+				return false;
+			file.write(archiveMagic, sizeof(archiveMagic));
+			file.write((char*)&archiveVersion, sizeof(int32_t));
+			file.write((char*)&header, sizeof(ArchiveHeader));
+			return file.good();
+		}
+
+		bool is_open() const
+		{
+			return file.is_open();
+		}
+
+		// data is the uncompressed content of the chunk. header.data_size is filled in here
+		void append(ChunkHeader header, const std::string& data)
+		{
+			std::string compressed = zlibCompress(data);
+			header.data_size = compressed.size();
+
+			std::lock_guard<std::mutex> lock(mtx);
+			ArchiveIndexEntry entry;
+			entry.header = header;
+			entry.offset = file.tellp();
+			file.write((char*)&header, sizeof(ChunkHeader));
+			file.write(compressed.data(), compressed.size());
+			file.flush();
+			index.push_back(entry);
+		}
+
+		// Writes the index. Without it the archive is still readable, but has to be scanned
+		void close()
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			if (!file.is_open())
+				return;
+			uint64_t index_offset = file.tellp();
+			uint64_t num_entries = index.size();
+			file.write((char*)index.data(), sizeof(ArchiveIndexEntry) * index.size());
+			file.write((char*)&index_offset, sizeof(uint64_t));
+			file.write((char*)&num_entries, sizeof(uint64_t));
+			file.write(archiveIndexMagic, sizeof(archiveIndexMagic));
+			file.close();
+		}
+
+	private:
+		std::ofstream file;
+		std::mutex mtx;
+		std::vector<ArchiveIndexEntry> index;
+	};
+
+	class ArchiveReader
+	{
+	public:
+		bool open(const std::string& path)
+		{
+			file.open(path, std::ios_base::binary);
+			if (!file.is_open())
+				return false;
+
+			char magic[8];
+			int32_t version;
+			file.read(magic, sizeof(magic));
+			file.read((char*)&version, sizeof(int32_t));
+			file.read((char*)&header, sizeof(ArchiveHeader));
+			if (!file || memcmp(magic, archiveMagic, sizeof(magic)) != 0 || version != archiveVersion)
+				return false;
+			data_start = file.tellg();
+
+			if (!readIndex())
+				scanChunks();
+			return true;
+		}
+
+		const ArchiveHeader& getHeader() const
+		{
+			return header;
+		}
+
+		// Iteration number -> index entry
+		const std::map<int, ArchiveIndexEntry>& getIterations() const
+		{
+			return iterations;
+		}
+
+		bool readIteration(int iteration, ChunkHeader& chunk, std::stringstream& data)
+		{
+			auto it = iterations.find(iteration);
+			if (it == iterations.end())
+				return false;
+			chunk = it->second.header;
+			return readChunk(it->second, data);
+		}
+
+		// The metadata can be rewritten while simulating (appended again): the last chunk holds
+		bool readMetadata(std::string& text)
+		{
+			auto it = metadata.find(0);
+			if (it == metadata.end())
+				return false;
+			std::stringstream data;
+			if (!readChunk(it->second, data))
+				return false;
+			text = data.str();
+			return true;
+		}
+
+		bool readWind(int wind_idx, std::stringstream& data)
+		{
+			auto it = winds.find(wind_idx);
+			if (it == winds.end())
+				return false;
+			return readChunk(it->second, data);
+		}
+
+		// False if the iteration has no far field
+		bool readFarField(int iteration, std::stringstream& data)
+		{
+			auto it = far_fields.find(iteration);
+			if (it == far_fields.end())
+				return false;
+			return readChunk(it->second, data);
+		}
+
+		// The archive might still be growing (simulation in progress). Look for new chunks
+		void refresh()
+		{
+			if (!complete)
+				scanChunks();
+		}
+
+	private:
+		std::ifstream file;
+		ArchiveHeader header;
+		uint64_t data_start;
+		bool complete = false;
+		std::map<int, ArchiveIndexEntry> iterations;
+		std::map<int, ArchiveIndexEntry> winds;
+		std::map<int, ArchiveIndexEntry> metadata;
+		std::map<int, ArchiveIndexEntry> far_fields;
+
+		void addEntry(const ArchiveIndexEntry& entry)
+		{
+			if (entry.header.type == ChunkType::ITERATION)
+				iterations[entry.header.id] = entry;
+			else if (entry.header.type == ChunkType::WIND)
+				winds[entry.header.id] = entry;
+			else if (entry.header.type == ChunkType::METADATA)
+				metadata[entry.header.id] = entry;
+			else if (entry.header.type == ChunkType::FAR_FIELD)
+				far_fields[entry.header.id] = entry;
+		}
+
+		bool readIndex()
+		{
+			char magic[8];
+			uint64_t index_offset, num_entries;
+			file.clear();
+			file.seekg(-(std::streamoff)(2 * sizeof(uint64_t) + sizeof(magic)), std::ios_base::end);
+			file.read((char*)&index_offset, sizeof(uint64_t));
+			file.read((char*)&num_entries, sizeof(uint64_t));
+			file.read(magic, sizeof(magic));
+			if (!file || memcmp(magic, archiveIndexMagic, sizeof(magic)) != 0)
+				return false;
+
+			std::vector<ArchiveIndexEntry> index(num_entries);
+			file.seekg(index_offset);
+			file.read((char*)index.data(), sizeof(ArchiveIndexEntry) * num_entries);
+			if (!file)
+				return false;
+			for (const ArchiveIndexEntry& entry : index)
+				addEntry(entry);
+			complete = true;
+			return true;
+		}
+
+		void scanChunks()
+		{
+			file.clear();
+			file.seekg(0, std::ios_base::end);
+			uint64_t file_size = file.tellg();
+
+			uint64_t offset = data_start;
+			while (offset + sizeof(ChunkHeader) <= file_size)
+			{
+				ArchiveIndexEntry entry;
+				entry.offset = offset;
+				file.seekg(offset);
+				file.read((char*)&entry.header, sizeof(ChunkHeader));
+				if (!file || entry.header.type < ChunkType::ITERATION || entry.header.type > ChunkType::FAR_FIELD)
+					break;
+				uint64_t next = offset + sizeof(ChunkHeader) + entry.header.data_size;
+				if (next > file_size) // chunk still being written
+					break;
+				addEntry(entry);
+				offset = next;
+			}
+			data_start = offset; // continue from here on the next refresh
+		}
+
+		bool readChunk(const ArchiveIndexEntry& entry, std::stringstream& data)
+		{
+			std::string compressed(entry.header.data_size, '\0');
+			file.clear();
+			file.seekg(entry.offset + sizeof(ChunkHeader));
+			file.read(&compressed[0], compressed.size());
+			if (!file)
+				return false;
+			zlibDecompress(compressed, data);
+			return true;
+		}
+	};
+}
@@ -0,0 +1,275 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <stddef.h>
+#include <stdint.h>
+#include <omp.h>
+#include "Real.h"
+#include "Vector3.h"
+#include "MemoryPlacement.h"
+
+namespace Gaden
+{
+	// Wind vector of a cell.
+	// The three components are stored together and padded to 4 components (32 bytes, or 16 in single precision),
+	// so every lookup touches a single cache line (instead of one line per component with separate U, V, W arrays)
+	struct alignas(4 * sizeof(Real)) WindVector
+	{
+		Real u = 0;
+		Real v = 0;
+		Real w = 0;
+		Real padding = 0;
+	};
+
+	inline Real WindVector::*windComponent(int axis)
+	{
+		return axis == 0 ? &WindVector::u : (axis == 1 ? &WindVector::v : &WindVector::w);
+	}
+
+	// Wind of every cell of the environment, stored in bricks of 8x8x8 cells.
+	// Most of the bounding box of a building is obstacles or outside air with no wind, so the bricks where every cell
+	// has the same vector (zero, almost always) are not stored: the index keeps that vector instead. Lookups stay O(1)
+	// (one read of the index, then the cell), and the memory scales with the volume where the wind changes.
+	// The files (and the WIND chunks of the archives) keep the dense layout, one array per component (see build and
+	// getComponent), so their size and the time to read them still scale with the whole grid.
+	class WindField
+	{
+	public:
+		static const int brickBits = 3;
+		static const int brickSize = 1 << brickBits; // cells per side
+		static const int brickCells = brickSize * brickSize * brickSize;
+
+		// Every cell to zero
+		void configure(const Vector3i& num_cells)
+		{
+			build(num_cells, [](size_t) { return WindVector(); });
+		}
+
+		// cellValue(i) gives the vector of the cell with index i = x + y * num_cells.x + z * num_cells.x * num_cells.y
+		template <typename F>
+		void build(const Vector3i& num_cells, F cellValue)
+		{
+			cells_per_axis = num_cells;
+			bricks_per_axis = Vector3i((num_cells.x + brickSize - 1) >> brickBits, (num_cells.y + brickSize - 1) >> brickBits,
+				(num_cells.z + brickSize - 1) >> brickBits);
+			size_t num_bricks = (size_t)bricks_per_axis.x * bricks_per_axis.y * bricks_per_axis.z;
+
+			// 1. Find the uniform bricks (and the value of their cells)
+			std::vector<WindVector> brick_value(num_bricks);
+			std::vector<char> brick_uniform(num_bricks);
+			forEachBrick(num_bricks, [&](size_t b) {
+				bool uniform = true;
+				bool first = true;
+				forEachCellOfBrick(b, [&](int x, int y, int z, size_t) {
+					WindVector value = cellValue(cellIndex(x, y, z));
+					if (first)
+						brick_value[b] = value;
+					else if (uniform)
+						uniform = value.u == brick_value[b].u && value.v == brick_value[b].v && value.w == brick_value[b].w;
+					first = false;
+				});
+				brick_uniform[b] = uniform;
+			});
+
+			// 2. Index. The uniform value 0 is always the zero vector
+			index.resize(num_bricks);
+			uniform_values.assign(1, WindVector());
+			uint32_t stored = 0;
+			for (size_t b = 0; b < num_bricks; b++)
+			{
+				if (!brick_uniform[b])
+					index[b] = stored++;
+				else if (brick_value[b].u == 0 && brick_value[b].v == 0 && brick_value[b].w == 0)
+					index[b] = uniformBrick;
+				else
+				{
+					index[b] = uniformBrick | (uint32_t)uniform_values.size();
+					uniform_values.push_back(brick_value[b]);
+				}
+			}
+
+			// 3. Cells of the stored bricks (the ones outside the environment stay zero)
+			cells.assign((size_t)stored * brickCells, WindVector());
+			forEachBrick(num_bricks, [&](size_t b) {
+				if (index[b] & uniformBrick)
+					return;
+				WindVector* brick = &cells[(size_t)index[b] * brickCells];
+				forEachCellOfBrick(b, [&](int x, int y, int z, size_t offset) { brick[offset] = cellValue(cellIndex(x, y, z)); });
+			});
+			place();
+		}
+
+		// From the three components as dense arrays (the layout of the files)
+		void buildFromComponents(const Vector3i& num_cells, const std::vector<double> components[3])
+		{
+			build(num_cells, [components](size_t i) {
+				WindVector vector;
+				vector.u = components[0][i];
+				vector.v = components[1][i];
+				vector.w = components[2][i];
+				return vector;
+			});
+		}
+
+		// Copy of other that keeps the placement of this field. The storage is reused when it is large enough
+		void assign(const WindField& other)
+		{
+			cells_per_axis = other.cells_per_axis;
+			bricks_per_axis = other.bricks_per_axis;
+			index = other.index;
+			cells = other.cells;
+			uniform_values = other.uniform_values;
+			place();
+		}
+
+		// NUMA policy and huge pages for the stored bricks (see MemoryPlacement.h). Every snapshot of the wind is written to
+		// the same storage, which only moves when a snapshot needs more bricks than the ones before: build and assign apply
+		// the placement again then
+		void setPlacement(MemoryPolicy policy, bool huge_pages)
+		{
+			placement = policy;
+			placement_huge_pages = huge_pages;
+			placed_data = nullptr;
+			place();
+		}
+
+		const WindVector& at(int x, int y, int z) const
+		{
+			uint32_t entry = index[brickIndex(x, y, z)];
+			if (entry & uniformBrick)
+				return uniform_values[entry & ~uniformBrick];
+			return cells[(size_t)entry * brickCells + cellOffset(x, y, z)];
+		}
+
+		// For writing single cells. A brick that was not stored is expanded first
+		WindVector& mutableAt(int x, int y, int z)
+		{
+			uint32_t& entry = index[brickIndex(x, y, z)];
+			if (entry & uniformBrick)
+			{
+				WindVector value = uniform_values[entry & ~uniformBrick];
+				entry = cells.size() / brickCells;
+				cells.resize(cells.size() + brickCells, value);
+			}
+			return cells[(size_t)entry * brickCells + cellOffset(x, y, z)];
+		}
+
+		// Number of cells
+		size_t size() const
+		{
+			return (size_t)cells_per_axis.x * cells_per_axis.y * cells_per_axis.z;
+		}
+
+		size_t numBricks() const
+		{
+			return index.size();
+		}
+
+		size_t numStoredBricks() const
+		{
+			return cells.size() / brickCells;
+		}
+
+		// Bytes in use (compare with size() * sizeof(WindVector) for the dense grid)
+		size_t memoryBytes() const
+		{
+			return cells.size() * sizeof(WindVector) + index.size() * sizeof(uint32_t) + uniform_values.size() * sizeof(WindVector);
+		}
+
+		// The cells of the stored bricks (see MemoryPlacement.h)
+		const std::vector<WindVector>& storage() const
+		{
+			return cells;
+		}
+
+		// f(i, vector) for every cell, in the order of the cell index i
+		template <typename F>
+		void forEachCell(F f) const
+		{
+			size_t i = 0;
+			for (int z = 0; z < cells_per_axis.z; z++)
+				for (int y = 0; y < cells_per_axis.y; y++)
+					for (int x = 0; x < cells_per_axis.x; x++)
+						f(i++, at(x, y, z));
+		}
+
+		// One component as a dense array (the layout of the files)
+		void getComponent(std::vector<double>& component, int axis) const
+		{
+			Real WindVector::*member = windComponent(axis);
+			component.resize(size());
+			forEachCell([&](size_t i, const WindVector& vector) { component[i] = vector.*member; });
+		}
+
+	private:
+		static const uint32_t uniformBrick = 0x80000000u; // flag of the index entries that hold a position in uniform_values
+
+		Vector3i cells_per_axis = Vector3i(0, 0, 0);
+		Vector3i bricks_per_axis = Vector3i(0, 0, 0);
+		std::vector<uint32_t> index;            // per brick: position in cells (in bricks), or uniformBrick | position in uniform_values
+		std::vector<WindVector> cells;          // the stored bricks, brickCells each (x fastest, then y, then z)
+		std::vector<WindVector> uniform_values; // the vector of the cells of each uniform brick
+
+		MemoryPolicy placement = MemoryPolicy::DEFAULT;
+		bool placement_huge_pages = false;
+		const WindVector* placed_data = nullptr; // storage the placement was last applied to
+		size_t placed_size = 0;
+
+		void place()
+		{
+			if ((placement == MemoryPolicy::DEFAULT && !placement_huge_pages) || (cells.data() == placed_data && cells.size() == placed_size))
+				return;
+			placeArray(cells, placement, placement_huge_pages);
+			placed_data = cells.data();
+			placed_size = cells.size();
+		}
+
+		size_t cellIndex(int x, int y, int z) const
+		{
+			return x + (size_t)y * cells_per_axis.x + (size_t)z * cells_per_axis.x * cells_per_axis.y;
+		}
+
+		size_t brickIndex(int x, int y, int z) const
+		{
+			return (x >> brickBits) + (size_t)(y >> brickBits) * bricks_per_axis.x + (size_t)(z >> brickBits) * bricks_per_axis.x * bricks_per_axis.y;
+		}
+
+		static size_t cellOffset(int x, int y, int z)
+		{
+			const int mask = brickSize - 1;
+			return (x & mask) + ((y & mask) << brickBits) + ((z & mask) << (2 * brickBits));
+		}
+
+		// f(x, y, z, offset in the brick) for the cells of brick b that are inside the environment
+		template <typename F>
+		void forEachCellOfBrick(size_t b, F f) const
+		{
+			int bx = b % bricks_per_axis.x;
+			int by = (b / bricks_per_axis.x) % bricks_per_axis.y;
+			int bz = b / ((size_t)bricks_per_axis.x * bricks_per_axis.y);
+			for (int z = bz * brickSize; z < std::min((bz + 1) * brickSize, cells_per_axis.z); z++)
+				for (int y = by * brickSize; y < std::min((by + 1) * brickSize, cells_per_axis.y); y++)
+					for (int x = bx * brickSize; x < std::min((bx + 1) * brickSize, cells_per_axis.x); x++)
+						f(x, y, z, cellOffset(x, y, z));
+		}
+
+		// f(b) for every brick, in parallel. From within a parallel region (the simulator loads the wind snapshots in its
+		// step loop, where a nested parallel for would get a single thread) the bricks are split as tasks of the team
+		template <typename F>
+		static void forEachBrick(size_t num_bricks, F f)
+		{
+			if (omp_in_parallel())
+			{
+				#pragma omp taskloop grainsize(16)
+				for (size_t b = 0; b < num_bricks; b++)
+					f(b);
+			}
+			else
+			{
+				#pragma omp parallel for schedule(dynamic, 16)
+				for (size_t b = 0; b < num_bricks; b++)
+					f(b);
+			}
+		}
+	};
+}
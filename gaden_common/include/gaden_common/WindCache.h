@@ -0,0 +1,79 @@
+#pragma once
+#include <list>
+#include <unordered_map>
+#include "Wind.h"
+
+namespace Gaden
+{
+	// In-memory cache of decoded wind snapshots, indexed by snapshot number.
+	// Used when the wind sequence is looped, so each snapshot is read from disk only once.
+	// When the memory budget is exceeded, the least recently used snapshots are evicted.
+	class WindCache
+	{
+	public:
+		WindCache(size_t budget_bytes = 0)
+			: budget(budget_bytes)
+		{
+		}
+
+		void setBudget(size_t budget_bytes)
+		{
+			budget = budget_bytes;
+			evict();
+		}
+
+		bool enabled() const
+		{
+			return budget > 0;
+		}
+
+		// Copy the cached snapshot to wind (keeping its storage and placement). Returns false if it is not in the cache
+		bool get(int idx, WindField& wind)
+		{
+			auto it = entries.find(idx);
+			if (it == entries.end())
+			{
+				misses++;
+				return false;
+			}
+
+			// mark as most recently used
+			lru.splice(lru.begin(), lru, it->second.second);
+			wind.assign(it->second.first);
+			hits++;
+			return true;
+		}
+
+		void put(int idx, const WindField& wind)
+		{
+			size_t size = wind.memoryBytes();
+			if (size > budget || entries.count(idx) > 0)
+				return;
+
+			lru.push_front(idx);
+			entries.emplace(idx, std::make_pair(wind, lru.begin()));
+			used += size;
+			evict();
+		}
+
+		size_t hits = 0;
+		size_t misses = 0;
+
+	private:
+		size_t budget;
+		size_t used = 0;
+		std::list<int> lru; // most recently used first
+		std::unordered_map<int, std::pair<WindField, std::list<int>::iterator>> entries;
+
+		void evict()
+		{
+			while (used > budget && !lru.empty())
+			{
+				auto it = entries.find(lru.back());
+				used -= it->second.first.memoryBytes();
+				entries.erase(it);
+				lru.pop_back();
+			}
+		}
+	};
+}
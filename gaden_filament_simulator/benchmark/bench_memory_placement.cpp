@@ -0,0 +1,157 @@
+/*---------------------------------------------------------------------------------------
+ * Benchmark of the memory placement settings of the simulator (memory_policy, huge_pages,
+ * thread_affinity; see gaden_common/MemoryPlacement.h) on the advection step.
+ *
+ * Every filament is moved with the kernel of update_filaments_location (advectFilament, see
+ * filament_simulator/filament_kernels.h): it reads the wind of its cell through the same
+ * environment model as the simulator, the occupancy of its new cell, moves and grows. It runs
+ * as a taskloop inside the parallel region, as in the simulator. The arrays are allocated and
+ * filled by the main thread and then placed, as configure_memory does, and the wind is written
+ * again with a new snapshot after the placement (so the placement of WindField::build is
+ * measured too). The grid and the wind are synthetic, so no scenario files are needed.
+ *
+ *   bench_memory_placement [--cells X Y Z] [--filaments N] [--steps S] [--affinity none|close|spread]
+ *
+ * Prints the time per step of every combination of memory_policy and huge_pages. Run it with
+ * OMP_NUM_THREADS set to the cores of all the sockets to be compared. On a machine with a single
+ * NUMA node (where it was developed) memory_policy changes nothing, and only huge_pages and
+ * thread_affinity can be compared.
+ ---------------------------------------------------------------------------------------*/
+
+#include <gaden_common/Wind.h>
+#include <gaden_common/ReadEnvironment.h>
+#include <gaden_common/MemoryPlacement.h>
+#include "filament_simulator/filament_kernels.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <random>
+#include <omp.h>
+
+struct Settings
+{
+	Gaden::Vector3i cells = Gaden::Vector3i(256, 256, 128);
+	double cell_size = 0.1;
+	int filaments = 1000000;
+	int steps = 50;
+	Gaden::ThreadAffinity affinity = Gaden::ThreadAffinity::NONE;
+};
+
+// Wind of a snapshot: a sheared flow that changes with the snapshot
+static Gaden::WindVector windOfCell(const Settings& settings, size_t i, int snapshot)
+{
+	int x = i % settings.cells.x;
+	int y = (i / settings.cells.x) % settings.cells.y;
+	int z = i / ((size_t)settings.cells.x * settings.cells.y);
+	Gaden::WindVector wind;
+	wind.u = 0.5 + 0.2 * sin(0.05 * y + 0.1 * snapshot);
+	wind.v = 0.2 * cos(0.03 * x + 0.1 * snapshot);
+	wind.w = 0.02 * sin(0.1 * z);
+	return wind;
+}
+
+// ms per step
+static double run(const Settings& settings, Gaden::MemoryPolicy policy, bool huge_pages)
+{
+	const Gaden::Vector3i& n = settings.cells;
+	const double h = settings.cell_size;
+
+	Gaden::EnvironmentDescription env;
+	env.num_cells = n;
+	env.cell_size = h;
+	env.min_coord = Gaden::Vector3(0, 0, 0);
+	env.max_coord = Gaden::Vector3(n.x * h, n.y * h, n.z * h);
+	env.Env.assign((size_t)n.x * n.y * n.z, 0);
+	for (size_t i = 0; i < env.Env.size(); i += 97)
+		env.Env[i] = 1; // scattered obstacles
+
+	std::mt19937 generator(1);
+	std::uniform_real_distribution<double> unit(0.05, 0.95);
+	std::vector<CFilament> filaments(settings.filaments);
+	for (CFilament& filament : filaments)
+		filament.activate_filament(unit(generator) * n.x * h, unit(generator) * n.y * h, unit(generator) * n.z * h, 0);
+
+	// As configure_memory
+	Gaden::WindField wind;
+	wind.configure(n);
+	wind.setPlacement(policy, huge_pages);
+	wind.build(n, [&](size_t i) { return windOfCell(settings, i, 0); });
+	Gaden::placeArray(env.Env, policy, huge_pages);
+	Gaden::placeArray(filaments, policy, huge_pages);
+
+	std::vector<RefinementLevel> levels;
+	CEnvironmentModel environment;
+	environment.configure(env, wind, levels);
+
+	const double time_step = 0.1;
+	double elapsed = 0;
+	#pragma omp parallel
+	#pragma omp single
+	{
+		for (int step = -5; step < settings.steps; step++) // 5 steps of warm up
+		{
+			if (step == settings.steps / 2)
+				wind.build(n, [&](size_t i) { return windOfCell(settings, i, 1); }); // next wind snapshot
+
+			AdvectionParameters parameters{ time_step, 0, 0, 25, 10, 1, 0, step + 5 };
+			double sim_time = (step + 5) * time_step;
+			double start = omp_get_wtime();
+			#pragma omp taskloop
+			for (size_t f = 0; f < filaments.size(); f++)
+			{
+				if (filaments[f].valid)
+					advectFilament<false, false>(filaments[f], sim_time, parameters, environment);
+			}
+			if (step >= 0)
+				elapsed += omp_get_wtime() - start;
+		}
+	}
+	return 1000 * elapsed / settings.steps;
+}
+
+int main(int argc, char** argv)
+{
+	Settings settings;
+	for (int a = 1; a < argc; a++)
+	{
+		if (!strcmp(argv[a], "--cells") && a + 3 < argc)
+		{
+			settings.cells = Gaden::Vector3i(atoi(argv[a + 1]), atoi(argv[a + 2]), atoi(argv[a + 3]));
+			a += 3;
+		}
+		else if (!strcmp(argv[a], "--filaments") && a + 1 < argc)
+			settings.filaments = atoi(argv[++a]);
+		else if (!strcmp(argv[a], "--steps") && a + 1 < argc)
+			settings.steps = std::max(atoi(argv[++a]), 1);
+		else if (!strcmp(argv[a], "--affinity") && a + 1 < argc)
+		{
+			a++;
+			if (!strcmp(argv[a], "close"))
+				settings.affinity = Gaden::ThreadAffinity::CLOSE;
+			else if (!strcmp(argv[a], "spread"))
+				settings.affinity = Gaden::ThreadAffinity::SPREAD;
+		}
+		else
+		{
+			fprintf(stderr, "Usage: %s [--cells X Y Z] [--filaments N] [--steps S] [--affinity none|close|spread]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	int pinned = Gaden::pinOpenMPThreads(settings.affinity);
+	printf("%d x %d x %d cells, %d filaments, %d steps. %d threads (%d pinned), %zu NUMA nodes\n", settings.cells.x, settings.cells.y,
+		settings.cells.z, settings.filaments, settings.steps, omp_get_max_threads(), pinned, Gaden::numaNodes().size());
+	if (Gaden::numaNodes().size() < 2)
+		printf("Single NUMA node: memory_policy has no effect on this machine\n");
+
+	const char* names[] = { "default", "interleave" };
+	const Gaden::MemoryPolicy policies[] = { Gaden::MemoryPolicy::DEFAULT, Gaden::MemoryPolicy::INTERLEAVE };
+	printf("%-12s %-11s %s\n", "memory", "huge_pages", "ms per step");
+	for (int p = 0; p < 2; p++)
+	{
+		for (bool huge_pages : { false, true })
+			printf("%-12s %-11s %.3f\n", names[p], huge_pages ? "true" : "false", run(settings, policies[p], huge_pages));
+	}
+	return 0;
+}
@@ -0,0 +1,45 @@
+#ifndef CONCENTRATION_MAPS_H
+#define CONCENTRATION_MAPS_H
+
+#include <string>
+#include <vector>
+#include <gaden_common/ReadEnvironment.h>
+#include <gaden_common/Real.h>
+
+// Running statistics of the concentration over time, kept while the simulation runs:
+// time-averaged concentration, peak concentration and time above a threshold, for every cell of a grid covering
+// the environment (possibly coarser than the environment, to keep the cost low)
+class CConcentrationMaps
+{
+public:
+	CConcentrationMaps();
+
+	// cell_size <= 0 uses the cells of the environment. A coarse cell is free if any of its environment cells is free
+	void configure(const Gaden::EnvironmentDescription& env, double cell_size, double threshold_ppm, double num_moles_all_gases_in_cm3);
+
+	// Add the concentration given by the filaments and the far field (moles in each cell of the environment, the far field
+	// empty if there is none), held during dt seconds
+	void update(const std::vector<Gaden::Real>& filaments, const std::vector<double>& far_field, double dt, double sim_time);
+
+	// File (zlib compressed):
+	//   int format(1) | double sim_time | double accumulated_time | int num_cells[3] | double min_coord[3] | double cell_size |
+	//   double threshold_ppm | double mean[N] | double max[N] | double time_above_threshold[N]
+	// Concentrations in ppm, times in seconds. Written to a temporary file first, so readers never see a partial file
+	bool save(const std::string& filename) const;
+
+private:
+	Gaden::EnvironmentDescription grid;
+	Gaden::Vector3i env_cells; // of the environment
+	int factor;                // environment cells per map cell (on each axis)
+	double threshold;
+	double moles_all_gases_in_cell;
+	double accumulated_time;
+	double last_time;
+
+	std::vector<double> moles; // of the last update, in each cell of the maps
+	std::vector<double> integral; // ppm * s
+	std::vector<double> peak;
+	std::vector<double> time_above;
+};
+
+#endif
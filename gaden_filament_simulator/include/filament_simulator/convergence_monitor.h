@@ -0,0 +1,48 @@
+#ifndef CONVERGENCE_MONITOR_H
+#define CONVERGENCE_MONITOR_H
+
+#include <string>
+#include <vector>
+
+// Detection of a statistically steady plume. Each monitored quantity (gas mass, centroid, probes...) is averaged over
+// consecutive windows of the same length, and the plume is steady once the means of the last window are within the tolerance
+// of the ones of the window before, for every quantity. Averaging over the window filters out the turbulent fluctuations,
+// while a plume that is still growing or drifting keeps changing from one window to the next.
+// The change of a quantity is measured against its scale: the larger of its window means and its floor for the relative
+// quantities, only the floor for the others (positions, whose magnitude depends on where the origin is)
+class CConvergenceMonitor
+{
+public:
+	CConvergenceMonitor();
+
+	// window (sec) <= 0 disables the monitor. relative: one per quantity (see above)
+	void configure(double window, double tolerance, const std::vector<std::string>& names, const std::vector<bool>& relative);
+	bool enabled() const;
+
+	// values and floors: one per quantity, in the order given to configure. True when the plume has just become steady
+	bool add(double sim_time, const std::vector<double>& values, const std::vector<double>& floors);
+
+	bool converged() const;
+	double convergence_time() const; //(sec) end of the first window that matched the one before (-1 if not converged)
+
+	// Quantity that changed the most between the last two complete windows, and its change relative to its scale
+	const std::string& worst_quantity() const;
+	double worst_change() const;
+
+private:
+	double window;
+	double tolerance;
+	std::vector<std::string> names;
+	std::vector<bool> relative;
+
+	double window_start; //(sec) -1 before the first sample
+	int samples;         // in the current window
+	std::vector<double> sum, floor_sum;
+	std::vector<double> previous_mean, previous_floor; // of the last complete window (empty if there is none)
+
+	double steady_time;
+	int worst;
+	double worst_relative_change;
+};
+
+#endif
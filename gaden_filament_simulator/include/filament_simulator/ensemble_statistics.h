@@ -0,0 +1,33 @@
+#ifndef ENSEMBLE_STATISTICS_H
+#define ENSEMBLE_STATISTICS_H
+
+#include <string>
+#include <vector>
+#include <gaden_common/ReadEnvironment.h>
+#include <gaden_common/Real.h>
+
+// Per-cell statistics of the concentration over the realizations of an ensemble, at a given time.
+// The members are added one at a time (Welford's algorithm), so the grids of all members are never kept in memory.
+class CEnsembleStatistics
+{
+public:
+	CEnsembleStatistics(size_t num_cells, double exceedance_threshold_ppm);
+
+	// concentration[ppm] of every cell, for one realization
+	void add_member(const std::vector<Gaden::Real>& concentration);
+
+	// File (zlib compressed):
+	//   int format(1) | double sim_time | int num_members | int num_cells[3] | double min_coord[3] | double cell_size |
+	//   double exceedance_threshold_ppm | double mean[N] | double variance[N] | double exceedance_probability[N]
+	// With N = num_cells x*y*z, in the same cell order as the rest of GADEN (x fastest)
+	bool save(const std::string& filename, double sim_time, const Gaden::EnvironmentDescription& env) const;
+
+private:
+	int num_members;
+	double threshold;
+	std::vector<double> mean;
+	std::vector<double> m2;         // sum of squared differences from the mean
+	std::vector<double> exceedance; // number of members above the threshold
+};
+
+#endif
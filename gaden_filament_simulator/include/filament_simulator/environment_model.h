@@ -0,0 +1,186 @@
+#ifndef ENVIRONMENT_MODEL_H
+#define ENVIRONMENT_MODEL_H
+
+#include <math.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <gaden_common/ReadEnvironment.h>
+#include <gaden_common/Wind.h>
+#include <gaden_common/WindCache.h>
+
+// A finer grid (occupancy and wind) over a box of the environment, read from the output of its own preprocessing.
+// Inside the box it replaces the coarser grids for the wind lookups and the obstacle tests. The levels are sorted from
+// the finest, so the first one that contains a point is the finest available there
+struct RefinementLevel
+{
+	Gaden::EnvironmentDescription env;
+	Gaden::WindField wind;
+	std::string wind_files_location;
+	Gaden::WindCache wind_cache;
+
+	bool contains(double x, double y, double z) const
+	{
+		return x >= env.min_coord.x && x < env.max_coord.x && y >= env.min_coord.y && y < env.max_coord.y && z >= env.min_coord.z &&
+			z < env.max_coord.z;
+	}
+
+	// Whether the box intersects the one from min to max
+	bool overlaps(double min_x, double min_y, double min_z, double max_x, double max_y, double max_z) const
+	{
+		return max_x >= env.min_coord.x && min_x < env.max_coord.x && max_y >= env.min_coord.y && min_y < env.max_coord.y &&
+			max_z >= env.min_coord.z && min_z < env.max_coord.z;
+	}
+
+	// Cell of a point within the box
+	Gaden::Vector3i cell(double x, double y, double z) const
+	{
+		return Gaden::Vector3i(std::min(int((x - env.min_coord.x) / env.cell_size), env.num_cells.x - 1),
+			std::min(int((y - env.min_coord.y) / env.cell_size), env.num_cells.y - 1),
+			std::min(int((z - env.min_coord.z) / env.cell_size), env.num_cells.z - 1));
+	}
+};
+
+// Occupancy and wind at any point of the environment, from the finest grid available there (the refinement levels, then the
+// base grid). The filaments and the probes are checked against it, so all of them see the same obstacles.
+// It only points to the grids, which belong to the simulator. Header only, so the lookups are inlined into the step kernels
+class CEnvironmentModel
+{
+public:
+	void configure(const Gaden::EnvironmentDescription& environment, const Gaden::WindField& wind_field, const std::vector<RefinementLevel>& refinement_levels)
+	{
+		env = &environment;
+		wind = &wind_field;
+		levels = &refinement_levels;
+	}
+
+	const Gaden::EnvironmentDescription& base() const
+	{
+		return *env;
+	}
+
+	// Check if a given 3D pose falls in:
+	//  0 = free space
+	//  1 = obstacle, wall, or outside the environment
+	//  2 = outlet (usefull to disable filaments)
+	int occupancy(double pose_x, double pose_y, double pose_z) const
+	{
+		// Finest refinement patch that contains the pose, if any
+		for (const RefinementLevel& level : *levels)
+		{
+			if (level.contains(pose_x, pose_y, pose_z))
+			{
+				Gaden::Vector3i cell = level.cell(pose_x, pose_y, pose_z);
+				return level.env.Env[Gaden::indexFrom3D(cell, level.env.num_cells)];
+			}
+		}
+
+		// 1.1 Check that pose is within the boundingbox environment
+		if (pose_x < env->min_coord.x || pose_x > env->max_coord.x || pose_y < env->min_coord.y || pose_y > env->max_coord.y || pose_z < env->min_coord.z || pose_z > env->max_coord.z)
+			return 1;
+
+		// Get 3D cell of the point
+		int x_idx = (pose_x - env->min_coord.x) / env->cell_size;
+		int y_idx = (pose_y - env->min_coord.y) / env->cell_size;
+		int z_idx = (pose_z - env->min_coord.z) / env->cell_size;
+
+		if (x_idx >= env->num_cells.x || y_idx >= env->num_cells.y || z_idx >= env->num_cells.z)
+			return 1;
+
+		// 1.2. Return cell occupancy (0=free, 1=obstacle, 2=outlet)
+		return env->Env[Gaden::indexFrom3D(Gaden::Vector3i(x_idx, y_idx, z_idx), env->num_cells)];
+	}
+
+	// Whether the straight path between two points crosses an obstacle, or one of the points is not free
+	bool obstructed(double start_x, double start_y, double start_z, double end_x, double end_y, double end_z) const
+	{
+		const bool PATH_OBSTRUCTED = true;
+		const bool PATH_UNOBSTRUCTED = false;
+
+		// Check whether one of the points is outside the valid environment or is not free
+		if (occupancy(start_x, start_y, start_z) != 0)
+		{
+			return PATH_OBSTRUCTED;
+		}
+		if (occupancy(end_x, end_y, end_z) != 0)
+		{
+			return PATH_OBSTRUCTED;
+		}
+
+		// Calculate normal displacement vector
+		double vector_x = end_x - start_x;
+		double vector_y = end_y - start_y;
+		double vector_z = end_z - start_z;
+		double distance = sqrt(vector_x * vector_x + vector_y * vector_y + vector_z * vector_z);
+		vector_x = vector_x / distance;
+		vector_y = vector_y / distance;
+		vector_z = vector_z / distance;
+
+		// Traverse path. Steps of one cell of the finest level the path can cross (only the patches that overlap its bounding
+		// box count), so no cell is skipped
+		double step_size = env->cell_size;
+		for (const RefinementLevel& level : *levels)
+		{
+			if (level.overlaps(std::min(start_x, end_x), std::min(start_y, end_y), std::min(start_z, end_z), std::max(start_x, end_x),
+					std::max(start_y, end_y), std::max(start_z, end_z)))
+				step_size = std::min(step_size, (double)level.env.cell_size);
+		}
+		int steps = ceil(distance / step_size); // Make sure no two iteration steps are separated more than 1 cell
+		double increment = distance / steps;
+
+		for (int i = 1; i < steps - 1; i++)
+		{
+			// Determine point in space to evaluate
+			double pose_x = start_x + vector_x * increment * i;
+			double pose_y = start_y + vector_y * increment * i;
+			double pose_z = start_z + vector_z * increment * i;
+
+			// With refinement patches, the cell is looked up in the finest level there
+			if (!levels->empty())
+			{
+				if (occupancy(pose_x, pose_y, pose_z) != 0)
+					return PATH_OBSTRUCTED;
+				continue;
+			}
+
+			// Determine cell to evaluate (some cells might get evaluated twice due to the current code
+			int x_idx = floor((pose_x - env->min_coord.x) / env->cell_size);
+			int y_idx = floor((pose_y - env->min_coord.y) / env->cell_size);
+			int z_idx = floor((pose_z - env->min_coord.z) / env->cell_size);
+
+			// Check if the cell is occupied
+			if (env->Env[Gaden::indexFrom3D(Gaden::Vector3i(x_idx, y_idx, z_idx), env->num_cells)] != 0)
+			{
+				return PATH_OBSTRUCTED;
+			}
+		}
+
+		// Direct line of sight confirmed!
+		return PATH_UNOBSTRUCTED;
+	}
+
+	// Wind at a point of the environment, from the finest level that contains it
+	const Gaden::WindVector& wind_at(double pose_x, double pose_y, double pose_z) const
+	{
+		for (const RefinementLevel& level : *levels)
+		{
+			if (level.contains(pose_x, pose_y, pose_z))
+			{
+				Gaden::Vector3i cell = level.cell(pose_x, pose_y, pose_z);
+				return level.wind.at(cell.x, cell.y, cell.z);
+			}
+		}
+
+		int x_idx = floor((pose_x - env->min_coord.x) / env->cell_size);
+		int y_idx = floor((pose_y - env->min_coord.y) / env->cell_size);
+		int z_idx = floor((pose_z - env->min_coord.z) / env->cell_size);
+		return wind->at(x_idx, y_idx, z_idx);
+	}
+
+private:
+	const Gaden::EnvironmentDescription* env = nullptr;
+	const Gaden::WindField* wind = nullptr;
+	const std::vector<RefinementLevel>* levels = nullptr;
+};
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef FAR_FIELD_H
+#define FAR_FIELD_H
+
+#include <string>
+#include <vector>
+#include <gaden_common/ReadEnvironment.h>
+#include <gaden_common/GaussianRasterizer.h>
+#include <gaden_common/Wind.h>
+
+// Far field of the hybrid Lagrangian-Eulerian model. The filaments that grow wider than a few cells are handed off to a grid
+// with the moles of gas in every cell of the environment, which is advected and diffused with an explicit finite volume scheme:
+//   - advection: first order upwind, with the wind of each face taken as the mean of its two cells
+//   - diffusion: the rate at which the filaments were spreading (see configure)
+// Faces next to obstacles or to the boundary of the environment are closed. The gas that enters an outlet is removed, as the
+// filaments are. Every face flux leaves one cell and enters the other, so the gas is conserved exactly. Each step is split in
+// substeps short enough to keep the scheme stable and the concentration positive.
+class CFarField
+{
+public:
+	CFarField();
+
+	// diffusivity [m²/s]
+	void configure(const Gaden::EnvironmentDescription& env, double diffusivity, double sigma_bin_ratio);
+	bool enabled() const;
+
+	// Velocities of the faces, and the substep they allow. Needed every time the wind changes
+	void set_wind(const Gaden::WindField& wind);
+
+	// Add the gas of the filaments. The gaussians cut by obstacles are rescaled, so all the gas they carried is kept
+	void deposit(const std::vector<Gaden::GaussianSource>& sources);
+
+	// Replace the grid with the moles of a saved far field (warm start). They count as deposited
+	void restore(const std::vector<double>& moles);
+
+	// Advance dt seconds. Called from within the task graph of the main loop (see update_filaments_location)
+	void step(double dt);
+
+	const std::vector<Gaden::Real>& moles() const;
+	double total_moles() const;
+	double deposited_moles() const;
+	double removed_moles() const; // through the outlets
+
+	// Content of the far field files (far_field_<n>, zlib compressed, or a FAR_FIELD chunk of the archive):
+	//   int format(1) | double sim_time | int num_cells[3] | double moles[N]
+	static std::string serialize(const std::vector<double>& moles, double sim_time, const Gaden::Vector3i& num_cells);
+
+private:
+	const Gaden::EnvironmentDescription* env;
+	double diffusivity;
+	Gaden::GaussianRasterizer rasterizer;
+
+	std::vector<Gaden::Real> grid, next, deposit_buffer;
+	std::vector<Gaden::Real> face_velocity[3]; // on the + face of every cell (0 if it is closed)
+	std::vector<size_t> outlets;                // cells where the gas leaves the environment
+	double max_substep;                         //(sec)
+	double deposited;
+	double removed;
+
+	bool is_open(int x, int y, int z) const;
+};
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef FILAMENT_H
 #define FILAMENT_H
 
+#include <gaden_common/Real.h>
+
 class CFilament
 {
 public:
@@ -12,11 +14,12 @@ public:
 
 	// Parameters of the filament
 	//--------------------------
-	double pose_x;     // Center of the filament (m)
-	double pose_y;     // Center of the filament (m)
-	double pose_z;     // Center of the filament (m)
-	double sigma;      // [cm] The sigma of a 3D gaussian (controlls the shape of the filament)
+	Gaden::Real pose_x; // Center of the filament (m)
+	Gaden::Real pose_y; // Center of the filament (m)
+	Gaden::Real pose_z; // Center of the filament (m)
+	Gaden::Real sigma;  // [cm] The sigma of a 3D gaussian (controlls the shape of the filament)
 	bool valid;        // Is filament valid?
 	double birth_time; // Time at which the filament is released (set as active)
+	int id;            // Stable ID used in the results (the filaments vector may be reordered)
 };
 #endif
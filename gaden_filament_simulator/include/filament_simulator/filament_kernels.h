@@ -0,0 +1,203 @@
+#ifndef FILAMENT_KERNELS_H
+#define FILAMENT_KERNELS_H
+
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+#include <gaden_common/GaussianKernel.h>
+#include "filament_simulator/filament.h"
+#include "filament_simulator/environment_model.h"
+#include "filament_simulator/filament_noise.h"
+
+// Work on a single filament, shared by the simulator (which runs them for all the filaments, as tasks) and by its tests and
+// benchmarks, so those exercise the same code. Header only, so they are inlined into the loops of the simulator
+
+// Evaluation points along each axis of a filament in splatFilament
+inline int splatPointsPerAxis(double sigma, double cell_size)
+{
+	double grid_size_m = std::min(cell_size, sigma / 100.0);
+	return (int)ceil(6 * (sigma / 100) / grid_size_m) + 1;
+}
+
+// Here we estimate the gas concentration on each cell of the 3D env
+// based on the active filaments and their 3DGaussian shapes
+// For that we employ Farrell's Concentration Eq
+// The moles of gas of the filament are added to the cells of grid (a cell of the base grid of the environment each), times
+// unit_scale: 1 for [moles], or the [ppm] of a cell per mole of gas.
+// Only the planes of evaluation points along X in [first_slab, last_slab) are done, so wide filaments can be split in tasks.
+// Several filaments can be splatted on the same grid at once. Filament is CFilament, or any type with the same fields
+template <typename Filament, typename T>
+inline void splatFilament(const Filament& filament, double moles_of_gas, double unit_scale, const CEnvironmentModel& environment, int first_slab,
+	int last_slab, std::vector<T>& grid)
+{
+	// We run over all the active filaments, and update the gas concentration of the cells that are close to them.
+	// Ideally a filament spreads over the entire environment, but in practice since filaments are modeled as 3Dgaussians
+	// We can stablish a cutt_off raduis of 3*sigma.
+	// To avoid resolution problems, we evaluate each filament according to the minimum between:
+	// the env_cell_size and filament_sigma. This way we ensure a filament is always well evaluated (not only one point).
+	const Gaden::EnvironmentDescription& envDesc = environment.base();
+
+	double grid_size_m = std::min(envDesc.cell_size, (filament.sigma / 100.0)); //[m] grid size to evaluate the filament
+	// Compute at which increments the Filament has to be evaluated.
+	// If the sigma of the Filament is very big (i.e. the Filament is very flat), the use the world's cell_size.
+	// If the Filament is very small (i.e in only spans one or few world cells), then use increments equal to sigma
+	//  in order to have several evaluations fall in the same cell.
+
+	int num_evaluations = ceil(6 * (filament.sigma / 100) / grid_size_m);
+	// How many times the Filament has to be evaluated depends on the final grid_size_m.
+	// The filament's grid size is multiplied by 6 because we evaluate it over +-3 sigma
+	// If the filament is very small (i.e. grid_size_m = sigma), then the filament is evaluated only 6 times
+	// If the filament is very big and spans several cells, then it has to be evaluated for each cell (which will be more than 6)
+
+	// The points of each line along Z are evaluated together, in SIMD registers (see GaussianKernel.h)
+	double sigma_m = filament.sigma / 100;
+	int num_points = num_evaluations + 1;
+	thread_local std::vector<double> line_x, line_y, line_z, line_values;
+	line_x.resize(num_points);
+	line_y.resize(num_points);
+	line_z.resize(num_points);
+	line_values.resize(num_points);
+	for (int k = 0; k < num_points; k++)
+		line_z[k] = (filament.pose_z - 3 * sigma_m) + k * grid_size_m;
+
+	// Each point stands for a volume of the size of the evaluation grid: [moles/cm³] -> [moles] or [ppm] of its cell
+	double point_scale = pow(grid_size_m * 100, 3) * unit_scale;
+
+	// EVALUATE IN ALL THREE AXIS
+	for (int i = first_slab; i < std::min(last_slab, num_points); i++)
+	{
+		for (int j = 0; j <= num_evaluations; j++)
+		{
+			// get point to evaluate [m]
+			double x = (filament.pose_x - 3 * sigma_m) + i * grid_size_m;
+			double y = (filament.pose_y - 3 * sigma_m) + j * grid_size_m;
+			std::fill(line_x.begin(), line_x.end(), x);
+			std::fill(line_y.begin(), line_y.end(), y);
+
+			// FARRELLS Eq.
+			// Evaluate the concentration of the filament at the points of the line (moles/cm³). No cutoff: the whole cube is kept
+			Gaden::pointsVsFilament(line_x.data(), line_y.data(), line_z.data(), num_points, filament.pose_x, filament.pose_y, filament.pose_z,
+				filament.sigma, moles_of_gas, HUGE_VAL, line_values.data());
+			for (int k = 0; k < num_points; k++)
+				line_values[k] *= point_scale;
+
+			for (int k = 0; k < num_points; k++)
+			{
+				double z = line_z[k];
+
+				// Valid point? If either OUT of the environment, or through a wall, treat it as invalid
+				bool path_is_obstructed = environment.obstructed(filament.pose_x, filament.pose_y, filament.pose_z, x, y, z);
+
+				if (!path_is_obstructed)
+				{
+					// Get 3D cell of the evaluated point
+					int x_idx = floor((x - envDesc.min_coord.x) / envDesc.cell_size);
+					int y_idx = floor((y - envDesc.min_coord.y) / envDesc.cell_size);
+					int z_idx = floor((z - envDesc.min_coord.z) / envDesc.cell_size);
+
+					// Accumulate concentration in corresponding env_cell
+					#pragma omp atomic
+					grid[Gaden::indexFrom3D(Gaden::Vector3i(x_idx, y_idx, z_idx), envDesc.num_cells)] += line_values[k]; // moles or ppm
+				}
+			}
+		}
+	}
+}
+
+// Settings of advectFilament, the same for all the filaments of a step
+struct AdvectionParameters
+{
+	double time_step;         //[s]
+	double buoyancy_velocity; //[m/s] Terminal velocity of the filaments (positive upwards)
+	double noise_std;         //[m]
+	double initial_variance;  //[cm²]
+	double growth_gamma;      //[cm²/s]
+	uint64_t seed;            // Of the noise (see filament_noise.h)
+	int member;               // Realization of the ensemble
+	int step;                 // Simulation step
+};
+
+// Moves and grows a filament over a step that ends at sim_time (the first four parts of update_filament_location).
+//  According to Farrell Filament model, a filament is afected by three components of the wind flow.
+//  1. Va (large scale wind) -> Advection (Va) -> Movement of a filament as a whole by wind) -> from CFD
+//  2. Vm (middle scale wind)-> Movement of the filament with respect the center of the "plume" -> modeled as white noise
+//  3. Vd (small scale wind) -> Difussion or change of the filament shape (growth with time)
+//  We also consider Gravity and Bouyant Forces given the gas molecular mass
+// A filament that reaches an outlet is no longer valid. Filament is CFilament, or any type with the same fields (the tests
+// use one in double precision). Environment is CEnvironmentModel, or any type with its occupancy and wind_at
+template <bool Buoyancy, bool Noise, typename Filament, typename Environment>
+inline void advectFilament(Filament& filament, double sim_time, const AdvectionParameters& parameters, const Environment& environment)
+{
+	double newpos_x, newpos_y, newpos_z;
+
+	// 1. Simulate Advection (Va)
+	//    Large scale wind-eddies -> Movement of a filament as a whole by wind (at the cell of the filament center)
+	//------------------------------------------------------------------------
+	const auto& wind_vector = environment.wind_at(filament.pose_x, filament.pose_y, filament.pose_z);
+	newpos_x = filament.pose_x + wind_vector.u * parameters.time_step;
+	newpos_y = filament.pose_y + wind_vector.v * parameters.time_step;
+	newpos_z = filament.pose_z + wind_vector.w * parameters.time_step;
+
+	// Check filament location
+	int valid_location = environment.occupancy(newpos_x, newpos_y, newpos_z);
+	switch (valid_location)
+	{
+	case 0:
+		// Free and valid location... update filament position
+		filament.pose_x = newpos_x;
+		filament.pose_y = newpos_y;
+		filament.pose_z = newpos_z;
+		break;
+	case 2:
+		// The location corresponds to an outlet! Delete filament!
+		filament.valid = false;
+		break;
+	default:
+		// The location falls in an obstacle -> Illegal movement (Do not apply advection)
+		break;
+	}
+
+	// 2. Simulate Gravity & Bouyant Force
+	//------------------------------------
+	// The vertical part of the advection is tried again on its own, in case the full movement was blocked (if it was not,
+	// newpos_z is already the current height). The terminal velocity of the filament adds to it
+	if (Buoyancy)
+		newpos_z += parameters.buoyancy_velocity * parameters.time_step;
+
+	// Check filament location
+	int vertical_location = environment.occupancy(filament.pose_x, filament.pose_y, newpos_z);
+	if (vertical_location == 0)
+	{
+		filament.pose_z = newpos_z;
+	}
+	else if (vertical_location == 2)
+	{
+		filament.valid = false;
+	}
+
+	// 3. Add some variability (stochastic process). The draws only depend on the filament and the step (see filament_noise.h)
+	if (Noise)
+	{
+		CFilamentNoise noise(parameters.seed, parameters.member, filament.id, parameters.step);
+		newpos_x = filament.pose_x + noise.normal(parameters.noise_std);
+		newpos_y = filament.pose_y + noise.normal(parameters.noise_std);
+		newpos_z = filament.pose_z + noise.normal(parameters.noise_std);
+
+		// Check filament location
+		if (environment.occupancy(newpos_x, newpos_y, newpos_z) == 0)
+		{
+			filament.pose_x = newpos_x;
+			filament.pose_y = newpos_y;
+			filament.pose_z = newpos_z;
+		}
+	}
+
+	// 4. Filament growth with time (this affects the posterior estimation of gas concentration at each cell)
+	//    Vd (small scale wind eddies) -> Difussion or change of the filament shape (growth with time)
+	//    R = sigma of a 3D gaussian -> Increasing sigma with time
+	//------------------------------------------------------------------------
+	filament.sigma = sqrt(parameters.initial_variance + parameters.growth_gamma * (sim_time - filament.birth_time));
+}
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef FILAMENT_NOISE_H
+#define FILAMENT_NOISE_H
+
+#include <math.h>
+#include <stdint.h>
+
+// Random displacement of the filaments (the middle scale wind of Farrell's model, see update_filament_location).
+// The draws are not taken from a generator that the threads share or own: each one is a hash (SplitMix64) of the seed, the
+// realization, the filament id, the step and its position in the sequence, turned into a normal draw with Box-Muller.
+// So they do not depend on which thread advects each filament, every realization of an ensemble gets its own, and a run
+// with a given seed is repeated exactly
+class CFilamentNoise
+{
+public:
+	CFilamentNoise(uint64_t seed, int member, int filament_id, int step)
+	{
+		key = mix(seed);
+		key = mix(key ^ (uint32_t)member);
+		key = mix(key ^ (uint32_t)filament_id);
+		key = mix(key ^ (uint32_t)step);
+	}
+
+	// Normal draw with mean 0
+	double normal(double std)
+	{
+		if (has_spare)
+		{
+			has_spare = false;
+			return spare * std;
+		}
+		double u1 = uniform(), u2 = uniform();
+		double radius = sqrt(-2 * log(u1));
+		spare = radius * sin(2 * M_PI * u2);
+		has_spare = true;
+		return radius * cos(2 * M_PI * u2) * std;
+	}
+
+private:
+	uint64_t key;
+	uint64_t counter = 0;
+	double spare = 0;
+	bool has_spare = false;
+
+	static uint64_t mix(uint64_t z)
+	{
+		z += 0x9e3779b97f4a7c15ULL;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		return z ^ (z >> 31);
+	}
+
+	// (0, 1]
+	double uniform()
+	{
+		counter++;
+		return ((mix(key + counter) >> 11) + 1) * 0x1.0p-53;
+	}
+};
+
+#endif
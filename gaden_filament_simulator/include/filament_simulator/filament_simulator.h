@@ -4,35 +4,103 @@
 #include <rclcpp/rclcpp.hpp>
 #include <visualization_msgs/msg/marker.hpp>
 #include <std_msgs/msg/bool.hpp>
+#include <rosgraph_msgs/msg/clock.hpp>
 #include "filament_simulator/filament.h"
+#include "filament_simulator/output_filter.h"
+#include "filament_simulator/ensemble_statistics.h"
+#include "filament_simulator/concentration_maps.h"
+#include "filament_simulator/probe_recorder.h"
+#include "filament_simulator/far_field.h"
+#include "filament_simulator/convergence_monitor.h"
+#include "filament_simulator/environment_model.h"
+#include "filament_simulator/filament_noise.h"
+#include "filament_simulator/filament_kernels.h"
 
 #include <omp.h>
 #include <stdlib.h> /* srand, rand */
 #include <iostream>
 #include <fstream>
 #include <random>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
 #include <boost/format.hpp>
 #include <boost/filesystem.hpp>
-#include <boost/thread/mutex.hpp>
 #include <boost/interprocess/streams/bufferstream.hpp>
 #include <boost/iostreams/filter/zlib.hpp>
 #include <boost/iostreams/filtering_stream.hpp>
 #include <boost/iostreams/copy.hpp>
 #include <gaden_common/ReadEnvironment.h>
+#include <gaden_common/Wind.h>
+#include <gaden_common/WindCache.h>
+#include <gaden_common/SPSCQueue.h>
+#include <gaden_common/SimulationArchive.h>
+#include <gaden_common/GaussianRasterizer.h>
+#include <gaden_common/LiveExchange.h>
+#include <gaden_common/MemoryPlacement.h>
+#include <gaden_common/GaussianKernel.h>
+#include <float.h>
+#include <limits.h>
+
+// Immutable copy of the filament set at a given step.
+// Saving and visualization work on these, so they can run as tasks while the next step is being advected
+struct FilamentSnapshot
+{
+	double sim_time;
+	int wind_idx;
+	int member; // realization of an ensemble run (-1 = not an ensemble run)
+	std::vector<CFilament> filaments; // (see CFilament::id)
+	std::vector<double> far_field;    // Moles of gas in each cell of the far field (empty if not taken)
+	std::vector<Gaden::Real> concentration; // Moles of gas of the filaments in each cell of the environment (empty if not taken)
+	double steady_time;               //(sec) When the plume became steady (-1 = not yet, see check_convergence)
+};
+
+// Statistics of an ensemble at a given step, and the realizations that are saved (see take_ensemble_snapshot)
+struct EnsembleSnapshot
+{
+	EnsembleSnapshot(size_t num_cells, double exceedance_threshold_ppm) : statistics(num_cells, exceedance_threshold_ppm) {}
+
+	double sim_time = 0;
+	CEnsembleStatistics statistics;
+	std::vector<std::shared_ptr<const FilamentSnapshot>> members; // of ensemble_save_members
+};
 
 class CFilamentSimulator : public rclcpp::Node
 {
 public:
-	CFilamentSimulator();
+	CFilamentSimulator(bool max_speed_arg = false);
 	~CFilamentSimulator();
+	void initialize();
+	void configure_memory();
 	void add_new_filaments(double radius_arround_source);
 	void read_wind_snapshot(int idx);
 	void update_gas_concentration_from_filaments();
-	void update_gas_concentration_from_filament(int fil_i);
+	template <bool PPM>
+	void update_gas_concentration_from_filament(int fil_i, int first_slab, int last_slab);
 	void update_filaments_location();
-	void update_filament_location(int i);
-	void publish_markers();
-	void save_state_to_file();
+	template <bool Buoyancy, bool Noise>
+	void update_filament_location(int i, const AdvectionParameters& parameters);
+	void sort_filaments();
+	std::shared_ptr<const FilamentSnapshot> take_snapshot(bool with_far_field = false);
+	std::shared_ptr<const FilamentSnapshot> take_concentration_snapshot();
+	void select_member(int member);
+	std::shared_ptr<const EnsembleSnapshot> take_ensemble_snapshot();
+	void save_ensemble(const EnsembleSnapshot& snapshot, int iteration);
+	void update_concentration_maps(const FilamentSnapshot& snapshot, bool flush);
+	bool plume_changed();
+	void notify_step();
+	void record_probes();
+	void publish_markers(const FilamentSnapshot& snapshot);
+	void save_state_to_file(const FilamentSnapshot& snapshot, int iteration);
+	void close_results();
+	void report_retirement();
+	void report_far_field();
+	void report_splat();
+	bool check_convergence();
+	void report_convergence();
 
 	// Variables
 	int current_wind_snapshot;
@@ -43,6 +111,7 @@ public:
 
 	// Parameters
 	bool verbose;
+	bool max_speed; // Publish the simulation time on /clock
 	bool wait_preprocessing;
 	bool preprocessing_done;
 	double max_sim_time;  //(sec) Time tu run this simulation
@@ -63,10 +132,14 @@ public:
 	double filament_initial_std;  //[cm] Sigma of the filament at t=0-> 3DGaussian shape
 	double filament_growth_gamma; //[cm²/s] Growth ratio of the filament_std
 	double filament_noise_std;    // STD to add some "variablity" to the filament location
+	bool buoyancy;                // Apply the terminal velocity of the buoyant rise (or fall) of the filaments
+	double retirement_min_peak_ppm;      //[ppm] Filaments whose peak concentration drops below this are retired (0 = never)
+	double retirement_max_mass_fraction; // Max fraction of the released gas that can be retired
 	int gasType;                  // Gas type to simulate
 	double envTemperature;        // Temp in Kelvins
 	double envPressure;           // Pressure in Atm
 	int gasConc_unit;             // Get gas concentration in [molecules/cm3] or [ppm]
+	std::string concentration_rasterizer; // "splat" or "binned" (see update_gas_concentration_from_filaments)
 
 	// Wind
 	std::string wind_files_location; // Location of the wind information
@@ -75,12 +148,17 @@ public:
 	bool allow_looping;
 	int loop_from_step;
 	int loop_to_step;
+	int wind_cache_size_mb; // Memory budget for keeping decoded wind snapshots (0 = disabled)
 
 	// Enviroment
 	std::string occupancy3D_data; // Location of the 3D Occupancy GridMap of the environment
 	std::string fixed_frame;      // Frame where to publish the markers
 	Gaden::EnvironmentDescription envDesc;
 
+	// Nested refinement: finer grids over parts of the environment (see environment_model.h)
+	std::vector<std::string> refinement_occupancy3D_data; // Occupancy file of each patch
+	std::vector<std::string> refinement_wind_data;        // Wind files of each patch (same snapshots as wind_data)
+
 	// Gas Source Location (for releasing the filaments)
 	double gas_source_pos_x; //[m]
 	double gas_source_pos_y; //[m]
@@ -89,30 +167,207 @@ public:
 	// Results
 	int save_results;             // True or false
 	std::string results_location; // Location for results logfiles
+	std::string results_format;   // "files" (iteration_<n> + wind/) or "archive" (single indexed file)
+	double output_min_peak_ppm;   //[ppm] Filaments with a lower peak concentration are not saved (0 = save all)
+	COutputFilter output_filter;  // Which filaments are written to the results (the simulation keeps all of them)
 	double results_time_step;     //(sec) Time increment between saving results
+	std::string results_policy;   // "fixed" (save every results_time_step) or "on_change" (see plume_changed)
+	double results_change_tolerance; // Relative change of the plume that triggers a save (on_change)
+	double results_max_gap;          //(sec) Max time between saves (on_change)
 	double results_min_time;      //(sec) time after which start saving results
+	std::string warm_start_file;  // iteration_<n> file or results archive of a previous (compatible) run to continue from. Empty to start from scratch
+	double warm_start_time;       //(sec) sim_time of the warm start file, only needed for logs that do not store it (format version 1)
+	int warm_start_iteration;     // iteration of the warm start archive (-1 = the last one)
+	std::vector<double> warm_start_far_field; // moles per cell of the far field of the warm start (empty if it had none)
 	bool wind_finished;
-	boost::mutex mtx;
+
+	// Ensemble: several realizations of the (stochastic) plume advanced together over the same wind
+	int ensemble_size;                      // Number of realizations (1 = normal simulation)
+	double ensemble_exceedance_ppm;         //[ppm] Threshold of the exceedance probability grids
+	std::vector<int> ensemble_save_members; // Realizations whose filaments are also saved (in member_<k>/)
+	int random_seed;                        // Seed of the releases and the filament noise (-1 = from the current time)
+
+	// Running concentration maps (mean, peak, time above threshold)
+	int maps_stride;               // Steps between updates of the maps (0 = disabled)
+	double maps_cell_size;         //[m] Cell size of the maps (0 = the one of the environment)
+	double maps_threshold_ppm;     //[ppm] Threshold for the time-above-threshold map
+	double maps_flush_interval;    //(sec) Simulated time between writes of the maps file (0 = only at the end)
+	double last_maps_flush_time;
+	CConcentrationMaps concentration_maps;
+
+	// Concentration time series at fixed probes (see probe_recorder.h)
+	std::vector<double> probe_points; // x,y,z of each point probe
+	std::vector<double> probe_lines;  // x1,y1,z1,x2,y2,z2 of each line probe
+	int probe_stride;                 // Steps between samples of the probes
+	CProbeRecorder probes;
+
+	// Hybrid Lagrangian-Eulerian model (see far_field.h)
+	double far_field_sigma_cells; // Filaments wider than this many cells are handed off to the far field grid (0 = disabled)
+	CFarField far_field;
+
+	// Steady state detection (see convergence_monitor.h)
+	double convergence_window;            //(sec) Length of the windows that are compared (0 = disabled)
+	double convergence_tolerance;         // Max change between consecutive windows, relative to the scale of each quantity
+	double convergence_min_ppm;           //[ppm] Probes below this are considered empty
+	std::string convergence_action;       // "stop", or "sparse" (keep going, saving every convergence_results_time_step)
+	double convergence_results_time_step; //(sec)
+	CConvergenceMonitor convergence;
+
+	// Pipelining
+	int max_pending_io_tasks; // Max number of snapshots waiting to be saved before the simulation loop blocks
+	int morton_sort_interval; // Steps between reorderings of the filaments by cell (0 = disabled)
+
+	// NUMA placement (see gaden_common/MemoryPlacement.h)
+	Gaden::MemoryPolicy memory_policy;     // Of the grids and the filament arrays
+	bool huge_pages;                       // Ask for transparent huge pages for the grids and filament arrays
+	Gaden::ThreadAffinity thread_affinity; // Pinning of the OpenMP threads
+
+	// Time spent in update_filaments_location (reported at the end)
+	double advection_time = 0; //(sec)
+	int advection_calls = 0;
+
+	// Time spent in update_gas_concentration_from_filaments, in total and by every thread (reported at the end).
+	// Every thread adds to its own entry, each in its own cache line
+	struct alignas(64) ThreadBusy
+	{
+		double seconds = 0;
+	};
+	double splat_time = 0;                     //(sec)
+	std::vector<ThreadBusy> splat_thread_busy;
+	int splat_calls = 0;
+
+	// Live coupling with the player (see gaden_common/LiveExchange.h)
+	std::string live_exchange_name; // Shared memory segment where the current state is published on every step (empty = disabled)
 
 private:
 	void loadNodeParameters();
 	void initSimulator();
-	void configure3DMatrix(std::vector<double>& A);
-	void configure3DMatrix(std::vector<uint8_t>& A);
+	// Resize a 3D Matrix compose of Vectors, This operation is only performed once!
+	template <typename T>
+	void configure3DMatrix(std::vector<T>& A)
+	{
+		A.resize(envDesc.num_cells.x * envDesc.num_cells.y * envDesc.num_cells.z);
+	}
+
+	bool load_warm_start(const std::string& filename);
+	void init_ensemble();
+
+	// Step kernels. They are instantiated for every combination of the settings they depend on, which do not change during
+	// the run, and select_step_kernels picks the right ones once, so the loops do not branch on them
+	template <bool Buoyancy, bool Noise>
+	void update_filaments_location_kernel();
+	void select_step_kernels();
+	void (CFilamentSimulator::*update_filaments_location_step)() = nullptr;
+	void (CFilamentSimulator::*update_gas_concentration_step)(int, int, int) = nullptr;
+	double buoyancy_velocity;         //[m/s] Terminal velocity of the filaments (positive upwards)
+	double filament_initial_variance; //[cm²]
+	double ppm_per_cell_mole;         //[ppm] Concentration of a cell per mole of gas in it
+
+	// Steady state (see check_convergence)
+	std::vector<double> convergence_values, convergence_floors;
+	std::string archive_metadata; // last METADATA chunk appended to the archive
+	void init_convergence();
+
+	// Scheduling of the concentration splat (see update_gas_concentration_from_filaments)
+	struct SplatTask
+	{
+		int filament;
+		int first_slab, last_slab; // planes of evaluation points along X
+		double cost;               // evaluation points
+	};
+	std::vector<SplatTask> splat_tasks;   // heaviest first
+	std::vector<size_t> splat_bundles;    // splat_tasks[splat_bundles[b]..splat_bundles[b+1]) run as one OpenMP task
+	void schedule_splat();
+	void run_splat();
+
+	// Retirement of the filaments that became negligible (see update_filaments_location)
+	double retirement_sigma = DBL_MAX;          //[cm] Wider filaments have a peak concentration below retirement_min_peak_ppm
+	long retired_filaments = 0;                 // Of the active realization
+	std::atomic<long> retirement_allowance{ 0 }; // Filaments that can still be retired in the current step (mass budget)
+	bool retirement_budget_reported = false;
 
-	void read_3D_file(std::string filename, std::vector<double>& A, bool binary);
-	int check_pose_with_environment(double pose_x, double pose_y, double pose_z);
-	bool check_environment_for_obstacle(double start_x, double start_y, double start_z, double end_x, double end_y, double end_z);
+	// Hand-off of the filaments to the far field (see update_filaments_location)
+	double far_field_sigma = DBL_MAX;               //[cm]
+	std::vector<int> far_field_handoffs;            // Filaments handed off in the current step (the first far_field_handoff_count)
+	std::atomic<int> far_field_handoff_count{ 0 };
+	std::vector<Gaden::GaussianSource> far_field_sources;
+	int far_field_wind_idx = -1;                    // Wind snapshot of the face velocities of the far field
+	long far_field_filaments = 0;                   // Handed off so far
+	void init_far_field();
+	void hand_off_to_far_field();
+	std::string results_description(double steady_time = -1);
+	Gaden::ArchiveHeader results_header();
+	void open_results_archive();
+	void save_state_to_archive(const FilamentSnapshot& snapshot, int iteration);
+
+	void read_3D_file(std::string filename, const Gaden::Vector3i& num_cells, std::vector<double>& A, bool binary);
+	std::string wind_filename(const std::string& location, int idx, char component);
+	void read_wind_files(const std::string& location, int idx, const Gaden::Vector3i& num_cells, Gaden::WindField& field);
+	void load_refinement_levels();
+	void read_refinement_wind_snapshots(int idx);
 	double random_number(double min_val, double max_val);
 	void preprocessingCB(const std_msgs::msg::Bool::SharedPtr b);
+	void publishCB();
 
 	// Subscriptions & Publishers
 	rclcpp::Publisher<visualization_msgs::msg::Marker>::SharedPtr marker_pub; // For visualization of the filaments!
+	rclcpp::Publisher<rosgraph_msgs::msg::Clock>::SharedPtr clock_pub;        // Simulation time (max_speed mode)
 	rclcpp::Subscription<std_msgs::msg::Bool>::SharedPtr prepro_sub;          // In case we require the preprocessing node to finish.
+	rclcpp::TimerBase::SharedPtr publish_timer;
+
+	// Communication with the ROS thread
+	std::mutex preprocessing_mtx;
+	std::condition_variable preprocessing_cv;
+	Gaden::SPSCQueue<std::shared_ptr<const FilamentSnapshot>> marker_queue; // Filled by the simulation loop, emptied by publishCB
+	std::atomic<double> published_sim_time{ 0 };
+	double last_clock_time = -1;
 
 	// Vars
-	std::vector<double> U, V, W, C;
+	Gaden::WindField wind;              // Interleaved U,V,W of every cell, in bricks (see gaden_common/Wind.h)
+	std::vector<double> wind_buffer[3]; // Scratch arrays (U, V, W) to convert between the (planar) files and the wind field
+	Gaden::WindCache wind_cache;     // Decoded snapshots, so looping runs read each file only once
+
+	// Nested refinement: finer grids over parts of the environment, sorted from the finest (see environment_model.h)
+	std::vector<RefinementLevel> refinement_levels;
+	double finest_cell_size; //[m] Of all the levels, the base one included
+	CEnvironmentModel environment; // Occupancy and wind lookups in the finest level at each point
+	Gaden::ArchiveWriter results_archive;
+	Gaden::LiveExchangeWriter live_exchange;
+	int live_exchange_skipped = 0; // Consecutive steps that could not be published (see notify_step)
+	std::vector<Gaden::Real> C;
+	Gaden::GaussianRasterizer rasterizer;
+	double rasterizer_sigma_bin_ratio;
 	std::vector<CFilament> filaments;
+	std::vector<CFilament> sorted_filaments; // Scratch arrays for sort_filaments
+	std::vector<uint64_t> sort_keys, sort_keys_aux;
+	std::vector<int> sort_order, sort_order_aux;
+
+	// State of a realization. The active one is kept in the members above (filaments, current_number_filaments...),
+	// and select_member swaps them
+	struct EnsembleMember
+	{
+		std::vector<CFilament> filaments;
+		int current_number_filaments = 0;
+		double numFilament_aux = 0;
+		int filament_stop_counter = 0;
+		long retired_filaments = 0;
+	};
+	std::vector<EnsembleMember> ensemble_members;
+	int active_member = 0;
+	std::vector<Gaden::Real> ensemble_ppm; // Scratch array for take_ensemble_snapshot
+	void swap_member_state(EnsembleMember& member);
+
+	// Summary of the plume at the last save (results_policy on_change)
+	struct PlumeSummary
+	{
+		double time = -DBL_MAX;
+		int count = 0;
+		double centroid[3] = { 0, 0, 0 };
+		double spread = 0; //[m] RMS distance of the filaments to the centroid
+	};
+	PlumeSummary last_saved_plume;
+	PlumeSummary summarize_plume();
+
 	visualization_msgs::msg::Marker filament_marker;
 	bool wind_notified;
 	int last_wind_idx = -1;
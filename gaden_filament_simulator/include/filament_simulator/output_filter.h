@@ -0,0 +1,47 @@
+#ifndef OUTPUT_FILTER_H
+#define OUTPUT_FILTER_H
+
+#include <string>
+#include <vector>
+#include "filament_simulator/filament.h"
+
+// Decides which filaments are written to the results files.
+// The simulation always keeps the full state, this only reduces the size of the logs.
+//  - Regions of interest: axis-aligned boxes and/or a polygon (extruded between two heights). A filament is kept if
+//    it can contribute to the concentration inside any of them (its center is closer than 3 sigma)
+//  - Significance: filaments whose peak concentration (at their center) is below a threshold are dropped
+class COutputFilter
+{
+public:
+	COutputFilter();
+
+	// boxes: xmin ymin zmin xmax ymax zmax (6 values per box)
+	// polygon: x0 y0 x1 y1 ... (in the XY plane), extruded between polygon_z[0] and polygon_z[1]
+	void set_regions(const std::vector<double>& boxes, const std::vector<double>& polygon, const std::vector<double>& polygon_z);
+
+	// The peak concentration of a filament is filament_moles / (sqrt(8*pi^3) * sigma^3), relative to the moles of all gases
+	void set_min_peak_ppm(double min_ppm, double filament_moles_of_gas, double num_moles_all_gases_in_cm3);
+
+	bool enabled() const;
+	bool accept(const CFilament& filament) const;
+
+	// Human-readable description of the active filters, stored in the results
+	std::string describe() const;
+
+private:
+	struct Box
+	{
+		double min[3], max[3];
+	};
+	std::vector<Box> boxes;
+	std::vector<double> polygon; // x0 y0 x1 y1...
+	double polygon_z[2];
+
+	double min_peak_ppm;
+	double max_sigma; //[cm] filaments wider than this have a peak concentration below min_peak_ppm
+
+	bool in_regions(double x, double y, double z, double margin) const;
+	bool in_polygon(double x, double y, double margin) const;
+};
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef PROBE_RECORDER_H
+#define PROBE_RECORDER_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <gaden_common/ReadEnvironment.h>
+#include "filament_simulator/filament.h"
+#include "filament_simulator/environment_model.h"
+
+// Concentration time series at fixed probes, sampled while the simulation runs (instead of replaying the saved iterations
+// through the player). Each probe is evaluated as the player does: Farrell's kernel of every filament within 5 sigma that is
+// in line of sight of the probe, plus the gas of the far field in the cell of the probe (if there is one, see far_field.h).
+// The obstacles are looked up as the simulator does, in the finest refinement level at each point (see environment_model.h).
+//   - Point probes give the concentration [ppm]
+//   - Line probes give the concentration integrated along the segment [ppm*m], as seen by an open-path sensor
+class CProbeRecorder
+{
+public:
+	CProbeRecorder();
+	~CProbeRecorder();
+
+	// points: x,y,z of each point probe. lines: x1,y1,z1, x2,y2,z2 of each line probe. False if the file cannot be created
+	bool configure(const CEnvironmentModel& environment, const std::vector<double>& points, const std::vector<double>& lines,
+		double filament_moles_of_gas, double num_moles_all_gases_in_cm3, const std::string& filename);
+
+	bool enabled() const;
+	size_t num_probes() const;
+
+	// Value of every probe in the last call to record (0 before the first one)
+	const std::vector<double>& last_values() const;
+
+	// Evaluate all the probes for the current filaments (the first num_filaments of the vector) and far field (moles per cell, or null)
+	void record(const std::vector<CFilament>& filaments, int num_filaments, const std::vector<Gaden::Real>* far_field, double sim_time);
+
+	// File (columnar, appended in blocks of up to block_rows samples):
+	//   "GADENPRB" | int version(1) | int num_probes | { int type (0 = point, 1 = line) | double start[3] | double end[3] } per probe
+	//   { int num_rows | double sim_time[num_rows] | double value[num_rows] per probe } per block
+	// Writes the rows that are still buffered
+	void flush();
+
+private:
+	struct Sample
+	{
+		double x, y, z;
+		double weight; // 1 for points, length of the piece of the segment for lines
+		bool free;     // not inside an obstacle
+		size_t cell;   // index of the cell of the base grid (if free)
+	};
+
+	struct Probe
+	{
+		int type;
+		double start[3], end[3];
+		double bbox_min[3], bbox_max[3];
+		size_t first_sample, last_sample; // [first, last) in samples
+	};
+
+	struct ActiveFilament
+	{
+		double x, y, z;
+		double sigma;  //[cm]
+		double cutoff; //[m]
+	};
+
+	const CEnvironmentModel* environment;
+	const Gaden::EnvironmentDescription* env; // base grid of the environment
+	double moles_of_gas;
+	double moles_all_gases_in_cm3;
+	std::vector<Probe> probes;
+	std::vector<Sample> samples;
+	std::vector<ActiveFilament> active;
+	std::ofstream file;
+
+	static const int block_rows = 256;
+	static constexpr double cutoff_sigmas = 5;
+	std::vector<double> times;
+	std::vector<std::vector<double>> columns; // one per probe
+	std::vector<double> latest;               // last row
+
+	double evaluate(const Probe& probe, const std::vector<Gaden::Real>* far_field) const;
+};
+
+#endif
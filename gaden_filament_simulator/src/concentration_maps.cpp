@@ -0,0 +1,122 @@
+/*---------------------------------------------------------------------------------------
+ * Time-averaged, peak and time-above-threshold concentration maps.
+ * See concentration_maps.h
+ ---------------------------------------------------------------------------------------*/
+
+#include "filament_simulator/concentration_maps.h"
+#include <math.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/filter/zlib.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/copy.hpp>
+
+CConcentrationMaps::CConcentrationMaps()
+{
+	threshold = 0;
+	moles_all_gases_in_cell = 1;
+	accumulated_time = 0;
+	last_time = 0;
+	factor = 1;
+}
+
+void CConcentrationMaps::configure(const Gaden::EnvironmentDescription& env, double cell_size, double threshold_ppm, double num_moles_all_gases_in_cm3)
+{
+	if (cell_size <= 0)
+		cell_size = env.cell_size;
+	factor = std::max((int)round(cell_size / env.cell_size), 1);
+	env_cells = env.num_cells;
+
+	grid.cell_size = factor * env.cell_size;
+	grid.min_coord = env.min_coord;
+	grid.num_cells.x = (env.num_cells.x + factor - 1) / factor;
+	grid.num_cells.y = (env.num_cells.y + factor - 1) / factor;
+	grid.num_cells.z = (env.num_cells.z + factor - 1) / factor;
+	grid.max_coord = env.max_coord;
+
+	grid.Env.assign(grid.num_cells.x * grid.num_cells.y * grid.num_cells.z, 1);
+	for (int k = 0; k < env.num_cells.z; k++)
+		for (int j = 0; j < env.num_cells.y; j++)
+			for (int i = 0; i < env.num_cells.x; i++)
+			{
+				if (env.Env[Gaden::indexFrom3D(Gaden::Vector3i(i, j, k), env.num_cells)] == 0)
+					grid.Env[Gaden::indexFrom3D(Gaden::Vector3i(i / factor, j / factor, k / factor), grid.num_cells)] = 0;
+			}
+
+	threshold = threshold_ppm;
+	moles_all_gases_in_cell = num_moles_all_gases_in_cm3 * pow(grid.cell_size * 100, 3);
+	integral.assign(grid.Env.size(), 0.0);
+	peak.assign(grid.Env.size(), 0.0);
+	time_above.assign(grid.Env.size(), 0.0);
+	accumulated_time = 0;
+}
+
+void CConcentrationMaps::update(const std::vector<Gaden::Real>& filaments, const std::vector<double>& far_field, double dt, double sim_time)
+{
+	// The cells of the environment are added up into the cells of the maps
+	moles.assign(grid.Env.size(), 0.0);
+	for (int k = 0; k < env_cells.z; k++)
+		for (int j = 0; j < env_cells.y; j++)
+			for (int i = 0; i < env_cells.x; i++)
+			{
+				int env_idx = Gaden::indexFrom3D(Gaden::Vector3i(i, j, k), env_cells);
+				moles[Gaden::indexFrom3D(Gaden::Vector3i(i / factor, j / factor, k / factor), grid.num_cells)] +=
+					filaments[env_idx] + (far_field.empty() ? 0.0 : far_field[env_idx]);
+			}
+
+	// Called from a task of the step loop, where a parallel for would only get one thread: split in tasks of the team instead
+	double to_ppm = pow(10, 6) / moles_all_gases_in_cell;
+	#pragma omp taskloop
+	for (size_t i = 0; i < moles.size(); i++)
+	{
+		double ppm = moles[i] * to_ppm;
+		integral[i] += ppm * dt;
+		peak[i] = std::max(peak[i], ppm);
+		if (ppm > threshold)
+			time_above[i] += dt;
+	}
+	accumulated_time += dt;
+	last_time = sim_time;
+}
+
+bool CConcentrationMaps::save(const std::string& filename) const
+{
+	std::vector<double> mean(integral.size(), 0.0);
+	if (accumulated_time > 0)
+	{
+		for (size_t i = 0; i < integral.size(); i++)
+			mean[i] = integral[i] / accumulated_time;
+	}
+
+	std::stringstream data;
+	int format = 1;
+	double min_coord[3] = { grid.min_coord.x, grid.min_coord.y, grid.min_coord.z };
+	data.write((char*)&format, sizeof(int));
+	data.write((char*)&last_time, sizeof(double));
+	data.write((char*)&accumulated_time, sizeof(double));
+	data.write((char*)&grid.num_cells.x, sizeof(int));
+	data.write((char*)&grid.num_cells.y, sizeof(int));
+	data.write((char*)&grid.num_cells.z, sizeof(int));
+	data.write((char*)min_coord, 3 * sizeof(double));
+	data.write((char*)&grid.cell_size, sizeof(double));
+	data.write((char*)&threshold, sizeof(double));
+	data.write((char*)mean.data(), sizeof(double) * mean.size());
+	data.write((char*)peak.data(), sizeof(double) * peak.size());
+	data.write((char*)time_above.data(), sizeof(double) * time_above.size());
+
+	std::string tmp_filename = filename + ".tmp";
+	{
+		std::ofstream file(tmp_filename, std::ios_base::binary);
+		if (!file.is_open())
+			return false;
+		boost::iostreams::filtering_streambuf<boost::iostreams::input> inbuf;
+		inbuf.push(boost::iostreams::zlib_compressor());
+		inbuf.push(data);
+		boost::iostreams::copy(inbuf, file);
+	}
+	boost::system::error_code error;
+	boost::filesystem::rename(tmp_filename, filename, error);
+	return !error;
+}
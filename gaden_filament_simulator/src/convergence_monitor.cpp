@@ -0,0 +1,120 @@
+/*---------------------------------------------------------------------------------------
+ * Detection of a statistically steady plume from windowed means.
+ * See convergence_monitor.h
+ ---------------------------------------------------------------------------------------*/
+
+#include "filament_simulator/convergence_monitor.h"
+#include <math.h>
+#include <algorithm>
+
+CConvergenceMonitor::CConvergenceMonitor()
+{
+	window = 0;
+	tolerance = 0;
+	window_start = -1;
+	samples = 0;
+	steady_time = -1;
+	worst = -1;
+	worst_relative_change = 0;
+}
+
+void CConvergenceMonitor::configure(double window_length, double tolerance_fraction, const std::vector<std::string>& quantity_names,
+	const std::vector<bool>& quantity_relative)
+{
+	window = window_length;
+	tolerance = tolerance_fraction;
+	names = quantity_names;
+	relative = quantity_relative;
+	sum.assign(names.size(), 0.0);
+	floor_sum.assign(names.size(), 0.0);
+	previous_mean.clear();
+	previous_floor.clear();
+	window_start = -1;
+	samples = 0;
+	steady_time = -1;
+	worst = -1;
+	worst_relative_change = 0;
+}
+
+bool CConvergenceMonitor::enabled() const
+{
+	return window > 0;
+}
+
+bool CConvergenceMonitor::add(double sim_time, const std::vector<double>& values, const std::vector<double>& floors)
+{
+	if (!enabled() || converged())
+		return false;
+
+	if (window_start < 0)
+		window_start = sim_time;
+	for (size_t q = 0; q < names.size(); q++)
+	{
+		sum[q] += values[q];
+		floor_sum[q] += floors[q];
+	}
+	samples++;
+
+	if (sim_time - window_start < window - 1e-6)
+		return false;
+
+	// The window is complete: compare it with the previous one
+	std::vector<double> mean(names.size()), floor(names.size());
+	for (size_t q = 0; q < names.size(); q++)
+	{
+		mean[q] = sum[q] / samples;
+		floor[q] = floor_sum[q] / samples;
+	}
+
+	bool steady = !previous_mean.empty();
+	if (steady)
+	{
+		worst = -1;
+		worst_relative_change = 0;
+		for (size_t q = 0; q < names.size(); q++)
+		{
+			double scale = std::max(floor[q], previous_floor[q]);
+			if (relative[q])
+				scale = std::max({ scale, std::abs(mean[q]), std::abs(previous_mean[q]) });
+			double change = scale > 0 ? std::abs(mean[q] - previous_mean[q]) / scale : 0;
+			if (worst < 0 || change > worst_relative_change)
+			{
+				worst = q;
+				worst_relative_change = change;
+			}
+		}
+		steady = worst_relative_change <= tolerance;
+	}
+
+	previous_mean = mean;
+	previous_floor = floor;
+	std::fill(sum.begin(), sum.end(), 0.0);
+	std::fill(floor_sum.begin(), floor_sum.end(), 0.0);
+	samples = 0;
+	window_start = sim_time;
+
+	if (steady)
+		steady_time = sim_time;
+	return steady;
+}
+
+bool CConvergenceMonitor::converged() const
+{
+	return steady_time >= 0;
+}
+
+double CConvergenceMonitor::convergence_time() const
+{
+	return steady_time;
+}
+
+const std::string& CConvergenceMonitor::worst_quantity() const
+{
+	static const std::string none = "";
+	return worst >= 0 ? names[worst] : none;
+}
+
+double CConvergenceMonitor::worst_change() const
+{
+	return worst_relative_change;
+}
@@ -0,0 +1,70 @@
+/*---------------------------------------------------------------------------------------
+ * Online statistics over the realizations of an ensemble simulation.
+ * See ensemble_statistics.h
+ ---------------------------------------------------------------------------------------*/
+
+#include "filament_simulator/ensemble_statistics.h"
+#include <fstream>
+#include <sstream>
+#include <boost/iostreams/filter/zlib.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/copy.hpp>
+
+CEnsembleStatistics::CEnsembleStatistics(size_t num_cells, double exceedance_threshold_ppm)
+	: num_members(0), threshold(exceedance_threshold_ppm), mean(num_cells, 0.0), m2(num_cells, 0.0), exceedance(num_cells, 0.0)
+{
+}
+
+void CEnsembleStatistics::add_member(const std::vector<Gaden::Real>& concentration)
+{
+	// Called from the thread that runs the steps (see take_ensemble_snapshot): split in tasks of the team
+	num_members++;
+	#pragma omp taskloop
+	for (size_t i = 0; i < mean.size(); i++)
+	{
+		double value = concentration[i];
+		double delta = value - mean[i];
+		mean[i] += delta / num_members;
+		m2[i] += delta * (value - mean[i]);
+		if (value > threshold)
+			exceedance[i]++;
+	}
+}
+
+bool CEnsembleStatistics::save(const std::string& filename, double sim_time, const Gaden::EnvironmentDescription& env) const
+{
+	std::vector<double> variance(mean.size(), 0.0);
+	std::vector<double> probability(mean.size(), 0.0);
+	for (size_t i = 0; i < mean.size(); i++)
+	{
+		if (num_members > 1)
+			variance[i] = m2[i] / (num_members - 1);
+		if (num_members > 0)
+			probability[i] = exceedance[i] / num_members;
+	}
+
+	std::stringstream data;
+	int format = 1;
+	double min_coord[3] = { env.min_coord.x, env.min_coord.y, env.min_coord.z };
+	data.write((char*)&format, sizeof(int));
+	data.write((char*)&sim_time, sizeof(double));
+	data.write((char*)&num_members, sizeof(int));
+	data.write((char*)&env.num_cells.x, sizeof(int));
+	data.write((char*)&env.num_cells.y, sizeof(int));
+	data.write((char*)&env.num_cells.z, sizeof(int));
+	data.write((char*)min_coord, 3 * sizeof(double));
+	data.write((char*)&env.cell_size, sizeof(double));
+	data.write((char*)&threshold, sizeof(double));
+	data.write((char*)mean.data(), sizeof(double) * mean.size());
+	data.write((char*)variance.data(), sizeof(double) * variance.size());
+	data.write((char*)probability.data(), sizeof(double) * probability.size());
+
+	std::ofstream file(filename, std::ios_base::binary);
+	if (!file.is_open())
+		return false;
+	boost::iostreams::filtering_streambuf<boost::iostreams::input> inbuf;
+	inbuf.push(boost::iostreams::zlib_compressor());
+	inbuf.push(data);
+	boost::iostreams::copy(inbuf, file);
+	return true;
+}
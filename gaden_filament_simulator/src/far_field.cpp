@@ -0,0 +1,226 @@
+/*---------------------------------------------------------------------------------------
+ * Far field of the hybrid Lagrangian-Eulerian model: a grid of gas advected and diffused
+ * with the wind. See far_field.h
+ ---------------------------------------------------------------------------------------*/
+
+#include "filament_simulator/far_field.h"
+#include <math.h>
+#include <float.h>
+#include <algorithm>
+#include <sstream>
+
+CFarField::CFarField()
+{
+	env = nullptr;
+	diffusivity = 0;
+	max_substep = DBL_MAX;
+	deposited = 0;
+	removed = 0;
+}
+
+void CFarField::configure(const Gaden::EnvironmentDescription& environment, double diffusivity_m2, double sigma_bin_ratio)
+{
+	env = &environment;
+	diffusivity = diffusivity_m2;
+	rasterizer = Gaden::GaussianRasterizer(sigma_bin_ratio);
+
+	size_t num_cells = (size_t)env->num_cells.x * env->num_cells.y * env->num_cells.z;
+	grid.assign(num_cells, 0.0);
+	next.assign(num_cells, 0.0);
+	for (std::vector<Gaden::Real>& velocity : face_velocity)
+		velocity.assign(num_cells, 0.0);
+
+	outlets.clear();
+	for (size_t i = 0; i < num_cells; i++)
+	{
+		if (env->Env[i] == 2)
+			outlets.push_back(i);
+	}
+	max_substep = DBL_MAX;
+	deposited = 0;
+	removed = 0;
+}
+
+bool CFarField::enabled() const
+{
+	return env != nullptr;
+}
+
+// Free cells and outlets take part in the transport, obstacles do not
+bool CFarField::is_open(int x, int y, int z) const
+{
+	return env->Env[Gaden::indexFrom3D(Gaden::Vector3i(x, y, z), env->num_cells)] != 1;
+}
+
+void CFarField::set_wind(const Gaden::WindField& wind)
+{
+	const int nx = env->num_cells.x, ny = env->num_cells.y, nz = env->num_cells.z;
+	const double h = env->cell_size;
+	std::vector<double> plane_rate(nz, 0.0); // max outflow rate [1/s] of the cells of each plane
+
+	#pragma omp taskloop
+	for (int z = 0; z < nz; z++)
+	{
+		for (int y = 0; y < ny; y++)
+		{
+			for (int x = 0; x < nx; x++)
+			{
+				size_t c = Gaden::indexFrom3D(Gaden::Vector3i(x, y, z), env->num_cells);
+				const Gaden::WindVector& w = wind.at(x, y, z);
+				bool open = is_open(x, y, z);
+				face_velocity[0][c] = open && x + 1 < nx && is_open(x + 1, y, z) ? 0.5 * (w.u + wind.at(x + 1, y, z).u) : 0;
+				face_velocity[1][c] = open && y + 1 < ny && is_open(x, y + 1, z) ? 0.5 * (w.v + wind.at(x, y + 1, z).v) : 0;
+				face_velocity[2][c] = open && z + 1 < nz && is_open(x, y, z + 1) ? 0.5 * (w.w + wind.at(x, y, z + 1).w) : 0;
+			}
+		}
+	}
+
+	// Stability: in one substep, no cell can lose more than it holds
+	#pragma omp taskloop
+	for (int z = 0; z < nz; z++)
+	{
+		for (int y = 0; y < ny; y++)
+		{
+			for (int x = 0; x < nx; x++)
+			{
+				size_t c = Gaden::indexFrom3D(Gaden::Vector3i(x, y, z), env->num_cells);
+				double outflow = std::max<double>(face_velocity[0][c], 0) + std::max<double>(face_velocity[1][c], 0) + std::max<double>(face_velocity[2][c], 0);
+				if (x > 0)
+					outflow += std::max<double>(-face_velocity[0][c - 1], 0);
+				if (y > 0)
+					outflow += std::max<double>(-face_velocity[1][c - nx], 0);
+				if (z > 0)
+					outflow += std::max<double>(-face_velocity[2][c - (size_t)nx * ny], 0);
+				plane_rate[z] = std::max(plane_rate[z], outflow / h);
+			}
+		}
+	}
+
+	double max_rate = 6 * diffusivity / (h * h);
+	max_rate += *std::max_element(plane_rate.begin(), plane_rate.end());
+	max_substep = max_rate > 0 ? 0.9 / max_rate : DBL_MAX;
+}
+
+void CFarField::deposit(const std::vector<Gaden::GaussianSource>& sources)
+{
+	if (sources.empty())
+		return;
+
+	double moles = 0;
+	for (const Gaden::GaussianSource& source : sources)
+		moles += source.moles;
+
+	rasterizer.rasterize(*env, sources, deposit_buffer);
+	double landed = 0;
+	for (Gaden::Real value : deposit_buffer)
+		landed += value;
+	if (landed <= 0)
+		return;
+
+	double scale = moles / landed;
+	for (size_t i = 0; i < grid.size(); i++)
+		grid[i] += scale * deposit_buffer[i];
+	deposited += moles;
+}
+
+void CFarField::restore(const std::vector<double>& moles)
+{
+	grid.assign(moles.begin(), moles.end());
+	deposited = 0;
+	for (Gaden::Real value : grid)
+		deposited += value;
+}
+
+void CFarField::step(double dt)
+{
+	if (dt <= 0)
+		return;
+
+	const int nx = env->num_cells.x, ny = env->num_cells.y, nz = env->num_cells.z;
+	const size_t plane = (size_t)nx * ny;
+	const int substeps = std::max((int)ceil(dt / max_substep), 1);
+	const double advection = dt / substeps / env->cell_size;                           // per (m/s) of face velocity
+	const double diffusion = diffusivity * dt / substeps / (env->cell_size * env->cell_size); // per unit of difference
+
+	// Gas that goes from a cell (m) to its neighbour (n) across a face with velocity u (positive towards the neighbour)
+	auto flux = [advection, diffusion](double m, double n, double u) { return advection * u * (u > 0 ? m : n) + diffusion * (m - n); };
+
+	for (int s = 0; s < substeps; s++)
+	{
+		#pragma omp taskloop
+		for (int z = 0; z < nz; z++)
+		{
+			for (int y = 0; y < ny; y++)
+			{
+				for (int x = 0; x < nx; x++)
+				{
+					size_t c = x + y * (size_t)nx + z * plane;
+					if (!is_open(x, y, z))
+					{
+						next[c] = 0;
+						continue;
+					}
+
+					double m = grid[c];
+					double out = 0;
+					if (x + 1 < nx && is_open(x + 1, y, z))
+						out += flux(m, grid[c + 1], face_velocity[0][c]);
+					if (x > 0 && is_open(x - 1, y, z))
+						out += flux(m, grid[c - 1], -face_velocity[0][c - 1]);
+					if (y + 1 < ny && is_open(x, y + 1, z))
+						out += flux(m, grid[c + nx], face_velocity[1][c]);
+					if (y > 0 && is_open(x, y - 1, z))
+						out += flux(m, grid[c - nx], -face_velocity[1][c - nx]);
+					if (z + 1 < nz && is_open(x, y, z + 1))
+						out += flux(m, grid[c + plane], face_velocity[2][c]);
+					if (z > 0 && is_open(x, y, z - 1))
+						out += flux(m, grid[c - plane], -face_velocity[2][c - plane]);
+					next[c] = m - out;
+				}
+			}
+		}
+
+		for (size_t outlet : outlets)
+		{
+			removed += next[outlet];
+			next[outlet] = 0;
+		}
+		grid.swap(next);
+	}
+}
+
+const std::vector<Gaden::Real>& CFarField::moles() const
+{
+	return grid;
+}
+
+double CFarField::total_moles() const
+{
+	double total = 0;
+	for (Gaden::Real value : grid)
+		total += value;
+	return total;
+}
+
+double CFarField::deposited_moles() const
+{
+	return deposited;
+}
+
+double CFarField::removed_moles() const
+{
+	return removed;
+}
+
+std::string CFarField::serialize(const std::vector<double>& moles, double sim_time, const Gaden::Vector3i& num_cells)
+{
+	std::stringstream data;
+	int format = 1;
+	data.write((char*)&format, sizeof(int));
+	data.write((char*)&sim_time, sizeof(double));
+	data.write((char*)&num_cells.x, sizeof(int));
+	data.write((char*)&num_cells.y, sizeof(int));
+	data.write((char*)&num_cells.z, sizeof(int));
+	data.write((char*)moles.data(), sizeof(double) * moles.size());
+	return data.str();
+}
@@ -20,6 +20,7 @@ CFilament::CFilament()
 	sigma = 0.01; //[cm] The sigma of a 3D gaussian (controlls the shape of the filament)
 	birth_time = 0.0;
 	valid = false;
+	id = -1;
 }
 
 // Overload Constructor
@@ -32,6 +33,7 @@ CFilament::CFilament(double x, double y, double z, double sigma_filament)
 	sigma = sigma_filament; //[cm] The sigma of a 3D gaussian (controlls the shape of the filament)
 	birth_time = 0.0;
 	valid = false;
+	id = -1;
 }
 
 CFilament::~CFilament()
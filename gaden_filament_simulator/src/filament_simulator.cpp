@@ -22,7 +22,9 @@
  * of the “visualization msgs/markers”. At each time step, “Dispersal_Simulation” node calculates or
  * determines the positions of n filaments. Gas plumes are simulated with or without acceleration.
  *
- * It is very time consuming, and currently it runs in just one thread (designed to run offline).
+ * It is very time consuming (designed to run offline). Each step is run as a task graph on the OpenMP team:
+ * advection is split in tasks, and saving/visualization work on immutable snapshots of the filaments,
+ * so they overlap with the following steps.
  *
  * TODO: Cambiar std::vector por std::list para los FILAMENTOS
  ---------------------------------------------------------------------------------------*/
@@ -32,11 +34,12 @@
  //==========================//
  //      Constructor         //
  //==========================//
-CFilamentSimulator::CFilamentSimulator()
-	: rclcpp::Node("Gaden_filament_simulator")
+CFilamentSimulator::CFilamentSimulator(bool max_speed_arg)
+	: rclcpp::Node("Gaden_filament_simulator"), marker_queue(2)
 {
 	// Init variables
 	//-----------------
+	max_speed = max_speed_arg;
 	sim_time = 0.0;                          // Start at time = 0(sec)
 	sim_time_last_wind = -2 * windTime_step; // Force to load wind-data on startup
 	current_wind_snapshot = 0;               // Start with wind_iter= 0;
@@ -48,30 +51,57 @@ CFilamentSimulator::CFilamentSimulator()
 
 	loadNodeParameters();
 
-	// Create directory to save results (if needed)
-	if (save_results && !boost::filesystem::exists(results_location))
+	// Create directory to save results (if needed). The probes and the maps are written there even if the filaments are not saved
+	bool writes_results = save_results || !probe_points.empty() || !probe_lines.empty() || maps_stride > 0;
+	if (writes_results && !boost::filesystem::exists(results_location))
 		if (!boost::filesystem::create_directories(results_location))
 			RCLCPP_ERROR(get_logger(), "[filament] Could not create result directory: %s", results_location.c_str());
 
-	if (save_results && !boost::filesystem::exists(results_location + "/wind"))
+	if (save_results && results_format == "files" && !boost::filesystem::exists(results_location + "/wind"))
 		if (!boost::filesystem::create_directories(results_location + "/wind"))
 			RCLCPP_ERROR(get_logger(), "[filament] Could not create result directory: %s/wind", results_location.c_str());
 
+	// The saved realizations of an ensemble get their own folder, sharing the wind snapshots
+	for (int member : ensemble_save_members)
+	{
+		std::string member_location = boost::str(boost::format("%s/member_%i") % results_location % member);
+		if (save_results && !boost::filesystem::exists(member_location + "/wind"))
+		{
+			boost::filesystem::create_directories(member_location);
+			boost::filesystem::create_directory_symlink("../wind", member_location + "/wind");
+		}
+	}
+
 	// Set Publishers and Subscribers
 	//-------------------------------
 	marker_pub = create_publisher<visualization_msgs::msg::Marker>("filament_visualization", 1);
 
+	clock_pub = create_publisher<rosgraph_msgs::msg::Clock>("/clock", rclcpp::ClockQoS());
+
+	// Everything ROS-related runs on the executor thread (see main). The simulation loop only pushes snapshots to a
+	// lock-free queue, and this timer takes care of publishing them
+	using namespace std::literals::chrono_literals;
+	publish_timer = create_wall_timer(20ms, std::bind(&CFilamentSimulator::publishCB, this));
+
 	// Wait preprocessing Node to finish?
 	preprocessing_done = false;
 	if (wait_preprocessing)
-	{
 		prepro_sub = create_subscription<std_msgs::msg::Bool>("preprocessing_done", 1, std::bind(&CFilamentSimulator::preprocessingCB, this, std::placeholders::_1));
+}
+
+//==========================//
+//      Initialization      //
+//==========================//
+// Must be called once the ROS executor is running (the preprocessing_done message is received by it)
+void CFilamentSimulator::initialize()
+{
+	if (wait_preprocessing)
+	{
+		std::unique_lock<std::mutex> lock(preprocessing_mtx);
 		while (rclcpp::ok() && !preprocessing_done)
 		{
-			using namespace std::literals::chrono_literals;
-			rclcpp::sleep_for(std::chrono::duration_cast<std::chrono::nanoseconds>(0.5s));
-			rclcpp::spin_some(shared_from_this());
-			if (verbose)
+			preprocessing_cv.wait_for(lock, std::chrono::milliseconds(500));
+			if (verbose && !preprocessing_done)
 				RCLCPP_INFO(get_logger(), "[filament] Waiting for node GADEN_preprocessing to end.");
 		}
 	}
@@ -99,7 +129,7 @@ CFilamentSimulator::CFilamentSimulator()
 	// Given the ppm value at the center of the filament, we approximate the total number of gas moles in that filament.
 	double numMoles_in_cm3 = envPressure / (R * envTemperature);                                                       //[mol of all gases/cm³]
 	double filament_moles_cm3_center = filament_ppm_center / pow(10, 6) * numMoles_in_cm3;                             //[moles of target gas / cm³]
-	filament_numMoles_of_gas = filament_moles_cm3_center * (sqrt(8 * pow(3.14159, 3)) * pow(filament_initial_std, 3)); // total number of moles in a filament
+	filament_numMoles_of_gas = filament_moles_cm3_center * (sqrt(8 * pow(M_PI, 3)) * pow(filament_initial_std, 3)); // total number of moles in a filament
 
 	if (verbose)
 		RCLCPP_INFO(get_logger(), "[filament] filament_initial_vol [cm3]: %f", filament_initial_vol);
@@ -111,6 +141,9 @@ CFilamentSimulator::CFilamentSimulator()
 		RCLCPP_INFO(get_logger(), "[filament] env_cell_numMoles [mol]: %E", env_cell_numMoles);
 	if (verbose)
 		RCLCPP_INFO(get_logger(), "[filament] filament_numMoles_of_gas [mol]: %E", filament_numMoles_of_gas);
+	if (verbose)
+		RCLCPP_INFO(get_logger(), "[filament] Gaussian kernel: %s", Gaden::simdLevelName(Gaden::simdLevel()));
+	select_step_kernels();
 
 	// Init visualization
 	//-------------------
@@ -121,6 +154,123 @@ CFilamentSimulator::CFilamentSimulator()
 	filament_marker.type = visualization_msgs::msg::Marker::POINTS;
 	filament_marker.color.a = 1;
 
+	output_filter.set_min_peak_ppm(output_min_peak_ppm, filament_numMoles_of_gas, env_cell_numMoles / env_cell_vol);
+	if (output_filter.enabled())
+		RCLCPP_INFO(get_logger(), "[filament] Saving only the filaments that pass the output filters: %s", output_filter.describe().c_str());
+
+	// Continue from the state of a previous simulation (skips the spin-up of the plume). Before opening the results archive,
+	// which can not be the source
+	if (warm_start_file != "" && !load_warm_start(warm_start_file))
+	{
+		RCLCPP_ERROR(get_logger(), "[filament] Could not warm start from %s. Exiting.", warm_start_file.c_str());
+		exit(-1);
+	}
+
+	// Results archive (needs the environment and the gas constants for its header)
+	if (save_results && results_format == "archive")
+		open_results_archive();
+
+	// Load the first Wind snapshot from file (all 3 components U,V,W). After a warm start, the one of the stored time is
+	// loaded at the first step
+	read_wind_snapshot(0);
+
+	if (ensemble_size > 1)
+		init_ensemble();
+
+	if (!probe_points.empty() || !probe_lines.empty())
+	{
+		std::string filename = results_location + "/probes";
+		if (!probes.configure(environment, probe_points, probe_lines, filament_numMoles_of_gas, env_cell_numMoles / env_cell_vol, filename))
+			RCLCPP_ERROR(get_logger(), "[filament] Cannot create the probes file %s. The probes are disabled", filename.c_str());
+	}
+
+	if (live_exchange_name != "")
+	{
+		if (live_exchange.open(live_exchange_name, results_header(), filaments.size(), far_field_sigma_cells > 0))
+			RCLCPP_INFO(get_logger(), "[filament] Publishing the simulation state in shared memory '%s' (play it with simulation_data: live:%s)", live_exchange_name.c_str(), live_exchange_name.c_str());
+		else
+			RCLCPP_ERROR(get_logger(), "[filament] Could not create the shared memory segment '%s'. The live exchange is disabled", live_exchange_name.c_str());
+	}
+
+	if (far_field_sigma_cells > 0)
+		init_far_field();
+	if (!warm_start_far_field.empty() && !far_field.enabled())
+		RCLCPP_WARN(get_logger(), "[filament] Warm start: the previous run had a far field, and this one has none. Its gas is dropped");
+
+	if (convergence_window > 0)
+		init_convergence();
+
+	if (maps_stride > 0)
+		concentration_maps.configure(envDesc, maps_cell_size, maps_threshold_ppm, env_cell_numMoles / env_cell_vol);
+}
+
+// Everything was allocated and filled by the main thread. Pin the team and spread the pages of the big arrays over the nodes:
+// every thread reads the grids at random positions, and gets a different share of the filaments on every step
+void CFilamentSimulator::configure_memory()
+{
+	int pinned = Gaden::pinOpenMPThreads(thread_affinity);
+	if (pinned > 0)
+		RCLCPP_INFO(get_logger(), "[filament] Pinned %d threads (%s)", pinned, thread_affinity == Gaden::ThreadAffinity::CLOSE ? "close" : "spread");
+
+	size_t num_nodes = Gaden::numaNodes().size();
+	if (memory_policy != Gaden::MemoryPolicy::DEFAULT && num_nodes < 2)
+		RCLCPP_INFO(get_logger(), "[filament] Single NUMA node, memory_policy has no effect");
+
+	wind.setPlacement(memory_policy, huge_pages); // the wind is loaded later: it is placed every time its storage grows
+	Gaden::placeArray(C, memory_policy, huge_pages);
+	Gaden::placeArray(envDesc.Env, memory_policy, huge_pages);
+	for (RefinementLevel& level : refinement_levels)
+	{
+		level.wind.setPlacement(memory_policy, huge_pages);
+		Gaden::placeArray(level.env.Env, memory_policy, huge_pages);
+	}
+
+	Gaden::placeArray(filaments, memory_policy, huge_pages);
+	if (morton_sort_interval > 0)
+	{
+		// Allocated here, so it is placed too (sort_filaments only uses the first current_number_filaments)
+		sorted_filaments.resize(filaments.size());
+		Gaden::placeArray(sorted_filaments, memory_policy, huge_pages);
+	}
+	for (EnsembleMember& member : ensemble_members)
+		Gaden::placeArray(member.filaments, memory_policy, huge_pages);
+
+	if (verbose && (memory_policy != Gaden::MemoryPolicy::DEFAULT || huge_pages))
+		RCLCPP_INFO(get_logger(), "[filament] Memory placement applied (%zu NUMA nodes, huge pages %s)", num_nodes, huge_pages ? "on" : "off");
+}
+
+// All the realizations start from the same state (empty, or the warm start)
+void CFilamentSimulator::init_ensemble()
+{
+	ensemble_members.resize(ensemble_size);
+	for (int member = 1; member < ensemble_size; member++)
+	{
+		ensemble_members[member].filaments = filaments;
+		ensemble_members[member].current_number_filaments = current_number_filaments;
+		ensemble_members[member].numFilament_aux = numFilament_aux;
+		ensemble_members[member].filament_stop_counter = filament_stop_counter;
+	}
+	active_member = 0;
+	RCLCPP_INFO(get_logger(), "[filament] Ensemble of %d realizations", ensemble_size);
+}
+
+void CFilamentSimulator::swap_member_state(EnsembleMember& member)
+{
+	filaments.swap(member.filaments);
+	std::swap(current_number_filaments, member.current_number_filaments);
+	std::swap(numFilament_aux, member.numFilament_aux);
+	std::swap(filament_stop_counter, member.filament_stop_counter);
+	std::swap(retired_filaments, member.retired_filaments);
+}
+
+// Make the given realization the one the simulation methods work on
+void CFilamentSimulator::select_member(int member)
+{
+	if (member == active_member)
+		return;
+	swap_member_state(ensemble_members[active_member]); // store the active one
+	swap_member_state(ensemble_members[member]);
+	active_member = member;
 }
 
 CFilamentSimulator::~CFilamentSimulator()
@@ -132,7 +282,68 @@ CFilamentSimulator::~CFilamentSimulator()
 //==============================//
 void CFilamentSimulator::preprocessingCB(const std_msgs::msg::Bool::SharedPtr b)
 {
-	preprocessing_done = true;
+	{
+		std::lock_guard<std::mutex> lock(preprocessing_mtx);
+		preprocessing_done = true;
+	}
+	preprocessing_cv.notify_all();
+}
+
+//==============================//
+//      Publishing (ROS thread) //
+//==============================//
+// Publishes whatever the simulation loop has produced since the last call. Runs on the executor thread,
+// so the simulation never waits for DDS
+void CFilamentSimulator::publishCB()
+{
+	std::shared_ptr<const FilamentSnapshot> snapshot, latest;
+	while (marker_queue.pop(snapshot))
+		latest = snapshot; // if the simulation is faster than the visualization, only the most recent state is shown
+	if (latest)
+		publish_markers(*latest);
+
+	if (max_speed)
+	{
+		double time = published_sim_time.load(std::memory_order_relaxed);
+		if (time != last_clock_time)
+		{
+			rosgraph_msgs::msg::Clock clock;
+			clock.clock = rclcpp::Time((int64_t)(time * 1e9));
+			clock_pub->publish(clock);
+			last_clock_time = time;
+		}
+	}
+}
+
+// Sample the probes (every probe_stride steps)
+void CFilamentSimulator::record_probes()
+{
+	if (probes.enabled() && current_simulation_step % probe_stride == 0)
+		probes.record(filaments, current_number_filaments, far_field.enabled() ? &far_field.moles() : nullptr, sim_time);
+}
+
+// Hands the state of the current step over to the ROS thread (never blocks)
+void CFilamentSimulator::notify_step()
+{
+	published_sim_time.store(sim_time, std::memory_order_relaxed);
+	if (!marker_queue.full())
+		marker_queue.push(take_snapshot());
+
+	if (live_exchange.is_open())
+	{
+		// A reader holding the lock delays the state to the next step. One that keeps it (it died while copying) would
+		// slow every step down by the timeout, so after a while the exchange is given up
+		size_t dropped;
+		if (live_exchange.publish(sim_time, last_wind_idx, wind, filaments, far_field.enabled() ? &far_field.moles() : nullptr, dropped))
+			live_exchange_skipped = 0;
+		else if (++live_exchange_skipped >= 1000)
+		{
+			RCLCPP_ERROR(get_logger(), "[filament] The live exchange has been locked by a reader for %d steps. It is disabled", live_exchange_skipped);
+			live_exchange.close();
+		}
+		if (dropped > 0)
+			RCLCPP_WARN(get_logger(), "[filament] %zu filaments did not fit in the live exchange", dropped);
+	}
 }
 
 //==========================//
@@ -144,6 +355,9 @@ void CFilamentSimulator::loadNodeParameters()
 	// Verbose
 	verbose = declare_parameter<bool>("verbose", false);
 
+	// Run as fast as possible, publishing the simulation time on /clock (can also be set with the --max-speed argument)
+	max_speed = declare_parameter<bool>("max_speed", false) || max_speed;
+
 	// Wait PreProcessing
 	wait_preprocessing = declare_parameter<bool>("wait_preprocessing", false);
 
@@ -178,6 +392,17 @@ void CFilamentSimulator::loadNodeParameters()
 	// [cm] Sigma of the white noise added on each iteration
 	filament_noise_std = declare_parameter<double>("filament_noise_std", 0.1);
 
+	// Move the filaments with the terminal velocity of their buoyant rise (or fall), given by the specific gravity of the gas
+	buoyancy = declare_parameter<bool>("buoyancy", false);
+
+	// [ppm] Retire the filaments whose peak concentration has dropped below this (0 = keep them until they reach an outlet).
+	// At most retirement_max_mass_fraction of the gas released so far can be retired (1 = no limit)
+	retirement_min_peak_ppm = declare_parameter<double>("retirement_min_peak_ppm", 0.0);
+	retirement_max_mass_fraction = std::min(std::max(declare_parameter<double>("retirement_max_mass_fraction", 1.0), 0.0), 1.0);
+
+	// Hand the filaments wider than this many cells over to a grid that is advected and diffused with the wind (0 = disabled)
+	far_field_sigma_cells = declare_parameter<double>("far_field_sigma_cells", 0.0);
+
 	// Gas Type ID
 	gasType = declare_parameter<int>("gas_type", 1);
 
@@ -200,11 +425,24 @@ void CFilamentSimulator::loadNodeParameters()
 	allow_looping = declare_parameter<bool>("allow_looping", false);
 	loop_from_step = declare_parameter<int>("loop_from_step", 1);
 	loop_to_step = declare_parameter<int>("loop_to_step", 100);
+	// Keep the decoded wind snapshots in memory (MB), so they are only read once when looping
+	wind_cache_size_mb = declare_parameter<int>("wind_cache_size_mb", 0);
+	wind_cache.setBudget((size_t)std::max(wind_cache_size_mb, 0) * 1024 * 1024);
 
 	// ENVIRONMENT
 	//-----------
 	//  Occupancy gridmap 3D location
 	occupancy3D_data = declare_parameter<std::string>("occupancy3D_data", "");
+	// Nested refinement: one occupancy file and one wind sequence per patch (the output of the preprocessing of the patch,
+	// with a smaller cell size). They must be inside the environment. wind_cache_size_mb applies to each patch as well
+	refinement_occupancy3D_data = declare_parameter<std::vector<std::string>>("refinement_occupancy3D_data", std::vector<std::string>());
+	refinement_wind_data = declare_parameter<std::vector<std::string>>("refinement_wind_data", std::vector<std::string>());
+	if (refinement_wind_data.size() != refinement_occupancy3D_data.size())
+	{
+		RCLCPP_ERROR(get_logger(), "[filament] refinement_occupancy3D_data and refinement_wind_data must have the same length. Refinement disabled");
+		refinement_occupancy3D_data.clear();
+		refinement_wind_data.clear();
+	}
 
 	// fixed frame (to disaply the gas particles on RVIZ)
 	fixed_frame = declare_parameter<std::string>("fixed_frame", "map");
@@ -217,6 +455,14 @@ void CFilamentSimulator::loadNodeParameters()
 	// Simulation results.
 	save_results = declare_parameter<int>("save_results", 1);
 	results_location = declare_parameter<std::string>("results_location", "");
+	// "files": one iteration_<n> file per save, plus the wind/ folder
+	// "archive": a single indexed file (results_location/simulation.gaden) with all the iterations and wind snapshots
+	results_format = declare_parameter<std::string>("results_format", "files");
+	if (results_format != "files" && results_format != "archive")
+	{
+		RCLCPP_ERROR(get_logger(), "[filament] Unknown results_format '%s'. Using 'files'", results_format.c_str());
+		results_format = "files";
+	}
 
 	if (save_results && !boost::filesystem::exists(results_location))
 	{
@@ -227,6 +473,129 @@ void CFilamentSimulator::loadNodeParameters()
 	results_min_time = declare_parameter<double>("results_min_time", 0.0);
 	results_time_step = declare_parameter<double>("results_time_step", 1.0);
 
+	// Save every results_time_step ("fixed"), or only when the plume has changed since the last save ("on_change").
+	// In that case results_time_step is how often the change is checked
+	results_policy = declare_parameter<std::string>("results_policy", "fixed");
+	if (results_policy != "fixed" && results_policy != "on_change")
+	{
+		RCLCPP_WARN(get_logger(), "[filament] Unknown results_policy '%s'. Using 'fixed'", results_policy.c_str());
+		results_policy = "fixed";
+	}
+	results_change_tolerance = declare_parameter<double>("results_change_tolerance", 0.1);
+	results_max_gap = declare_parameter<double>("results_max_gap", 30.0);
+
+	// Warm start from the results of a previous simulation
+	warm_start_file = declare_parameter<std::string>("warm_start_file", "");
+	warm_start_time = declare_parameter<double>("warm_start_time", -1.0);
+	warm_start_iteration = declare_parameter<int>("warm_start_iteration", -1); // of a results archive (-1 = the last one)
+
+	// Only save the filaments that matter: regions of interest and minimum peak concentration
+	// boxes: [xmin ymin zmin xmax ymax zmax, ...] polygon: [x0 y0 x1 y1 ...] polygon_z: [zmin zmax]
+	std::vector<double> roi_boxes = declare_parameter<std::vector<double>>("output_roi_boxes", std::vector<double>());
+	std::vector<double> roi_polygon = declare_parameter<std::vector<double>>("output_roi_polygon", std::vector<double>());
+	std::vector<double> roi_polygon_z = declare_parameter<std::vector<double>>("output_roi_polygon_z", std::vector<double>());
+	output_filter.set_regions(roi_boxes, roi_polygon, roi_polygon_z);
+	output_min_peak_ppm = declare_parameter<double>("output_min_peak_ppm", 0.0);
+
+	// Max number of snapshots that can be waiting to be saved while the simulation keeps going
+	max_pending_io_tasks = declare_parameter<int>("max_pending_io_tasks", 4);
+
+	// How to compute the gas concentration grid: "splat" (evaluate each filament) or "binned" (sigma bins + separable convolution)
+	concentration_rasterizer = declare_parameter<std::string>("concentration_rasterizer", "splat");
+	if (concentration_rasterizer != "splat" && concentration_rasterizer != "binned")
+	{
+		RCLCPP_WARN(get_logger(), "[filament] Unknown concentration_rasterizer '%s'. Using 'splat'", concentration_rasterizer.c_str());
+		concentration_rasterizer = "splat";
+	}
+	rasterizer_sigma_bin_ratio = declare_parameter<double>("rasterizer_sigma_bin_ratio", 1.1);
+	rasterizer = Gaden::GaussianRasterizer(rasterizer_sigma_bin_ratio);
+
+	// Ensemble mode: advance several realizations together, and save the statistics of their concentration grids
+	ensemble_size = std::max(declare_parameter<int>("ensemble_size", 1), 1);
+	ensemble_exceedance_ppm = declare_parameter<double>("ensemble_exceedance_ppm", 1.0);
+	for (int64_t member : declare_parameter<std::vector<int64_t>>("ensemble_save_members", std::vector<int64_t>()))
+	{
+		if (member >= 0 && member < ensemble_size)
+			ensemble_save_members.push_back(member);
+		else
+			RCLCPP_WARN(get_logger(), "[filament] ensemble_save_members: there is no realization %ld", member);
+	}
+	if (ensemble_size > 1 && results_format != "files")
+	{
+		RCLCPP_WARN(get_logger(), "[filament] The results of an ensemble are always saved as files");
+		results_format = "files";
+	}
+	// Seed of the releases and the filament noise. -1 takes it from the current time (and logs it, so the run can be repeated)
+	random_seed = declare_parameter<int>("random_seed", -1);
+	if (random_seed < 0)
+	{
+		random_seed = time(NULL) & INT_MAX;
+		RCLCPP_INFO(get_logger(), "[filament] random_seed: %d", random_seed);
+	}
+
+	// Running concentration maps, updated every maps_stride steps (0 = disabled) on a grid with cells of maps_cell_size
+	maps_stride = declare_parameter<int>("maps_stride", 0);
+	maps_cell_size = declare_parameter<double>("maps_cell_size", 0.0);
+	maps_threshold_ppm = declare_parameter<double>("maps_threshold_ppm", 1.0);
+	maps_flush_interval = declare_parameter<double>("maps_flush_interval", 0.0);
+	last_maps_flush_time = 0;
+
+	// Reorder the filaments by cell (Morton order) every N steps, so neighbouring filaments are processed together (0 = never)
+	morton_sort_interval = declare_parameter<int>("morton_sort_interval", 0);
+
+	// NUMA placement of the grids and filaments, and pinning of the threads
+	std::string memory_policy_name = declare_parameter<std::string>("memory_policy", "default");
+	if (memory_policy_name == "interleave")
+		memory_policy = Gaden::MemoryPolicy::INTERLEAVE;
+	else if (memory_policy_name == "local")
+	{
+		// The filaments are advected as tasks and reordered by the Morton sort, so no thread keeps a share of them
+		RCLCPP_WARN(get_logger(), "[filament] memory_policy 'local' is no longer supported, using 'interleave'");
+		memory_policy = Gaden::MemoryPolicy::INTERLEAVE;
+	}
+	else
+	{
+		if (memory_policy_name != "default")
+			RCLCPP_WARN(get_logger(), "[filament] Unknown memory_policy '%s', using 'default'", memory_policy_name.c_str());
+		memory_policy = Gaden::MemoryPolicy::DEFAULT;
+	}
+	huge_pages = declare_parameter<bool>("huge_pages", false);
+	std::string thread_affinity_name = declare_parameter<std::string>("thread_affinity", "none");
+	if (thread_affinity_name == "close")
+		thread_affinity = Gaden::ThreadAffinity::CLOSE;
+	else if (thread_affinity_name == "spread")
+		thread_affinity = Gaden::ThreadAffinity::SPREAD;
+	else
+	{
+		if (thread_affinity_name != "none")
+			RCLCPP_WARN(get_logger(), "[filament] Unknown thread_affinity '%s', using 'none'", thread_affinity_name.c_str());
+		thread_affinity = Gaden::ThreadAffinity::NONE;
+	}
+
+	// Probes sampled while simulating: x,y,z of each point, and x1,y1,z1,x2,y2,z2 of each line (written to <results_location>/probes)
+	probe_points = declare_parameter<std::vector<double>>("probe_points", std::vector<double>());
+	probe_lines = declare_parameter<std::vector<double>>("probe_lines", std::vector<double>());
+	probe_stride = std::max(declare_parameter<int>("probe_stride", 1), 1);
+	if (probe_points.size() % 3 != 0 || probe_lines.size() % 6 != 0)
+		RCLCPP_WARN(get_logger(), "[filament] probe_points needs 3 values per point and probe_lines 6 per line. The incomplete ones are ignored");
+
+	// Stop when the plume becomes statistically steady: the means of the gas mass, the centroid of the plume and the probes
+	// over windows of convergence_window seconds (0 = disabled) change less than convergence_tolerance from one window to the
+	// next. Then "stop" (saving the last state), or "sparse": keep simulating, saving every convergence_results_time_step
+	convergence_window = declare_parameter<double>("convergence_window", 0.0);
+	convergence_tolerance = declare_parameter<double>("convergence_tolerance", 0.02);
+	convergence_min_ppm = declare_parameter<double>("convergence_min_ppm", 0.1);
+	convergence_action = declare_parameter<std::string>("convergence_action", "stop");
+	if (convergence_action != "stop" && convergence_action != "sparse")
+	{
+		RCLCPP_WARN(get_logger(), "[filament] Unknown convergence_action '%s'. Using 'stop'", convergence_action.c_str());
+		convergence_action = "stop";
+	}
+	convergence_results_time_step = declare_parameter<double>("convergence_results_time_step", 10.0);
+
+	// Name of a shared memory segment to publish the current filaments and wind for the player (empty = disabled)
+	live_exchange_name = declare_parameter<std::string>("live_exchange", "");
+
 	if (verbose)
 	{
 		RCLCPP_INFO(get_logger(), "[filament] The data provided in the roslaunch file is:");
@@ -278,11 +647,11 @@ void CFilamentSimulator::initSimulator()
 		if (verbose)
 			RCLCPP_INFO(get_logger(), "[filament] Env size in cells	 (%d,%d,%d) - with cell size %f [m]", envDesc.num_cells.x, envDesc.num_cells.y, envDesc.num_cells.z, envDesc.cell_size);
 
-		// Reserve memory for the 3D matrices: U,V,W,C and Env, according to provided num_cells of the environment.
+		// Reserve memory for the 3D matrices: Wind,C and Env, according to provided num_cells of the environment.
 		// It also init them to 0.0 values
-		configure3DMatrix(U);
-		configure3DMatrix(V);
-		configure3DMatrix(W);
+		wind.configure(envDesc.num_cells);
+		for (std::vector<double>& component : wind_buffer)
+			configure3DMatrix(component);
 		configure3DMatrix(C);
 		configure3DMatrix(envDesc.Env);
 	}
@@ -290,25 +659,216 @@ void CFilamentSimulator::initSimulator()
 	{
 		RCLCPP_ERROR(get_logger(), "[filament] File %s Does Not Exists!", occupancy3D_data.c_str());
 	}
+	load_refinement_levels();
+	environment.configure(envDesc, wind, refinement_levels);
 
-	// 2. Load the first Wind snapshot from file (all 3 components U,V,W)
-	read_wind_snapshot(current_simulation_step);
-
-	// 3. Initialize the filaments vector to its max value (to avoid increasing the size at runtime)
+	// 2. Initialize the filaments vector to its max value (to avoid increasing the size at runtime)
 	if (verbose)
 		RCLCPP_INFO(get_logger(), "[filament] Initializing Filaments");
 	filaments.resize(total_number_filaments, CFilament(0.0, 0.0, 0.0, filament_initial_std));
 }
 
-// Resize a 3D Matrix compose of Vectors, This operation is only performed once!
-void CFilamentSimulator::configure3DMatrix(std::vector<double>& A)
+// Load the state stored by a previous simulation, and continue the simulation from that point: an iteration_<n> file (with
+// its far_field_<n>, if any), or an iteration of a results archive (warm_start_iteration, the last one by default).
+// The previous run must have used the same environment, gas and filament parameters
+bool CFilamentSimulator::load_warm_start(const std::string& filename)
 {
-	A.resize(envDesc.num_cells.x * envDesc.num_cells.y * envDesc.num_cells.z);
-}
+	// What is needed from the previous run, from either source
+	Gaden::ArchiveHeader stored;          // environment and gas constants
+	double start_time = warm_start_time;  // time of the stored state
+	int wind_idx = 0;
+	int iteration = -1;                   // number of the stored iteration (-1 if unknown)
+	std::string filters;                  // output filters it was saved with
+	std::stringstream decompressed;       // (int id, double x, y, z, sigma) for every filament
+	std::stringstream far_field_data;     // see CFarField::serialize. Empty if there is none
+
+	Gaden::ArchiveReader archive;
+	if (archive.open(filename))
+	{
+		// The archive of the results would be truncated before reading it
+		boost::system::error_code error;
+		if (save_results && results_format == "archive" && boost::filesystem::equivalent(filename, results_location + "/simulation.gaden", error))
+		{
+			RCLCPP_ERROR(get_logger(), "[filament] Warm start: %s is the results archive of this simulation, and would be overwritten. Set another results_location",
+				filename.c_str());
+			return false;
+		}
 
-void CFilamentSimulator::configure3DMatrix(std::vector<uint8_t>& A)
-{
-	A.resize(envDesc.num_cells.x * envDesc.num_cells.y * envDesc.num_cells.z);
+		if (archive.getIterations().empty())
+		{
+			RCLCPP_ERROR(get_logger(), "[filament] Warm start: the archive %s has no iterations", filename.c_str());
+			return false;
+		}
+		iteration = warm_start_iteration >= 0 ? warm_start_iteration : archive.getIterations().rbegin()->first;
+		Gaden::ChunkHeader chunk;
+		if (!archive.readIteration(iteration, chunk, decompressed))
+		{
+			RCLCPP_ERROR(get_logger(), "[filament] Warm start: iteration %d is not in the archive %s", iteration, filename.c_str());
+			return false;
+		}
+		stored = archive.getHeader();
+		start_time = chunk.sim_time;
+		wind_idx = chunk.wind_idx;
+		archive.readMetadata(filters);
+		archive.readFarField(iteration, far_field_data);
+	}
+	else
+	{
+		std::ifstream infile(filename, std::ios_base::binary);
+		if (!infile.is_open())
+		{
+			RCLCPP_ERROR(get_logger(), "[filament] Warm start file %s does not exist", filename.c_str());
+			return false;
+		}
+
+		boost::iostreams::filtering_streambuf<boost::iostreams::input> inbuf;
+		inbuf.push(boost::iostreams::zlib_decompressor());
+		inbuf.push(infile);
+		boost::iostreams::copy(inbuf, decompressed);
+		infile.close();
+
+		int version = 0;
+		decompressed.read((char*)&version, sizeof(int));
+		if (version < 1 || version > 3)
+		{
+			RCLCPP_ERROR(get_logger(), "[filament] %s is not a filament log file or a results archive", filename.c_str());
+			return false;
+		}
+
+		double cell_size[2];
+		decompressed.read((char*)stored.min_coord, 3 * sizeof(double));
+		decompressed.read((char*)stored.max_coord, 3 * sizeof(double));
+		decompressed.read((char*)stored.num_cells, 3 * sizeof(int));
+		decompressed.read((char*)cell_size, 2 * sizeof(double));
+		decompressed.ignore(sizeof(double));
+		decompressed.read((char*)stored.source_position, 3 * sizeof(double));
+		decompressed.read((char*)&stored.gas_type, sizeof(int));
+		decompressed.read((char*)&stored.filament_moles_of_gas, sizeof(double));
+		decompressed.read((char*)&stored.num_moles_all_gases_in_cm3, sizeof(double));
+		decompressed.read((char*)&wind_idx, sizeof(int));
+		stored.cell_size = cell_size[0];
+		if (version >= 2)
+			decompressed.read((char*)&start_time, sizeof(double));
+		if (version >= 3)
+		{
+			int filters_length;
+			decompressed.read((char*)&filters_length, sizeof(int));
+			filters.resize(filters_length);
+			decompressed.read(&filters[0], filters_length);
+		}
+
+		// iteration_<n>, and the far field saved along it
+		boost::filesystem::path path(filename);
+		std::string name = path.filename().string();
+		if (name.rfind("iteration_", 0) == 0 && name.find_first_not_of("0123456789", 10) == std::string::npos && name.size() > 10)
+		{
+			iteration = atoi(name.c_str() + 10);
+			std::ifstream far_field_file((path.parent_path() / ("far_field_" + name.substr(10))).string(), std::ios_base::binary);
+			if (far_field_file.is_open())
+			{
+				boost::iostreams::filtering_streambuf<boost::iostreams::input> far_field_buf;
+				far_field_buf.push(boost::iostreams::zlib_decompressor());
+				far_field_buf.push(far_field_file);
+				boost::iostreams::copy(far_field_buf, far_field_data);
+			}
+		}
+	}
+
+	// Check that the previous run is compatible with this one
+	Gaden::Vector3i num_cells(stored.num_cells[0], stored.num_cells[1], stored.num_cells[2]);
+	if (num_cells.x != envDesc.num_cells.x || num_cells.y != envDesc.num_cells.y || num_cells.z != envDesc.num_cells.z || std::abs(stored.cell_size - envDesc.cell_size) > 1e-6)
+	{
+		RCLCPP_ERROR(get_logger(), "[filament] Warm start: the environment (%d,%d,%d) cells of %f m does not match the current one", num_cells.x, num_cells.y, num_cells.z,
+			stored.cell_size);
+		return false;
+	}
+	// The logs written before the moles of gas per filament used M_PI (instead of 3.14159) differ by 1.27e-6
+	if (stored.gas_type != gasType || std::abs(stored.filament_moles_of_gas - filament_numMoles_of_gas) > 1e-5 * filament_numMoles_of_gas)
+	{
+		RCLCPP_ERROR(get_logger(), "[filament] Warm start: gas type or filament parameters do not match the current simulation");
+		return false;
+	}
+	const double* source = stored.source_position;
+	if (std::abs(source[0] - gas_source_pos_x) > 1e-6 || std::abs(source[1] - gas_source_pos_y) > 1e-6 || std::abs(source[2] - gas_source_pos_z) > 1e-6)
+		RCLCPP_WARN(get_logger(), "[filament] Warm start: the source position (%.2f,%.2f,%.2f) differs from the current one", source[0], source[1], source[2]);
+
+	if (start_time < 0)
+	{
+		RCLCPP_ERROR(get_logger(), "[filament] Warm start: %s does not store the simulation time. Set the parameter warm_start_time", filename.c_str());
+		return false;
+	}
+	// Read the filaments (keeping their IDs)
+	std::vector<std::pair<int, CFilament>> loaded;
+	int max_id = -1;
+	while (decompressed.peek() != EOF)
+	{
+		int id;
+		CFilament filament;
+		double values[4]; // x, y, z, sigma
+		decompressed.read((char*)&id, sizeof(int));
+		decompressed.read((char*)values, 4 * sizeof(double));
+		if (!decompressed)
+			break;
+		filament.pose_x = values[0];
+		filament.pose_y = values[1];
+		filament.pose_z = values[2];
+		filament.sigma = values[3];
+
+		// The birth time is not stored, but it can be recovered from the growth of sigma
+		filament.birth_time = start_time - (pow(values[3], 2) - pow(filament_initial_std, 2)) / filament_growth_gamma;
+		filament.valid = true;
+		filament.id = id;
+		loaded.emplace_back(id, filament);
+		max_id = std::max(max_id, id);
+	}
+
+	// The gas that had been handed off to the far field (see init_far_field)
+	if (far_field_data.rdbuf()->in_avail() > 0)
+	{
+		int format;
+		double far_field_time;
+		int far_field_cells[3];
+		far_field_data.read((char*)&format, sizeof(int));
+		far_field_data.read((char*)&far_field_time, sizeof(double));
+		far_field_data.read((char*)far_field_cells, 3 * sizeof(int));
+		warm_start_far_field.resize((size_t)num_cells.x * num_cells.y * num_cells.z);
+		far_field_data.read((char*)warm_start_far_field.data(), sizeof(double) * warm_start_far_field.size());
+		if (!far_field_data || format != 1 || far_field_cells[0] != num_cells.x || far_field_cells[1] != num_cells.y || far_field_cells[2] != num_cells.z)
+		{
+			RCLCPP_ERROR(get_logger(), "[filament] Warm start: the far field of %s could not be read", filename.c_str());
+			return false;
+		}
+	}
+
+	// The filaments handed off to the far field are not missing when it is restored (see results_description)
+	size_t far_field_part = filters.find("far_field_sigma_cells");
+	if (!warm_start_far_field.empty() && far_field_part != std::string::npos)
+		filters.erase(far_field_part, filters.find("; ", far_field_part) + 2 - far_field_part);
+	if (filters.length() > 0)
+		RCLCPP_WARN(get_logger(), "[filament] Warm start: %s was saved with output filters (%s). The filtered filaments are missing from the initial state", filename.c_str(), filters.c_str());
+
+	// The filaments of the previous run are kept in front of the ones that will be released from now on
+	sim_time = start_time;
+	current_simulation_step = round(start_time / time_step);
+	current_number_filaments = max_id + 1;
+	total_number_filaments += current_number_filaments;
+	filaments.resize(total_number_filaments, CFilament(0.0, 0.0, 0.0, filament_initial_std));
+	for (auto& pair : loaded)
+		filaments[pair.first] = pair.second;
+
+	// The results continue the numbering of the stored iteration, which was saved at start_time
+	if (iteration >= 0)
+		last_saved_step = iteration;
+	last_saved_timestamp = start_time;
+
+	// Force the wind to be reloaded at the first step
+	sim_time_last_wind = sim_time - 2 * windTime_step;
+	if (allow_looping)
+		current_wind_snapshot = wind_idx;
+
+	RCLCPP_INFO(get_logger(), "[filament] Warm start from %s: %zu filaments%s at sim_time %.2f s", filename.c_str(), loaded.size(),
+		warm_start_far_field.empty() ? "" : " and the far field", sim_time);
+	return true;
 }
 
 //==========================//
@@ -319,17 +879,18 @@ void CFilamentSimulator::read_wind_snapshot(int idx)
 	if (last_wind_idx == idx)
 		return;
 
-	// configure filenames to read
-
-	// the old way to do this was to pass "path/wind_" as the parameter and only append the index itseld
-	// but that is clunky, and inconsistent with all the other gaden nodes, which append the underscore automatically
-	// so now, for backwards compatibility, we need to check whether the underscore is already there or not
-	std::string separator = (wind_files_location.back() == '_') ? "" : "_";
-	std::string U_filename = boost::str(boost::format("%s%s%i.csv_U") % wind_files_location % separator % idx);
-	std::string V_filename = boost::str(boost::format("%s%s%i.csv_V") % wind_files_location % separator % idx);
-	std::string W_filename = boost::str(boost::format("%s%s%i.csv_W") % wind_files_location % separator % idx);
+	// Already decoded (in a previous loop)?
+	if (wind_cache.get(idx, wind))
+	{
+		last_wind_idx = idx;
+		if (verbose)
+			RCLCPP_INFO(get_logger(), "[filament] Loading Wind Snapshot %i from cache (%zu hits, %zu misses)", idx, wind_cache.hits, wind_cache.misses);
+		read_refinement_wind_snapshots(idx);
+		return;
+	}
 
 	// read data to 3D matrices
+	std::string U_filename = wind_filename(wind_files_location, idx, 'U');
 	if (FILE* file = fopen(U_filename.c_str(), "r"))
 	{
 		if (verbose)
@@ -341,17 +902,30 @@ void CFilamentSimulator::read_wind_snapshot(int idx)
 		if (verbose)
 			RCLCPP_INFO(get_logger(), "[filament] Loading Wind Snapshot %i", idx);
 
-		// binary format files start with the code "999"
-		std::ifstream ist(U_filename, std::ios_base::binary);
-		int check = 0;
-		ist.read((char*)&check, sizeof(int));
-		ist.close();
-
-		read_3D_file(U_filename, U, (check == 999));
-		read_3D_file(V_filename, V, (check == 999));
-		read_3D_file(W_filename, W, (check == 999));
+		read_wind_files(wind_files_location, idx, envDesc.num_cells, wind);
+		wind_cache.put(idx, wind);
+		if (verbose)
+			RCLCPP_INFO(get_logger(), "[filament] Wind Snapshot %i: %zu of %zu bricks stored (%.1f MB, %.1f MB dense)", idx, wind.numStoredBricks(),
+				wind.numBricks(), wind.memoryBytes() / 1e6, wind.size() * sizeof(Gaden::WindVector) / 1e6);
+		read_refinement_wind_snapshots(idx);
 
-		if (!wind_finished)
+		if (!wind_finished && results_archive.is_open())
+		{
+			std::string data;
+			data.reserve(3 * sizeof(double) * wind.size());
+			for (int axis = 0; axis < 3; axis++)
+			{
+				wind.getComponent(wind_buffer[axis], axis);
+				data.append((char*)wind_buffer[axis].data(), sizeof(double) * wind_buffer[axis].size());
+			}
+			Gaden::ChunkHeader header{};
+			header.type = Gaden::ChunkType::WIND;
+			header.id = idx;
+			header.sim_time = sim_time;
+			header.wind_idx = idx;
+			results_archive.append(header, data);
+		}
+		else if (save_results && !wind_finished)
 		{
 			// dump the binary wind data to file
 			std::string out_filename = boost::str(boost::format("%s/wind/wind_iteration_%i") % results_location % idx);
@@ -363,9 +937,11 @@ void CFilamentSimulator::read_wind_snapshot(int idx)
 			}
 			fclose(file);
 			std::ofstream wind_File(out_filename.c_str());
-			wind_File.write((char*)U.data(), sizeof(double) * U.size());
-			wind_File.write((char*)V.data(), sizeof(double) * V.size());
-			wind_File.write((char*)W.data(), sizeof(double) * W.size());
+			for (int axis = 0; axis < 3; axis++)
+			{
+				wind.getComponent(wind_buffer[axis], axis);
+				wind_File.write((char*)wind_buffer[axis].data(), sizeof(double) * wind_buffer[axis].size());
+			}
 			wind_File.close();
 		}
 	}
@@ -382,11 +958,108 @@ void CFilamentSimulator::read_wind_snapshot(int idx)
 	}
 }
 
+// File of one component of a wind snapshot
+std::string CFilamentSimulator::wind_filename(const std::string& location, int idx, char component)
+{
+	// the old way to do this was to pass "path/wind_" as the parameter and only append the index itseld
+	// but that is clunky, and inconsistent with all the other gaden nodes, which append the underscore automatically
+	// so now, for backwards compatibility, we need to check whether the underscore is already there or not
+	std::string separator = (location.back() == '_') ? "" : "_";
+	return boost::str(boost::format("%s%s%i.csv_%c") % location % separator % idx % component);
+}
+
+// Read the three components of a wind snapshot (binary or ASCII) into a grid of num_cells
+void CFilamentSimulator::read_wind_files(const std::string& location, int idx, const Gaden::Vector3i& num_cells, Gaden::WindField& field)
+{
+	// binary format files start with the code "999"
+	std::ifstream ist(wind_filename(location, idx, 'U'), std::ios_base::binary);
+	int check = 0;
+	ist.read((char*)&check, sizeof(int));
+	ist.close();
+
+	// the files store each component separately, convert them to the interleaved (bricked) layout once
+	read_3D_file(wind_filename(location, idx, 'U'), num_cells, wind_buffer[0], (check == 999));
+	read_3D_file(wind_filename(location, idx, 'V'), num_cells, wind_buffer[1], (check == 999));
+	read_3D_file(wind_filename(location, idx, 'W'), num_cells, wind_buffer[2], (check == 999));
+	field.buildFromComponents(num_cells, wind_buffer);
+}
+
+// Load the occupancy of the refinement patches. The ones that are not finer than the environment, or not inside it, are skipped
+void CFilamentSimulator::load_refinement_levels()
+{
+	finest_cell_size = envDesc.cell_size;
+	size_t refined_cells = 0;
+	for (size_t i = 0; i < refinement_occupancy3D_data.size(); i++)
+	{
+		RefinementLevel level;
+		if (Gaden::readEnvFile(refinement_occupancy3D_data[i], level.env) != Gaden::ReadResult::OK)
+		{
+			RCLCPP_ERROR(get_logger(), "[filament] Could not read the refinement patch %s. Skipping it", refinement_occupancy3D_data[i].c_str());
+			continue;
+		}
+
+		const Gaden::EnvironmentDescription& patch = level.env;
+		if (patch.cell_size >= envDesc.cell_size || patch.min_coord.x < envDesc.min_coord.x || patch.min_coord.y < envDesc.min_coord.y ||
+			patch.min_coord.z < envDesc.min_coord.z || patch.max_coord.x > envDesc.max_coord.x || patch.max_coord.y > envDesc.max_coord.y ||
+			patch.max_coord.z > envDesc.max_coord.z)
+		{
+			RCLCPP_ERROR(get_logger(), "[filament] The refinement patch %s must be inside the environment and have a smaller cell size. Skipping it",
+				refinement_occupancy3D_data[i].c_str());
+			continue;
+		}
+
+		level.wind.configure(patch.num_cells);
+		level.wind_files_location = refinement_wind_data[i];
+		level.wind_cache.setBudget((size_t)std::max(wind_cache_size_mb, 0) * 1024 * 1024);
+		refined_cells += (size_t)patch.num_cells.x * patch.num_cells.y * patch.num_cells.z;
+		finest_cell_size = std::min(finest_cell_size, patch.cell_size);
+		RCLCPP_INFO(get_logger(), "[filament] Refinement patch (%.2f,%.2f,%.2f) to (%.2f,%.2f,%.2f), cell size %f [m]", patch.min_coord.x,
+			patch.min_coord.y, patch.min_coord.z, patch.max_coord.x, patch.max_coord.y, patch.max_coord.z, patch.cell_size);
+		refinement_levels.push_back(std::move(level));
+	}
+
+	// finest first (stable, so patches of the same cell size keep the order they were given in)
+	std::stable_sort(refinement_levels.begin(), refinement_levels.end(),
+		[](const RefinementLevel& a, const RefinementLevel& b) { return a.env.cell_size < b.env.cell_size; });
+
+	if (verbose && !refinement_levels.empty())
+	{
+		double uniform_cells = ceil((envDesc.max_coord.x - envDesc.min_coord.x) / finest_cell_size) *
+			ceil((envDesc.max_coord.y - envDesc.min_coord.y) / finest_cell_size) * ceil((envDesc.max_coord.z - envDesc.min_coord.z) / finest_cell_size);
+		RCLCPP_INFO(get_logger(), "[filament] Nested grids: %zu cells (a uniform grid at %f [m] would need %.0f)",
+			(size_t)envDesc.num_cells.x * envDesc.num_cells.y * envDesc.num_cells.z + refined_cells, finest_cell_size, uniform_cells);
+	}
+}
+
+// The patches follow the snapshots of the environment. If one has no file for this snapshot, it keeps its current wind
+void CFilamentSimulator::read_refinement_wind_snapshots(int idx)
+{
+	for (RefinementLevel& level : refinement_levels)
+	{
+		if (level.wind_cache.get(idx, level.wind))
+			continue;
+
+		std::string U_filename = wind_filename(level.wind_files_location, idx, 'U');
+		if (FILE* file = fopen(U_filename.c_str(), "r"))
+		{
+			fclose(file);
+			read_wind_files(level.wind_files_location, idx, level.env.num_cells, level.wind);
+			level.wind_cache.put(idx, level.wind);
+			if (verbose)
+				RCLCPP_INFO(get_logger(), "[filament] Refinement wind snapshot %s: %zu of %zu bricks stored (%.1f MB)", U_filename.c_str(),
+					level.wind.numStoredBricks(), level.wind.numBricks(), level.wind.memoryBytes() / 1e6);
+		}
+		else if (verbose)
+			RCLCPP_WARN(get_logger(), "[filament] File %s Does Not Exists! Keeping the current wind of the patch", U_filename.c_str());
+	}
+}
+
 //==========================//
 //                          //
 //==========================//
-void CFilamentSimulator::read_3D_file(std::string filename, std::vector<double>& A, bool binary)
+void CFilamentSimulator::read_3D_file(std::string filename, const Gaden::Vector3i& num_cells, std::vector<double>& A, bool binary)
 {
+	A.resize((size_t)num_cells.x * num_cells.y * num_cells.z);
 	if (binary)
 	{
 		std::ifstream infile(filename, std::ios_base::binary);
@@ -396,54 +1069,9 @@ void CFilamentSimulator::read_3D_file(std::string filename, std::vector<double>&
 	}
 	else
 	{
-		// open file
-		std::ifstream infile(filename.c_str());
-		std::string line;
-		int line_counter = 0;
-
-		// Read file line by line
-		int x_idx = 0;
-		int y_idx = 0;
-		int z_idx = 0;
-
-		while (std::getline(infile, line))
-		{
-			line_counter++;
-			std::stringstream ss(line);
-			if (z_idx >= envDesc.num_cells.z)
-			{
-				RCLCPP_ERROR(get_logger(), "Trying to read:[%s]", line.c_str());
-			}
-
-			if (line == ";")
-			{
-				// New Z-layer
-				z_idx++;
-				x_idx = 0;
-				y_idx = 0;
-			}
-			else
-			{ // New line with constant x_idx and all the y_idx values
-				while (!ss.fail())
-				{
-					double f;
-					ss >> f; // get one double value
-					if (!ss.fail())
-					{
-						A[indexFrom3D(x_idx, y_idx, z_idx)] = f;
-						y_idx++;
-					}
-				}
-
-				// Line has ended
-				x_idx++;
-				y_idx = 0;
-			}
-		}
-		// End of file.
-		if (verbose)
-			RCLCPP_INFO(get_logger(), "End of File");
-		infile.close();
+		std::string error;
+		if (!Gaden::readASCIIGrid(filename, 0, num_cells, A, error))
+			RCLCPP_ERROR(get_logger(), "[filament] Error reading %s: %s", filename.c_str(), error.c_str());
 	}
 }
 
@@ -478,324 +1106,592 @@ void CFilamentSimulator::add_new_filaments(double radius_arround_source)
 			x = gas_source_pos_x + random_number(-1, 1) * radius_arround_source;
 			y = gas_source_pos_y + random_number(-1, 1) * radius_arround_source;
 			z = gas_source_pos_z + random_number(-1, 1) * radius_arround_source;
-		} while (check_pose_with_environment(x, y, z) != 0);
+		} while (environment.occupancy(x, y, z) != 0);
 
 		/*Instead of adding new filaments to the filaments vector on each iteration (push_back)
 		  we had initially resized the filaments vector to the max number of filaments (numSteps*numFilaments_step)
 		  Here we will "activate" just the corresponding filaments for this step.*/
 		filaments[current_number_filaments + i].activate_filament(x, y, z, sim_time);
+		filaments[current_number_filaments + i].id = current_number_filaments + i;
 	}
 }
 
-// Here we estimate the gas concentration on each cell of the 3D env
-// based on the active filaments and their 3DGaussian shapes
-// For that we employ Farrell's Concentration Eq
-void CFilamentSimulator::update_gas_concentration_from_filament(int fil_i)
+// Concentration of one filament (see splatFilament in filament_kernels.h)
+// PPM: accumulate [ppm] instead of [moles] (concentration_unit_choice), chosen once in select_step_kernels
+template <bool PPM>
+void CFilamentSimulator::update_gas_concentration_from_filament(int fil_i, int first_slab, int last_slab)
 {
-	// We run over all the active filaments, and update the gas concentration of the cells that are close to them.
-	// Ideally a filament spreads over the entire environment, but in practice since filaments are modeled as 3Dgaussians
-	// We can stablish a cutt_off raduis of 3*sigma.
-	// To avoid resolution problems, we evaluate each filament according to the minimum between:
-	// the env_cell_size and filament_sigma. This way we ensure a filament is always well evaluated (not only one point).
-
-	double grid_size_m = std::min(envDesc.cell_size, (filaments[fil_i].sigma / 100)); //[m] grid size to evaluate the filament
-	// Compute at which increments the Filament has to be evaluated.
-	// If the sigma of the Filament is very big (i.e. the Filament is very flat), the use the world's cell_size.
-	// If the Filament is very small (i.e in only spans one or few world cells), then use increments equal to sigma
-	//  in order to have several evaluations fall in the same cell.
-
-	int num_evaluations = ceil(6 * (filaments[fil_i].sigma / 100) / grid_size_m);
-	// How many times the Filament has to be evaluated depends on the final grid_size_m.
-	// The filament's grid size is multiplied by 6 because we evaluate it over +-3 sigma
-	// If the filament is very small (i.e. grid_size_m = sigma), then the filament is evaluated only 6 times
-	// If the filament is very big and spans several cells, then it has to be evaluated for each cell (which will be more than 6)
+	splatFilament(filaments[fil_i], filament_numMoles_of_gas, PPM ? ppm_per_cell_mole : 1, environment, first_slab, last_slab, C);
+}
 
-	// EVALUATE IN ALL THREE AXIS
-	for (int i = 0; i <= num_evaluations; i++)
+//==========================//
+//                          //
+//==========================//
+void CFilamentSimulator::update_gas_concentration_from_filaments()
+{
+	if (concentration_rasterizer == "binned")
 	{
-		for (int j = 0; j <= num_evaluations; j++)
+		std::vector<Gaden::GaussianSource> sources;
+		for (int i = 0; i < current_number_filaments; i++)
 		{
-			for (int k = 0; k <= num_evaluations; k++)
-			{
-				// get point to evaluate [m]
-				double x = (filaments[fil_i].pose_x - 3 * (filaments[fil_i].sigma / 100)) + i * grid_size_m;
-				double y = (filaments[fil_i].pose_y - 3 * (filaments[fil_i].sigma / 100)) + j * grid_size_m;
-				double z = (filaments[fil_i].pose_z - 3 * (filaments[fil_i].sigma / 100)) + k * grid_size_m;
-
-				// Disntance from evaluated_point to filament_center (in [cm])
-				double distance_cm = 100 * sqrt(pow(x - filaments[fil_i].pose_x, 2) + pow(y - filaments[fil_i].pose_y, 2) + pow(z - filaments[fil_i].pose_z, 2));
+			if (filaments[i].valid)
+				sources.push_back({ filaments[i].pose_x, filaments[i].pose_y, filaments[i].pose_z, filaments[i].sigma, filament_numMoles_of_gas });
+		}
+		rasterizer.rasterize(envDesc, sources, C);
 
-				// FARRELLS Eq.
-				// Evaluate the concentration of filament fil_i at given point (moles/cm³)
-				double num_moles_cm3 = (filament_numMoles_of_gas / (sqrt(8 * pow(3.14159, 3)) * pow(filaments[fil_i].sigma, 3))) * exp(-pow(distance_cm, 2) / (2 * pow(filaments[fil_i].sigma, 2)));
+		if (gasConc_unit != 0)
+		{
+			for (Gaden::Real& c : C)
+				c = (c / env_cell_numMoles) * pow(10, 6); //[ppm]
+		}
+		return;
+	}
 
-				// Multiply for the volumen of the grid cell
-				double num_moles = num_moles_cm3 * pow(grid_size_m * 100, 3); //[moles]
+	// The work of a filament grows with (6 sigma / cell size)³, so the oldest filaments cost far more than the new ones, and a
+	// static split of the filaments leaves most threads waiting for the few that got the widest. Instead, the work is split
+	// by its cost (see schedule_splat) in tasks, which every thread of the team takes as soon as it is free
+	double start = omp_get_wtime();
+	schedule_splat();
+	if (omp_in_parallel())
+		run_splat();
+	else
+	{
+		#pragma omp parallel
+		#pragma omp single
+		run_splat();
+	}
+	splat_time += omp_get_wtime() - start;
+	splat_calls++;
+}
 
-				// Valid point? If either OUT of the environment, or through a wall, treat it as invalid
-				bool path_is_obstructed = check_environment_for_obstacle(filaments[fil_i].pose_x, filaments[fil_i].pose_y, filaments[fil_i].pose_z, x, y, z);
+// Split the splat in tasks of similar cost. The cost of a filament is the number of points where it is evaluated: the heavy
+// ones (above the target cost of a task) are split in slabs along X, and the light ones are bundled together. The tasks are
+// sorted heaviest first, so the cheap ones at the end fill the gaps between the threads
+void CFilamentSimulator::schedule_splat()
+{
+	int team_size = omp_in_parallel() ? omp_get_num_threads() : omp_get_max_threads();
+	if ((int)splat_thread_busy.size() < team_size)
+		splat_thread_busy.resize(team_size);
 
-				if (!path_is_obstructed)
-				{
-					// Get 3D cell of the evaluated point
-					int x_idx = floor((x - envDesc.min_coord.x) / envDesc.cell_size);
-					int y_idx = floor((y - envDesc.min_coord.y) / envDesc.cell_size);
-					int z_idx = floor((z - envDesc.min_coord.z) / envDesc.cell_size);
+	splat_tasks.clear();
+	double total_cost = 0;
+	for (int i = 0; i < current_number_filaments; i++)
+	{
+		if (!filaments[i].valid)
+			continue;
+		int num_slabs = splatPointsPerAxis(filaments[i].sigma, envDesc.cell_size);
+		double cost = pow(num_slabs, 3);
+		splat_tasks.push_back({ i, 0, num_slabs, cost });
+		total_cost += cost;
+	}
 
-					// Accumulate concentration in corresponding env_cell
-					if (gasConc_unit == 0)
-					{
-						mtx.lock();
-						C[indexFrom3D(x_idx, y_idx, z_idx)] += num_moles; // moles
-						mtx.unlock();
-					}
-					else
-					{
-						mtx.lock();
-						double num_ppm = (num_moles / env_cell_numMoles) * pow(10, 6); //[ppm]
+	// A few tasks per thread: enough for the idle threads to even out the load, few enough to keep the overhead low
+	const int tasks_per_thread = 8;
+	double target_cost = std::max(total_cost / (team_size * tasks_per_thread), 1.0);
 
-						C[indexFrom3D(x_idx, y_idx, z_idx)] += num_ppm; // ppm
-						mtx.unlock();
-					}
-				}
-			}
+	size_t num_filaments = splat_tasks.size();
+	for (size_t t = 0; t < num_filaments; t++)
+	{
+		SplatTask task = splat_tasks[t];
+		if (task.cost <= target_cost)
+			continue;
+		int num_slabs = task.last_slab;
+		int pieces = std::min((int)ceil(task.cost / target_cost), num_slabs);
+		double slab_cost = task.cost / num_slabs;
+		for (int p = 0; p < pieces; p++)
+		{
+			task.first_slab = (long)num_slabs * p / pieces;
+			task.last_slab = (long)num_slabs * (p + 1) / pieces;
+			task.cost = slab_cost * (task.last_slab - task.first_slab);
+			if (p == 0)
+				splat_tasks[t] = task;
+			else
+				splat_tasks.push_back(task);
+		}
+	}
+	std::sort(splat_tasks.begin(), splat_tasks.end(), [](const SplatTask& a, const SplatTask& b) {
+		if (a.cost != b.cost)
+			return a.cost > b.cost;
+		return a.filament != b.filament ? a.filament < b.filament : a.first_slab < b.first_slab;
+	});
+
+	splat_bundles.assign(1, 0);
+	double bundle_cost = 0;
+	for (size_t t = 0; t < splat_tasks.size(); t++)
+	{
+		bundle_cost += splat_tasks[t].cost;
+		if (bundle_cost >= target_cost || t + 1 == splat_tasks.size())
+		{
+			splat_bundles.push_back(t + 1);
+			bundle_cost = 0;
 		}
 	}
-
-	// Update Gasconcentration markers
 }
 
-//==========================//
-//                          //
-//==========================//
-void CFilamentSimulator::update_gas_concentration_from_filaments()
+// One task per bundle (see schedule_splat). Must be called from a single thread of the team
+void CFilamentSimulator::run_splat()
 {
-	// First, set all cells to 0.0 gas concentration (clear previous state)
-	#pragma omp parallel for collapse(3)
-	for (size_t i = 0; i < envDesc.num_cells.x; i++)
+	// First, set all cells to 0.0 gas concentration (clear previous state). The taskloop waits for its tasks
+	#pragma omp taskloop
+	for (size_t i = 0; i < C.size(); i++)
+		C[i] = 0.0;
+
+	#pragma omp taskgroup
 	{
-		for (size_t j = 0; j < envDesc.num_cells.y; j++)
+		for (size_t b = 0; b + 1 < splat_bundles.size(); b++)
 		{
-			for (size_t k = 0; k < envDesc.num_cells.z; k++)
+			#pragma omp task firstprivate(b)
 			{
-				C[indexFrom3D(i, j, k)] = 0.0;
+				double start = omp_get_wtime();
+				for (size_t t = splat_bundles[b]; t < splat_bundles[b + 1]; t++)
+					(this->*update_gas_concentration_step)(splat_tasks[t].filament, splat_tasks[t].first_slab, splat_tasks[t].last_slab);
+				splat_thread_busy[omp_get_thread_num()].seconds += omp_get_wtime() - start;
 			}
 		}
 	}
+}
+
+// Update the location of a filament in the 3D environment (see advectFilament), and take it out of the simulation if it is
+// no longer needed
+template <bool Buoyancy, bool Noise>
+void CFilamentSimulator::update_filament_location(int i, const AdvectionParameters& parameters)
+{
+	try
+	{
+		advectFilament<Buoyancy, Noise>(filaments[i], sim_time, parameters, environment);
+
+		// 5. Filaments that span several cells go to the far field (see hand_off_to_far_field). Not the ones that have just
+		//    left through an outlet: their gas is no longer in the environment
+		if (filaments[i].valid && filaments[i].sigma > far_field_sigma)
+		{
+			filaments[i].valid = false;
+			far_field_handoffs[far_field_handoff_count.fetch_add(1, std::memory_order_relaxed)] = i;
+		}
 
-	#pragma omp parallel for
+		// 6. Retirement. The peak concentration only goes down as the filament grows, so once it is below the floor it
+		//    stays there. The allowance is only touched by the (still valid) filaments that cross it
+		else if (filaments[i].valid && filaments[i].sigma > retirement_sigma && retirement_allowance.fetch_sub(1, std::memory_order_relaxed) > 0)
+			filaments[i].valid = false;
+	}
+	catch (...)
+	{
+		RCLCPP_ERROR(get_logger(), "Exception Updating Filaments!");
+		return;
+	}
+}
+
+// One step of advection of all the filaments
+template <bool Buoyancy, bool Noise>
+void CFilamentSimulator::update_filaments_location_kernel()
+{
+	// Called from within the task graph of the main loop, so the work is split as tasks of the enclosing team
+	// (the implicit taskgroup waits only for these, not for the save/publish tasks that might still be running)
+	AdvectionParameters parameters{ time_step, buoyancy_velocity, filament_noise_std, filament_initial_variance, filament_growth_gamma,
+		(uint64_t)random_seed, active_member, current_simulation_step };
+	#pragma omp taskloop
 	for (int i = 0; i < current_number_filaments; i++)
 	{
 		if (filaments[i].valid)
 		{
-			update_gas_concentration_from_filament(i);
+			update_filament_location<Buoyancy, Noise>(i, parameters);
 		}
 	}
 }
 
-// Check if a given 3D pose falls in:
-//  0 = free space
-//  1 = obstacle, wall, or outside the environment
-//  2 = outlet (usefull to disable filaments)
-int CFilamentSimulator::check_pose_with_environment(double pose_x, double pose_y, double pose_z)
+// Constants of the step kernels, and the instantiation that matches the settings of this run
+void CFilamentSimulator::select_step_kernels()
 {
-	// 1.1 Check that pose is within the boundingbox environment
-	if (pose_x < envDesc.min_coord.x || pose_x > envDesc.max_coord.x || pose_y < envDesc.min_coord.y || pose_y > envDesc.max_coord.y || pose_z < envDesc.min_coord.z || pose_z > envDesc.max_coord.z)
-		return 1;
+	// Approximation from "Terminal Velocity of a Bubble Rise in a Liquid Column", World Academy of Science, Engineering and Technology 28 2007
+	double g = 9.8;               //[m/s²]
+	double ro_air = 1.205;        //[kg/m³] density of air
+	double mu = 19 * pow(10, -6); //[kg/s·m] dynamic viscosity of air
+	buoyancy_velocity = (g * (1 - SpecificGravity[gasType]) * ro_air * filament_ppm_center * pow(10, -6)) / (18 * mu);
+	filament_initial_variance = filament_initial_std * filament_initial_std;
+	ppm_per_cell_mole = pow(10, 6) / env_cell_numMoles;
+
+	// peak_ppm(sigma) = K / sigma^3 (see COutputFilter::set_min_peak_ppm), and sigma only grows
+	retirement_sigma = DBL_MAX;
+	if (retirement_min_peak_ppm > 0)
+	{
+		double K = filament_numMoles_of_gas / (sqrt(8 * pow(M_PI, 3)) * env_cell_numMoles / env_cell_vol) * 1e6;
+		retirement_sigma = cbrt(K / retirement_min_peak_ppm);
+		if (verbose)
+			RCLCPP_INFO(get_logger(), "[filament] Retiring the filaments below %g ppm (sigma > %f cm), up to %g of the released gas",
+				retirement_min_peak_ppm, retirement_sigma, retirement_max_mass_fraction);
+	}
 
-	// Get 3D cell of the point
-	int x_idx = (pose_x - envDesc.min_coord.x) / envDesc.cell_size;
-	int y_idx = (pose_y - envDesc.min_coord.y) / envDesc.cell_size;
-	int z_idx = (pose_z - envDesc.min_coord.z) / envDesc.cell_size;
+	bool noise = filament_noise_std > 0;
+	if (buoyancy && noise)
+		update_filaments_location_step = &CFilamentSimulator::update_filaments_location_kernel<true, true>;
+	else if (buoyancy)
+		update_filaments_location_step = &CFilamentSimulator::update_filaments_location_kernel<true, false>;
+	else if (noise)
+		update_filaments_location_step = &CFilamentSimulator::update_filaments_location_kernel<false, true>;
+	else
+		update_filaments_location_step = &CFilamentSimulator::update_filaments_location_kernel<false, false>;
 
-	if (x_idx >= envDesc.num_cells.x || y_idx >= envDesc.num_cells.y || z_idx >= envDesc.num_cells.z)
-		return 1;
+	if (gasConc_unit == 0)
+		update_gas_concentration_step = &CFilamentSimulator::update_gas_concentration_from_filament<false>;
+	else
+		update_gas_concentration_step = &CFilamentSimulator::update_gas_concentration_from_filament<true>;
 
-	// 1.2. Return cell occupancy (0=free, 1=obstacle, 2=outlet)
-	return envDesc.Env[indexFrom3D(x_idx, y_idx, z_idx)];
+	if (verbose)
+		RCLCPP_INFO(get_logger(), "[filament] Step kernels: buoyancy %s (%f m/s), noise %s, concentration in %s", buoyancy ? "on" : "off",
+			buoyancy_velocity, noise ? "on" : "off", gasConc_unit == 0 ? "moles" : "ppm");
 }
 
+
 //==========================//
 //                          //
 //==========================//
-bool CFilamentSimulator::check_environment_for_obstacle(double start_x, double start_y, double start_z,
-	double end_x, double end_y, double end_z)
+void CFilamentSimulator::update_filaments_location()
 {
-	const bool PATH_OBSTRUCTED = true;
-	const bool PATH_UNOBSTRUCTED = false;
+	if (morton_sort_interval > 0 && current_simulation_step % morton_sort_interval == 0)
+		sort_filaments();
 
-	// Check whether one of the points is outside the valid environment or is not free
-	if (check_pose_with_environment(start_x, start_y, start_z) != 0)
-	{
-		return PATH_OBSTRUCTED;
-	}
-	if (check_pose_with_environment(end_x, end_y, end_z) != 0)
+	// Filaments that can be retired in this step without exceeding the mass budget (all of them carry the same moles)
+	long allowance = LONG_MAX;
+	if (retirement_max_mass_fraction < 1)
+		allowance = std::max((long)floor(retirement_max_mass_fraction * current_number_filaments) - retired_filaments, 0L);
+	retirement_allowance.store(allowance, std::memory_order_relaxed);
+
+	// The far field moves first, so the gas handed off in this step is not advected twice
+	if (far_field.enabled())
 	{
-		return PATH_OBSTRUCTED;
+		if (far_field_wind_idx != last_wind_idx)
+		{
+			far_field.set_wind(wind);
+			far_field_wind_idx = last_wind_idx;
+		}
+		far_field.step(time_step);
+		far_field_handoff_count.store(0, std::memory_order_relaxed);
 	}
 
-	// Calculate normal displacement vector
-	double vector_x = end_x - start_x;
-	double vector_y = end_y - start_y;
-	double vector_z = end_z - start_z;
-	double distance = sqrt(vector_x * vector_x + vector_y * vector_y + vector_z * vector_z);
-	vector_x = vector_x / distance;
-	vector_y = vector_y / distance;
-	vector_z = vector_z / distance;
+	double start = omp_get_wtime();
+	(this->*update_filaments_location_step)();
+	advection_time += omp_get_wtime() - start;
+	advection_calls++;
 
-	// Traverse path
-	int steps = ceil(distance / envDesc.cell_size); // Make sure no two iteration steps are separated more than 1 cell
-	double increment = distance / steps;
+	if (far_field.enabled())
+		hand_off_to_far_field();
 
-	for (int i = 1; i < steps - 1; i++)
+	long left = retirement_allowance.load(std::memory_order_relaxed);
+	retired_filaments += allowance - std::max(left, 0L);
+	if (left < 0 && !retirement_budget_reported)
 	{
-		// Determine point in space to evaluate
-		double pose_x = start_x + vector_x * increment * i;
-		double pose_y = start_y + vector_y * increment * i;
-		double pose_z = start_z + vector_z * increment * i;
-
-		// Determine cell to evaluate (some cells might get evaluated twice due to the current code
-		int x_idx = floor((pose_x - envDesc.min_coord.x) / envDesc.cell_size);
-		int y_idx = floor((pose_y - envDesc.min_coord.y) / envDesc.cell_size);
-		int z_idx = floor((pose_z - envDesc.min_coord.z) / envDesc.cell_size);
+		RCLCPP_INFO(get_logger(), "[filament] The retirement budget (%g of the released gas) was reached. From now on, negligible filaments are only retired as it grows with the released gas",
+			retirement_max_mass_fraction);
+		retirement_budget_reported = true;
+	}
+	current_number_filaments += floor(numFilament_aux);
+	numFilament_aux -= floor(numFilament_aux);
+}
 
-		// Check if the cell is occupied
-		if (envDesc.Env[indexFrom3D(x_idx, y_idx, z_idx)] != 0)
-		{
-			return PATH_OBSTRUCTED;
-		}
+// Hybrid Lagrangian-Eulerian model. The far field diffuses at the rate the filaments were spreading: sigma² grows by
+// filament_growth_gamma per second on each axis (K = gamma / 2), and the noise adds filament_noise_std² per step
+void CFilamentSimulator::init_far_field()
+{
+	if (ensemble_size > 1)
+	{
+		RCLCPP_WARN(get_logger(), "[filament] The far field is not supported in ensemble mode. Disabled");
+		return;
 	}
 
-	// Direct line of sight confirmed!
-	return PATH_UNOBSTRUCTED;
+	double diffusivity = filament_growth_gamma * 1e-4 / 2 + filament_noise_std * filament_noise_std / (2 * time_step); //[m²/s]
+	far_field.configure(envDesc, diffusivity, rasterizer_sigma_bin_ratio);
+	far_field_sigma = far_field_sigma_cells * envDesc.cell_size * 100;
+	far_field_handoffs.resize(filaments.size());
+	if (!warm_start_far_field.empty())
+		far_field.restore(warm_start_far_field);
+	RCLCPP_INFO(get_logger(), "[filament] Far field: filaments wider than %f cm are handed off to the grid (diffusivity %E m2/s)", far_field_sigma,
+		diffusivity);
 }
 
-// Update the filaments location in the 3D environment
-//  According to Farrell Filament model, a filament is afected by three components of the wind flow.
-//  1. Va (large scale wind) -> Advection (Va) -> Movement of a filament as a whole by wind) -> from CFD
-//  2. Vm (middle scale wind)-> Movement of the filament with respect the center of the "plume" -> modeled as white noise
-//  3. Vd (small scale wind) -> Difussion or change of the filament shape (growth with time)
-//  We also consider Gravity and Bouyant Forces given the gas molecular mass
-void CFilamentSimulator::update_filament_location(int i)
+// Deposit the filaments marked in this step on the far field grid, in a fixed order (the marks come from several threads)
+void CFilamentSimulator::hand_off_to_far_field()
 {
-	// Estimte filament acceleration due to gravity & Bouyant force (for the given gas_type):
-	double g = 9.8;
-	double specific_gravity_air = 1; //[dimensionless]
-	double accel = g * (specific_gravity_air - SpecificGravity[gasType]) / SpecificGravity[gasType];
-	double newpos_x, newpos_y, newpos_z;
-	// Update the location of all active filaments
-	// RCLCPP_INFO(get_logger(), "[filament] Updating %i filaments of %lu",current_number_filaments, filaments.size());
+	int count = far_field_handoff_count.load(std::memory_order_relaxed);
+	if (count == 0)
+		return;
+	std::sort(far_field_handoffs.begin(), far_field_handoffs.begin() + count);
 
-	try
+	far_field_sources.clear();
+	for (int n = 0; n < count; n++)
 	{
-		// Get 3D cell of the filament center
-		int x_idx = floor((filaments[i].pose_x - envDesc.min_coord.x) / envDesc.cell_size);
-		int y_idx = floor((filaments[i].pose_y - envDesc.min_coord.y) / envDesc.cell_size);
-		int z_idx = floor((filaments[i].pose_z - envDesc.min_coord.z) / envDesc.cell_size);
-
-		// 1. Simulate Advection (Va)
-		//    Large scale wind-eddies -> Movement of a filament as a whole by wind
-		//------------------------------------------------------------------------
-		newpos_x = filaments[i].pose_x + U[indexFrom3D(x_idx, y_idx, z_idx)] * time_step;
-		newpos_y = filaments[i].pose_y + V[indexFrom3D(x_idx, y_idx, z_idx)] * time_step;
-		newpos_z = filaments[i].pose_z + W[indexFrom3D(x_idx, y_idx, z_idx)] * time_step;
-
-		// Check filament location
-		int valid_location = check_pose_with_environment(newpos_x, newpos_y, newpos_z);
-		switch (valid_location)
-		{
-		case 0:
-			// Free and valid location... update filament position
-			filaments[i].pose_x = newpos_x;
-			filaments[i].pose_y = newpos_y;
-			filaments[i].pose_z = newpos_z;
-			break;
-		case 2:
-			// The location corresponds to an outlet! Delete filament!
-			filaments[i].valid = false;
-			break;
-		default:
-			// The location falls in an obstacle -> Illegal movement (Do not apply advection)
-			break;
-		}
-
-		// 2. Simulate Gravity & Bouyant Force
-		//------------------------------------
-		// OLD approach: using accelerations (pure gas)
-		// newpos_z = filaments[i].pose_z + 0.5*accel*pow(time_step,2);
+		const CFilament& filament = filaments[far_field_handoffs[n]];
+		far_field_sources.push_back({ filament.pose_x, filament.pose_y, filament.pose_z, filament.sigma, filament_numMoles_of_gas });
+	}
+	far_field.deposit(far_field_sources);
+	far_field_filaments += count;
+}
 
-		// Approximation from "Terminal Velocity of a Bubble Rise in a Liquid Column", World Academy of Science, Engineering and Technology 28 2007
-		double ro_air = 1.205;        //[kg/m³] density of air
-		double mu = 19 * pow(10, -6); //[kg/s·m] dynamic viscosity of air
-		double terminal_buoyancy_velocity = (g * (1 - SpecificGravity[gasType]) * ro_air * filament_ppm_center * pow(10, -6)) / (18 * mu);
-		// newpos_z = filaments[i].pose_z + terminal_buoyancy_velocity*time_step;
+// Interleave the bits of the cell indices (x in bit 0, y in bit 1, z in bit 2, ...)
+static uint64_t mortonCode(uint32_t x, uint32_t y, uint32_t z)
+{
+	auto spread = [](uint64_t v)
+	{
+		v &= 0x1fffff; // 21 bits per axis
+		v = (v | v << 32) & 0x1f00000000ffff;
+		v = (v | v << 16) & 0x1f0000ff0000ff;
+		v = (v | v << 8) & 0x100f00f00f00f00f;
+		v = (v | v << 4) & 0x10c30c30c30c30c3;
+		v = (v | v << 2) & 0x1249249249249249;
+		return v;
+	};
+	return spread(x) | spread(y) << 1 | spread(z) << 2;
+}
 
-		// Check filament location
-		if (check_pose_with_environment(filaments[i].pose_x, filaments[i].pose_y, newpos_z) == 0)
+// Reorder the active filaments by the Morton code of their cell (LSD radix sort), so the filaments processed together
+// by a thread read the same part of the wind field and the environment. Invalid filaments are moved to the end.
+// The IDs are kept in CFilament::id, so the results do not change
+void CFilamentSimulator::sort_filaments()
+{
+	int n = current_number_filaments;
+	int max_cells = std::max(envDesc.num_cells.x, std::max(envDesc.num_cells.y, envDesc.num_cells.z));
+	int bits_per_axis = 1;
+	while ((1 << bits_per_axis) < max_cells)
+		bits_per_axis++;
+	int key_bits = 3 * bits_per_axis + 1; // the extra bit is for the invalid filaments
+	uint64_t invalid_key = (uint64_t)1 << (3 * bits_per_axis);
+
+	sort_keys.resize(n);
+	sort_order.resize(n);
+	sort_keys_aux.resize(n);
+	sort_order_aux.resize(n);
+
+	#pragma omp taskloop
+	for (int i = 0; i < n; i++)
+	{
+		const CFilament& filament = filaments[i];
+		if (filament.valid)
 		{
-			filaments[i].pose_z = newpos_z;
+			int x_idx = std::clamp((int)floor((filament.pose_x - envDesc.min_coord.x) / envDesc.cell_size), 0, envDesc.num_cells.x - 1);
+			int y_idx = std::clamp((int)floor((filament.pose_y - envDesc.min_coord.y) / envDesc.cell_size), 0, envDesc.num_cells.y - 1);
+			int z_idx = std::clamp((int)floor((filament.pose_z - envDesc.min_coord.z) / envDesc.cell_size), 0, envDesc.num_cells.z - 1);
+			sort_keys[i] = mortonCode(x_idx, y_idx, z_idx);
 		}
-		else if (check_pose_with_environment(filaments[i].pose_x, filaments[i].pose_y, newpos_z) == 2)
+		else
+			sort_keys[i] = invalid_key;
+		sort_order[i] = i;
+	}
+
+	// 8 bits per pass, only as many passes as the keys need
+	for (int shift = 0; shift < key_bits; shift += 8)
+	{
+		size_t count[257] = { 0 };
+		for (int i = 0; i < n; i++)
+			count[((sort_keys[i] >> shift) & 0xff) + 1]++;
+		for (int b = 0; b < 256; b++)
+			count[b + 1] += count[b];
+		for (int i = 0; i < n; i++)
 		{
-			filaments[i].valid = false;
+			size_t dst = count[(sort_keys[i] >> shift) & 0xff]++;
+			sort_keys_aux[dst] = sort_keys[i];
+			sort_order_aux[dst] = sort_order[i];
 		}
+		sort_keys.swap(sort_keys_aux);
+		sort_order.swap(sort_order_aux);
+	}
 
-		// 3. Add some variability (stochastic process)
-
-		static thread_local std::mt19937 engine;
-		static thread_local std::normal_distribution<> dist{ 0, filament_noise_std };
+	sorted_filaments.resize(n);
+	#pragma omp taskloop
+	for (int i = 0; i < n; i++)
+		sorted_filaments[i] = filaments[sort_order[i]];
+	std::copy(sorted_filaments.begin(), sorted_filaments.end(), filaments.begin());
+}
 
-		newpos_x = filaments[i].pose_x + dist(engine);
-		newpos_y = filaments[i].pose_y + dist(engine);
-		newpos_z = filaments[i].pose_z + dist(engine);
+CFilamentSimulator::PlumeSummary CFilamentSimulator::summarize_plume()
+{
+	PlumeSummary summary;
+	summary.time = sim_time;
+	double sum[3] = { 0, 0, 0 };
+	double sum_sq = 0;
+	for (int i = 0; i < current_number_filaments; i++)
+	{
+		const CFilament& filament = filaments[i];
+		if (!filament.valid)
+			continue;
+		summary.count++;
+		sum[0] += filament.pose_x;
+		sum[1] += filament.pose_y;
+		sum[2] += filament.pose_z;
+		sum_sq += filament.pose_x * filament.pose_x + filament.pose_y * filament.pose_y + filament.pose_z * filament.pose_z;
+	}
+	if (summary.count == 0)
+		return summary;
+
+	for (int axis = 0; axis < 3; axis++)
+		summary.centroid[axis] = sum[axis] / summary.count;
+	double centroid_sq = summary.centroid[0] * summary.centroid[0] + summary.centroid[1] * summary.centroid[1] + summary.centroid[2] * summary.centroid[2];
+	summary.spread = sqrt(std::max(sum_sq / summary.count - centroid_sq, 0.0));
+	return summary;
+}
 
-		// Check filament location
-		if (check_pose_with_environment(newpos_x, newpos_y, newpos_z) == 0)
-		{
-			filaments[i].pose_x = newpos_x;
-			filaments[i].pose_y = newpos_y;
-			filaments[i].pose_z = newpos_z;
-		}
+// Gas mass, centroid of the plume and each probe (see check_convergence)
+void CFilamentSimulator::init_convergence()
+{
+	std::vector<std::string> names = { "gas mass", "centroid x", "centroid y", "centroid z" };
+	std::vector<bool> relative = { true, false, false, false };
+	for (size_t p = 0; p < probes.num_probes(); p++)
+	{
+		names.push_back(boost::str(boost::format("probe %i") % p));
+		relative.push_back(true);
+	}
+	convergence.configure(convergence_window, convergence_tolerance, names, relative);
+	convergence_values.resize(names.size());
+	convergence_floors.resize(names.size());
+	if (verbose)
+		RCLCPP_INFO(get_logger(), "[filament] Steady state detection: windows of %.2f s, tolerance %g, %zu probes. Then %s", convergence_window,
+			convergence_tolerance, probes.num_probes(), convergence_action.c_str());
+}
 
-		// 4. Filament growth with time (this affects the posterior estimation of gas concentration at each cell)
-		//    Vd (small scale wind eddies) -> Difussion or change of the filament shape (growth with time)
-		//    R = sigma of a 3D gaussian -> Increasing sigma with time
-		//------------------------------------------------------------------------
-		filaments[i].sigma = sqrt(pow(filament_initial_std, 2) + filament_growth_gamma * (sim_time - filaments[i].birth_time));
+// Feed the convergence monitor with the state after the current step (of the first realization, in ensemble mode).
+// The scale of the mass is one filament, the one of the centroid the spread of the plume (at least a cell), and the one of
+// the probes convergence_min_ppm. True if the simulation has to stop now
+bool CFilamentSimulator::check_convergence()
+{
+	if (!convergence.enabled() || convergence.converged())
+		return false;
+
+	select_member(0);
+	PlumeSummary plume = summarize_plume();
+	convergence_values[0] = plume.count * filament_numMoles_of_gas + (far_field.enabled() ? far_field.total_moles() : 0);
+	convergence_floors[0] = filament_numMoles_of_gas;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		convergence_values[1 + axis] = plume.centroid[axis];
+		convergence_floors[1 + axis] = std::max(plume.spread, envDesc.cell_size);
 	}
-	catch (...)
+	const std::vector<double>& probe_values = probes.last_values();
+	for (size_t p = 0; p < probe_values.size(); p++)
 	{
-		RCLCPP_ERROR(get_logger(), "Exception Updating Filaments!");
-		return;
+		convergence_values[4 + p] = probe_values[p];
+		convergence_floors[4 + p] = convergence_min_ppm;
 	}
+
+	if (!convergence.add(sim_time, convergence_values, convergence_floors))
+		return false;
+
+	RCLCPP_INFO(get_logger(), "[filament] The plume is steady at t=%.2f s (windows of %.2f s, largest change %.4f in %s)", sim_time,
+		convergence_window, convergence.worst_change(), convergence.worst_quantity().c_str());
+	if (convergence_action == "stop")
+		return true;
+
+	RCLCPP_INFO(get_logger(), "[filament] Saving every %.2f s from now on", convergence_results_time_step);
+	results_time_step = convergence_results_time_step;
+	return false;
+}
+
+// Whether the results have to be saved now. With results_policy "on_change", only if the plume changed more than
+// results_change_tolerance since the last save: drift of the centroid or change of the spread (relative to the spread),
+// or change of the gas mass (number of filaments). Or if results_max_gap has passed.
+// In ensemble mode the first realization is checked
+bool CFilamentSimulator::plume_changed()
+{
+	if (results_policy != "on_change")
+		return true;
+
+	select_member(0);
+	PlumeSummary current = summarize_plume();
+	const PlumeSummary& last = last_saved_plume;
+
+	double reference_spread = std::max(last.spread, envDesc.cell_size);
+	double drift = sqrt(pow(current.centroid[0] - last.centroid[0], 2) + pow(current.centroid[1] - last.centroid[1], 2) + pow(current.centroid[2] - last.centroid[2], 2));
+	double change = std::max(drift, std::abs(current.spread - last.spread)) / reference_spread;
+	change = std::max(change, std::abs(current.count - last.count) / (double)std::max(last.count, 1));
+
+	if (change <= results_change_tolerance && current.time - last.time < results_max_gap - 1e-6)
+		return false;
+
+	last_saved_plume = current;
+	return true;
 }
 
 //==========================//
 //                          //
 //==========================//
-void CFilamentSimulator::update_filaments_location()
+std::shared_ptr<const FilamentSnapshot> CFilamentSimulator::take_snapshot(bool with_far_field)
 {
-	#pragma omp parallel for
-	for (int i = 0; i < current_number_filaments; i++)
+	auto snapshot = std::make_shared<FilamentSnapshot>();
+	snapshot->sim_time = sim_time;
+	snapshot->wind_idx = last_wind_idx;
+	snapshot->member = ensemble_size > 1 ? active_member : -1;
+	snapshot->steady_time = convergence.convergence_time();
+	snapshot->filaments.assign(filaments.begin(), filaments.begin() + current_number_filaments);
+	if (with_far_field && far_field.enabled())
+		snapshot->far_field.assign(far_field.moles().begin(), far_field.moles().end());
+	return snapshot;
+}
+
+// The concentration grid of the filaments (see update_gas_concentration_from_filaments) and the far field, without the
+// filaments. Called from the thread that runs the steps: the grid is computed by the whole team
+std::shared_ptr<const FilamentSnapshot> CFilamentSimulator::take_concentration_snapshot()
+{
+	update_gas_concentration_from_filaments();
+
+	auto snapshot = std::make_shared<FilamentSnapshot>();
+	snapshot->sim_time = sim_time;
+	snapshot->wind_idx = last_wind_idx;
+	snapshot->member = ensemble_size > 1 ? active_member : -1;
+	snapshot->steady_time = convergence.convergence_time();
+	snapshot->concentration = C;
+	if (gasConc_unit != 0)
 	{
-		if (filaments[i].valid)
+		for (Gaden::Real& c : snapshot->concentration)
+			c = c * env_cell_numMoles / pow(10, 6); //[ppm] -> [moles]
+	}
+	if (far_field.enabled())
+		snapshot->far_field.assign(far_field.moles().begin(), far_field.moles().end());
+	return snapshot;
+}
+
+// The statistics of the concentration over the realizations, and the filaments of the ones that are saved. The grid of each
+// realization is computed with concentration_rasterizer (see update_gas_concentration_from_filaments) and added to the
+// statistics right away, so only one is kept. Called from the thread that runs the steps: the grids are computed by the team
+std::shared_ptr<const EnsembleSnapshot> CFilamentSimulator::take_ensemble_snapshot()
+{
+	auto snapshot = std::make_shared<EnsembleSnapshot>(envDesc.Env.size(), ensemble_exceedance_ppm);
+	snapshot->sim_time = sim_time;
+	for (int member = 0; member < ensemble_size; member++)
+	{
+		select_member(member);
+		update_gas_concentration_from_filaments();
+		if (gasConc_unit == 0)
 		{
-			update_filament_location(i);
+			ensemble_ppm.resize(C.size());
+			for (size_t i = 0; i < C.size(); i++)
+				ensemble_ppm[i] = (C[i] / env_cell_numMoles) * pow(10, 6); //[ppm]
+			snapshot->statistics.add_member(ensemble_ppm);
 		}
+		else
+			snapshot->statistics.add_member(C);
+
+		if (std::find(ensemble_save_members.begin(), ensemble_save_members.end(), member) != ensemble_save_members.end())
+			snapshot->members.push_back(take_snapshot());
 	}
-	current_number_filaments += floor(numFilament_aux);
-	numFilament_aux -= floor(numFilament_aux);
+	return snapshot;
+}
+
+void CFilamentSimulator::save_ensemble(const EnsembleSnapshot& snapshot, int iteration)
+{
+	std::string filename = boost::str(boost::format("%s/ensemble_%i") % results_location % iteration);
+	if (!snapshot.statistics.save(filename, snapshot.sim_time, envDesc))
+		RCLCPP_ERROR(get_logger(), "[filament] Could not write %s", filename.c_str());
+
+	for (const auto& member : snapshot.members)
+		save_state_to_file(*member, iteration);
 }
 
 //==========================//
 //                          //
 //==========================//
-void CFilamentSimulator::publish_markers()
+void CFilamentSimulator::publish_markers(const FilamentSnapshot& snapshot)
 {
 	// 1. Clean old markers
 	filament_marker.points.clear();
 	filament_marker.colors.clear();
-	filament_marker.header.stamp = now();
+	// when running faster than real time, stamp with the simulation time (published on /clock)
+	filament_marker.header.stamp = max_speed ? rclcpp::Time((int64_t)(snapshot.sim_time * 1e9)) : now();
 	filament_marker.pose.orientation.w = 1.0;
 
 	// width of points: scale.x is point width, scale.y is point height
@@ -804,19 +1700,19 @@ void CFilamentSimulator::publish_markers()
 	filament_marker.scale.z = envDesc.cell_size / 4;
 
 	// 2. Add a marker for each filament!
-	for (int i = 0; i < current_number_filaments; i++)
+	for (const CFilament& filament : snapshot.filaments)
 	{
 		geometry_msgs::msg::Point point;
 		std_msgs::msg::ColorRGBA color;
 
 		// Set filament pose
-		point.x = filaments[i].pose_x;
-		point.y = filaments[i].pose_y;
-		point.z = filaments[i].pose_z;
+		point.x = filament.pose_x;
+		point.y = filament.pose_y;
+		point.z = filament.pose_z;
 
 		// Set filament color
 		color.a = 1;
-		if (filaments[i].valid)
+		if (filament.valid)
 		{
 			color.r = 0;
 			color.g = 0;
@@ -857,12 +1753,31 @@ bool eq(double a, double b)
 
 // Saves current Wind + GasConcentration to file
 //  These files will be later used in the "player" node.
-void CFilamentSimulator::save_state_to_file()
+//  Only reads the snapshot and constant data, so it can run concurrently with the simulation
+void CFilamentSimulator::save_state_to_file(const FilamentSnapshot& snapshot, int iteration)
 {
-	last_saved_step++;
-	last_saved_timestamp = sim_time;
+	if (results_archive.is_open())
+	{
+		save_state_to_archive(snapshot, iteration);
+		return;
+	}
+
 	// Configure file name for saving the current snapshot
-	std::string out_filename = boost::str(boost::format("%s/iteration_%i") % results_location % last_saved_step);
+	std::string location = results_location;
+	if (snapshot.member >= 0)
+		location = boost::str(boost::format("%s/member_%i") % results_location % snapshot.member);
+	std::string out_filename = boost::str(boost::format("%s/iteration_%i") % location % iteration);
+
+	// The far field goes first, so a reader that finds the iteration also finds its far field
+	if (!snapshot.far_field.empty())
+	{
+		std::stringstream far_field_data(CFarField::serialize(snapshot.far_field, snapshot.sim_time, envDesc.num_cells));
+		boost::iostreams::filtering_streambuf<boost::iostreams::input> far_field_buf;
+		far_field_buf.push(boost::iostreams::zlib_compressor());
+		far_field_buf.push(far_field_data);
+		std::ofstream far_field_file(boost::str(boost::format("%s/far_field_%i") % location % iteration), std::ios_base::binary);
+		boost::iostreams::copy(far_field_buf, far_field_file);
+	}
 
 	FILE* file = fopen(out_filename.c_str(), "wb");
 	if (file == NULL)
@@ -877,7 +1792,7 @@ void CFilamentSimulator::save_state_to_file()
 	inbuf.push(boost::iostreams::zlib_compressor());
 	inbuf.push(ist);
 
-	int h = 1;
+	int h = 3; // format version (1 = no timestamp, 2 = no output filters)
 	ist.write((char*)&h, sizeof(int));
 
 	ist.write((char*)&envDesc.min_coord.x, sizeof(double));
@@ -907,17 +1822,22 @@ void CFilamentSimulator::save_state_to_file()
 	double num_moles_all_gases_in_cm3 = env_cell_numMoles / env_cell_vol;
 	ist.write((char*)&num_moles_all_gases_in_cm3, sizeof(double));
 
-	ist.write((char*)&last_wind_idx, sizeof(int)); // index of the wind file (they are stored separately under (results_location)/wind/... )
+	ist.write((char*)&snapshot.wind_idx, sizeof(int)); // index of the wind file (they are stored separately under (results_location)/wind/... )
+	ist.write((char*)&snapshot.sim_time, sizeof(double));
+
+	// description of the output filters (empty if all the filaments are saved)
+	std::string filters = results_description(snapshot.steady_time);
+	int filters_length = filters.size();
+	ist.write((char*)&filters_length, sizeof(int));
+	ist.write(filters.data(), filters_length);
 
-	for (int i = 0; i < filaments.size(); i++)
+	for (const CFilament& filament : snapshot.filaments)
 	{
-		if (filaments[i].valid)
+		if (filament.valid && output_filter.accept(filament))
 		{
-			ist.write((char*)&i, sizeof(int));
-			ist.write((char*)&filaments[i].pose_x, sizeof(double));
-			ist.write((char*)&filaments[i].pose_y, sizeof(double));
-			ist.write((char*)&filaments[i].pose_z, sizeof(double));
-			ist.write((char*)&filaments[i].sigma, sizeof(double));
+			ist.write((char*)&filament.id, sizeof(int));
+			double values[4] = { filament.pose_x, filament.pose_y, filament.pose_z, filament.sigma }; // always stored in double
+			ist.write((char*)values, 4 * sizeof(double));
 		}
 	}
 
@@ -926,6 +1846,202 @@ void CFilamentSimulator::save_state_to_file()
 	fi.close();
 }
 
+// Environment and gas constants, as stored in the header of the archive (also used by the live exchange)
+Gaden::ArchiveHeader CFilamentSimulator::results_header()
+{
+	Gaden::ArchiveHeader header;
+	header.min_coord[0] = envDesc.min_coord.x;
+	header.min_coord[1] = envDesc.min_coord.y;
+	header.min_coord[2] = envDesc.min_coord.z;
+	header.max_coord[0] = envDesc.max_coord.x;
+	header.max_coord[1] = envDesc.max_coord.y;
+	header.max_coord[2] = envDesc.max_coord.z;
+	header.num_cells[0] = envDesc.num_cells.x;
+	header.num_cells[1] = envDesc.num_cells.y;
+	header.num_cells[2] = envDesc.num_cells.z;
+	header.gas_type = gasType;
+	header.cell_size = envDesc.cell_size;
+	header.source_position[0] = gas_source_pos_x;
+	header.source_position[1] = gas_source_pos_y;
+	header.source_position[2] = gas_source_pos_z;
+	header.filament_moles_of_gas = filament_numMoles_of_gas;
+	header.num_moles_all_gases_in_cm3 = env_cell_numMoles / env_cell_vol;
+	return header;
+}
+
+void CFilamentSimulator::open_results_archive()
+{
+	std::string filename = results_location + "/simulation.gaden";
+	if (!results_archive.open(filename, results_header()))
+	{
+		RCLCPP_ERROR(get_logger(), "CANNOT OPEN RESULTS ARCHIVE %s", filename.c_str());
+		exit(1);
+	}
+
+	// Record the output filters
+	Gaden::ChunkHeader metadata{};
+	metadata.type = Gaden::ChunkType::METADATA;
+	archive_metadata = results_description();
+	results_archive.append(metadata, archive_metadata);
+}
+
+// Same contents as the iteration_<n> files, but appended as a chunk of the archive (the header is stored only once)
+void CFilamentSimulator::save_state_to_archive(const FilamentSnapshot& snapshot, int iteration)
+{
+	// The description changes once the plume is steady. Readers take the last metadata chunk
+	std::string description = results_description(snapshot.steady_time);
+	if (description != archive_metadata)
+	{
+		Gaden::ChunkHeader metadata{};
+		metadata.type = Gaden::ChunkType::METADATA;
+		archive_metadata = description;
+		results_archive.append(metadata, archive_metadata);
+	}
+
+	if (!snapshot.far_field.empty())
+	{
+		Gaden::ChunkHeader far_field_header{};
+		far_field_header.type = Gaden::ChunkType::FAR_FIELD;
+		far_field_header.id = iteration;
+		far_field_header.sim_time = snapshot.sim_time;
+		far_field_header.wind_idx = snapshot.wind_idx;
+		results_archive.append(far_field_header, CFarField::serialize(snapshot.far_field, snapshot.sim_time, envDesc.num_cells));
+	}
+
+	Gaden::ChunkHeader header{};
+	header.type = Gaden::ChunkType::ITERATION;
+	header.id = iteration;
+	header.sim_time = snapshot.sim_time;
+	header.wind_idx = snapshot.wind_idx;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		header.bbox_min[axis] = DBL_MAX;
+		header.bbox_max[axis] = -DBL_MAX;
+	}
+
+	std::string data;
+	for (const CFilament& filament : snapshot.filaments)
+	{
+		if (filament.valid && output_filter.accept(filament))
+		{
+			data.append((char*)&filament.id, sizeof(int));
+			double values[4] = { filament.pose_x, filament.pose_y, filament.pose_z, filament.sigma }; // always stored in double
+			data.append((char*)values, 4 * sizeof(double));
+
+			header.num_filaments++;
+			double pose[3] = { filament.pose_x, filament.pose_y, filament.pose_z };
+			for (int axis = 0; axis < 3; axis++)
+			{
+				header.bbox_min[axis] = std::min(header.bbox_min[axis], pose[axis]);
+				header.bbox_max[axis] = std::max(header.bbox_max[axis], pose[axis]);
+			}
+		}
+	}
+
+	results_archive.append(header, data);
+}
+
+// Write the index of the archive (if any) and whatever is still buffered
+void CFilamentSimulator::close_results()
+{
+	results_archive.close();
+	probes.flush();
+	live_exchange.close();
+	if (maps_stride > 0)
+		update_concentration_maps(FilamentSnapshot(), true);
+}
+
+// How the saved filaments were selected: output filters, and retirement (which removes them from the simulation).
+// And when the plume became steady, if it had when the snapshot was taken
+std::string CFilamentSimulator::results_description(double steady_time)
+{
+	std::string description = output_filter.describe();
+	if (retirement_min_peak_ppm > 0)
+		description += boost::str(boost::format("retirement_min_peak_ppm %g (sigma > %g cm), max mass fraction %g; ") % retirement_min_peak_ppm %
+			retirement_sigma % retirement_max_mass_fraction);
+	if (far_field.enabled())
+		description += boost::str(boost::format("far_field_sigma_cells %g (sigma > %g cm); ") % far_field_sigma_cells % far_field_sigma);
+	if (steady_time >= 0)
+		description += boost::str(boost::format("steady from t=%g s (convergence_window %g s, tolerance %g); ") % steady_time % convergence_window %
+			convergence_tolerance);
+	return description;
+}
+
+// Gas removed from the simulation by retirement (over all the realizations)
+void CFilamentSimulator::report_retirement()
+{
+	if (retirement_min_peak_ppm <= 0)
+		return;
+	long retired = retired_filaments;
+	long released = current_number_filaments;
+	for (size_t member = 0; member < ensemble_members.size(); member++)
+	{
+		if ((int)member == active_member)
+			continue;
+		retired += ensemble_members[member].retired_filaments;
+		released += ensemble_members[member].current_number_filaments;
+	}
+	RCLCPP_INFO(get_logger(), "[filament] Retired %ld of %ld filaments: %E mol of gas (%.3f%% of the released gas)", retired, released,
+		retired * filament_numMoles_of_gas, released > 0 ? 100.0 * retired / released : 0.0);
+}
+
+// Share of the time spent in update_gas_concentration_from_filaments that each thread was splatting (100% = perfect scaling)
+void CFilamentSimulator::report_splat()
+{
+	if (splat_calls == 0 || splat_time <= 0)
+		return;
+
+	double mean = 0, lowest = DBL_MAX, highest = 0;
+	for (const ThreadBusy& busy : splat_thread_busy)
+	{
+		mean += busy.seconds / splat_time / splat_thread_busy.size();
+		lowest = std::min(lowest, busy.seconds / splat_time);
+		highest = std::max(highest, busy.seconds / splat_time);
+	}
+	RCLCPP_INFO(get_logger(), "[filament] update_gas_concentration_from_filaments: %.3f ms per call (%d calls), thread utilisation %.0f%% (min %.0f%%, max %.0f%%)",
+		1000 * splat_time / splat_calls, splat_calls, 100 * mean, 100 * lowest, 100 * highest);
+	if (verbose)
+	{
+		for (size_t t = 0; t < splat_thread_busy.size(); t++)
+			RCLCPP_INFO(get_logger(), "[filament]   thread %zu: %.0f%%", t, 100 * splat_thread_busy[t].seconds / splat_time);
+	}
+}
+
+// Why the plume did not become steady (the quantity that was still changing)
+void CFilamentSimulator::report_convergence()
+{
+	if (!convergence.enabled() || convergence.converged())
+		return;
+	if (convergence.worst_quantity().empty())
+		RCLCPP_INFO(get_logger(), "[filament] The plume did not become steady: the run was shorter than two windows of %.2f s", convergence_window);
+	else
+		RCLCPP_INFO(get_logger(), "[filament] The plume did not become steady: largest change %.4f in %s between the last two windows (tolerance %g)",
+			convergence.worst_change(), convergence.worst_quantity().c_str(), convergence_tolerance);
+}
+
+// Gas handed off to the far field, and where it is now
+void CFilamentSimulator::report_far_field()
+{
+	if (!far_field.enabled())
+		return;
+	RCLCPP_INFO(get_logger(), "[filament] Far field: %ld filaments handed off (%E mol of gas). %E mol in the grid, %E mol left through the outlets",
+		far_field_filaments, far_field.deposited_moles(), far_field.total_moles(), far_field.removed_moles());
+}
+
+// Each update stands for the maps_stride steps until the next one. Runs as a task (the maps are only used from these)
+void CFilamentSimulator::update_concentration_maps(const FilamentSnapshot& snapshot, bool flush)
+{
+	if (!snapshot.concentration.empty())
+		concentration_maps.update(snapshot.concentration, snapshot.far_field, maps_stride * time_step, snapshot.sim_time);
+
+	if (flush)
+	{
+		std::string filename = results_location + "/concentration_maps";
+		if (!concentration_maps.save(filename))
+			RCLCPP_ERROR(get_logger(), "[filament] Could not write %s", filename.c_str());
+	}
+}
+
 int CFilamentSimulator::indexFrom3D(int x, int y, int z)
 {
 	return Gaden::indexFrom3D(Gaden::Vector3i(x, y, z), envDesc.num_cells);
@@ -939,63 +2055,172 @@ int main(int argc, char** argv)
 	// Init ROS-NODE
 	rclcpp::init(argc, argv);
 
-	// Create simulator obj and initialize it
-	std::shared_ptr<CFilamentSimulator> sim = std::make_shared<CFilamentSimulator>();
+	// --max-speed: run as fast as possible and publish the simulation time on /clock
+	bool max_speed = false;
+	for (const std::string& arg : rclcpp::remove_ros_arguments(argc, argv))
+		if (arg == "--max-speed")
+			max_speed = true;
+
+	// Create simulator obj
+	std::shared_ptr<CFilamentSimulator> sim = std::make_shared<CFilamentSimulator>(max_speed);
+
+	// All the ROS communication (subscriptions, publishing) happens in this thread
+	rclcpp::executors::SingleThreadedExecutor executor;
+	executor.add_node(sim);
+	std::thread ros_thread([&executor]() { executor.spin(); });
+
+	// Initialize the simulator
+	sim->initialize();
+	sim->configure_memory();
 
-	// Initiate Random Number generator with current time
-	srand(time(NULL));
+	// Initiate Random Number generator (see random_seed)
+	srand(sim->random_seed);
 
 	//--------------
 	// LOOP
 	//--------------
-	while (rclcpp::ok() && (sim->current_simulation_step < sim->numSteps))
+	// The loop runs on a single thread of the OpenMP team, which generates the tasks of each step.
+	// Advection is split in tasks (taskloop), while saving runs as tasks over immutable snapshots, so step N+1 can
+	// be advected while step N is still being compressed/written. All of it shares the same team, so there is no
+	// oversubscription. The dependency token keeps the saves in order.
+	// Visualization is handed over to the ROS thread through a lock-free queue.
+	std::atomic<int> pending_io_tasks{ 0 };
+	[[maybe_unused]] int save_token = 0; // only used as the address of the depend clauses
+	[[maybe_unused]] int maps_token = 0;
+
+	#pragma omp parallel
+	#pragma omp single
 	{
-		// RCLCPP_INFO(sim->get_logger(), "[filament] Simulating step %i (sim_time = %.2f)", sim->current_simulation_step, sim->sim_time);
-
-		// 0. Load wind snapshot (if necessary and availabe)
-		if (sim->sim_time - sim->sim_time_last_wind >= sim->windTime_step)
+		while (rclcpp::ok() && (sim->current_simulation_step < sim->numSteps))
 		{
-			// Time to update wind!
-			sim->sim_time_last_wind = sim->sim_time;
-			if (sim->allow_looping)
+			// RCLCPP_INFO(sim->get_logger(), "[filament] Simulating step %i (sim_time = %.2f)", sim->current_simulation_step, sim->sim_time);
+
+			// 0. Load wind snapshot (if necessary and availabe)
+			if (sim->sim_time - sim->sim_time_last_wind >= sim->windTime_step)
 			{
-				// Load wind-data
-				sim->read_wind_snapshot(sim->current_wind_snapshot);
-				// Update idx
-				if (sim->current_wind_snapshot >= sim->loop_to_step)
+				// Time to update wind!
+				sim->sim_time_last_wind = sim->sim_time;
+				if (sim->allow_looping)
 				{
-					sim->current_wind_snapshot = sim->loop_from_step;
-					sim->wind_finished = true;
+					// Load wind-data
+					sim->read_wind_snapshot(sim->current_wind_snapshot);
+					// Update idx
+					if (sim->current_wind_snapshot >= sim->loop_to_step)
+					{
+						sim->current_wind_snapshot = sim->loop_from_step;
+						sim->wind_finished = true;
+					}
+					else
+						sim->current_wind_snapshot++;
 				}
 				else
-					sim->current_wind_snapshot++;
+					sim->read_wind_snapshot(floor(sim->sim_time / sim->windTime_step)); // Alllways increasing
 			}
-			else
-				sim->read_wind_snapshot(floor(sim->sim_time / sim->windTime_step)); // Alllways increasing
-		}
 
-		// 1. Create new filaments close to the source location
-		//    On each iteration num_filaments (See params) are created
-		sim->add_new_filaments(sim->envDesc.cell_size);
+			// In ensemble mode, steps 1-3 are done for every realization over the same wind (the markers show the first one)
+			for (int member = 0; member < sim->ensemble_size; member++)
+			{
+				sim->select_member(member);
 
-		// 2. Publish markers for RVIZ
-		sim->publish_markers();
+				// 1. Create new filaments close to the source location
+				//    On each iteration num_filaments (See params) are created
+				sim->add_new_filaments(sim->envDesc.cell_size);
 
-		// 3. Update filament locations
-		sim->update_filaments_location();
+				// 2. Publish markers for RVIZ (and the simulation time), and sample the probes
+				if (member == 0)
+				{
+					sim->notify_step();
+					sim->record_probes();
+				}
 
-		// 4. Save data (if necessary)
-		if ((sim->save_results == 1) && (sim->sim_time >= sim->results_min_time))
-		{
-			double time_next_save = sim->results_time_step + sim->last_saved_timestamp;
-			if (sim->sim_time > time_next_save || std::abs(sim->sim_time - time_next_save) < 0.01)
-				sim->save_state_to_file();
-		}
+				// 3. Update filament locations
+				sim->update_filaments_location();
+			}
+
+			// 4. Update the running concentration maps (of the first realization, in ensemble mode)
+			if (sim->maps_stride > 0 && sim->current_simulation_step % sim->maps_stride == 0)
+			{
+				bool flush = sim->maps_flush_interval > 0 && sim->sim_time - sim->last_maps_flush_time >= sim->maps_flush_interval;
+				if (flush)
+					sim->last_maps_flush_time = sim->sim_time;
+
+				if (pending_io_tasks >= sim->max_pending_io_tasks)
+				{
+					#pragma omp taskwait
+				}
+
+				sim->select_member(0);
+				std::shared_ptr<const FilamentSnapshot> snapshot = sim->take_concentration_snapshot();
+				pending_io_tasks++;
+				#pragma omp task firstprivate(snapshot, flush) shared(pending_io_tasks) depend(inout : maps_token)
+				{
+					sim->update_concentration_maps(*snapshot, flush);
+					pending_io_tasks--;
+				}
+			}
+
+			// The plume might have become steady (see check_convergence). When stopping, the last state is always saved
+			bool steady_stop = sim->check_convergence();
 
-		// 5. Update Simulation state
-		sim->sim_time = sim->sim_time + sim->time_step; // sec
-		sim->current_simulation_step++;
+			// 5. Save data (if necessary)
+			if ((sim->save_results == 1) && (sim->sim_time >= sim->results_min_time))
+			{
+				double time_next_save = sim->results_time_step + sim->last_saved_timestamp;
+				bool save_time = sim->sim_time > time_next_save || std::abs(sim->sim_time - time_next_save) < 0.01;
+				if (save_time)
+					sim->last_saved_timestamp = sim->sim_time;
+				if (steady_stop || (save_time && sim->plume_changed()))
+				{
+					sim->last_saved_step++;
+
+					// Do not let the snapshots pile up if the IO is slower than the simulation
+					if (pending_io_tasks >= sim->max_pending_io_tasks)
+					{
+						#pragma omp taskwait
+					}
+
+					int iteration = sim->last_saved_step;
+					pending_io_tasks++;
+					if (sim->ensemble_size > 1)
+					{
+						std::shared_ptr<const EnsembleSnapshot> snapshot = sim->take_ensemble_snapshot();
+						#pragma omp task firstprivate(snapshot, iteration) shared(pending_io_tasks) depend(inout : save_token)
+						{
+							sim->save_ensemble(*snapshot, iteration);
+							pending_io_tasks--;
+						}
+					}
+					else
+					{
+						std::shared_ptr<const FilamentSnapshot> snapshot = sim->take_snapshot(true);
+						#pragma omp task firstprivate(snapshot, iteration) shared(pending_io_tasks) depend(inout : save_token)
+						{
+							sim->save_state_to_file(*snapshot, iteration);
+							pending_io_tasks--;
+						}
+					}
+				}
+			}
+
+			// 6. Update Simulation state
+			sim->sim_time = sim->sim_time + sim->time_step; // sec
+			sim->current_simulation_step++;
+			if (steady_stop)
+				break;
+		}
 
-		rclcpp::spin_some(sim);
+		// Wait for the last snapshots to be written
+		#pragma omp taskwait
 	}
+	sim->close_results();
+	sim->report_retirement();
+	sim->report_far_field();
+	sim->report_convergence();
+	if (sim->advection_calls > 0)
+		RCLCPP_INFO(sim->get_logger(), "[filament] update_filaments_location: %.3f ms per call (%d calls)", 1000 * sim->advection_time / sim->advection_calls, sim->advection_calls);
+	sim->report_splat();
+
+	executor.cancel();
+	ros_thread.join();
+	rclcpp::shutdown();
 }
@@ -0,0 +1,127 @@
+/*---------------------------------------------------------------------------------------
+ * Filters applied to the filaments before saving them to the results files.
+ * See output_filter.h
+ ---------------------------------------------------------------------------------------*/
+
+#include "filament_simulator/output_filter.h"
+#include <math.h>
+#include <float.h>
+#include <algorithm>
+#include <boost/format.hpp>
+
+COutputFilter::COutputFilter()
+{
+	polygon_z[0] = -DBL_MAX;
+	polygon_z[1] = DBL_MAX;
+	min_peak_ppm = 0;
+	max_sigma = DBL_MAX;
+}
+
+void COutputFilter::set_regions(const std::vector<double>& box_values, const std::vector<double>& polygon_values, const std::vector<double>& polygon_z_values)
+{
+	boxes.clear();
+	for (size_t i = 0; i + 5 < box_values.size(); i += 6)
+	{
+		Box box;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			box.min[axis] = std::min(box_values[i + axis], box_values[i + 3 + axis]);
+			box.max[axis] = std::max(box_values[i + axis], box_values[i + 3 + axis]);
+		}
+		boxes.push_back(box);
+	}
+
+	// a polygon needs at least three vertices
+	polygon.clear();
+	if (polygon_values.size() >= 6)
+		polygon.assign(polygon_values.begin(), polygon_values.end() - polygon_values.size() % 2);
+	if (polygon_z_values.size() == 2)
+	{
+		polygon_z[0] = std::min(polygon_z_values[0], polygon_z_values[1]);
+		polygon_z[1] = std::max(polygon_z_values[0], polygon_z_values[1]);
+	}
+}
+
+void COutputFilter::set_min_peak_ppm(double min_ppm, double filament_moles_of_gas, double num_moles_all_gases_in_cm3)
+{
+	min_peak_ppm = min_ppm;
+	max_sigma = DBL_MAX;
+	if (min_ppm > 0)
+	{
+		// peak_ppm(sigma) = K / sigma^3   ->   peak_ppm >= min_ppm   <=>   sigma <= cbrt(K / min_ppm)
+		double K = filament_moles_of_gas / (sqrt(8 * pow(M_PI, 3)) * num_moles_all_gases_in_cm3) * 1e6;
+		max_sigma = cbrt(K / min_ppm);
+	}
+}
+
+bool COutputFilter::enabled() const
+{
+	return !boxes.empty() || !polygon.empty() || min_peak_ppm > 0;
+}
+
+bool COutputFilter::accept(const CFilament& filament) const
+{
+	if (filament.sigma > max_sigma)
+		return false;
+
+	if (boxes.empty() && polygon.empty())
+		return true;
+	return in_regions(filament.pose_x, filament.pose_y, filament.pose_z, 3 * filament.sigma / 100);
+}
+
+bool COutputFilter::in_regions(double x, double y, double z, double margin) const
+{
+	for (const Box& box : boxes)
+	{
+		if (x >= box.min[0] - margin && x <= box.max[0] + margin &&
+			y >= box.min[1] - margin && y <= box.max[1] + margin &&
+			z >= box.min[2] - margin && z <= box.max[2] + margin)
+			return true;
+	}
+
+	if (!polygon.empty() && z >= polygon_z[0] - margin && z <= polygon_z[1] + margin)
+		return in_polygon(x, y, margin);
+
+	return false;
+}
+
+// Point inside the polygon (even-odd rule), or closer than margin to one of its edges
+bool COutputFilter::in_polygon(double x, double y, double margin) const
+{
+	bool inside = false;
+	size_t n = polygon.size() / 2;
+	for (size_t i = 0, j = n - 1; i < n; j = i++)
+	{
+		double xi = polygon[2 * i], yi = polygon[2 * i + 1];
+		double xj = polygon[2 * j], yj = polygon[2 * j + 1];
+
+		if ((yi > y) != (yj > y) && x < (xj - xi) * (y - yi) / (yj - yi) + xi)
+			inside = !inside;
+
+		// distance to the edge (j,i)
+		double ex = xi - xj, ey = yi - yj;
+		double length2 = ex * ex + ey * ey;
+		double t = length2 > 0 ? std::clamp(((x - xj) * ex + (y - yj) * ey) / length2, 0.0, 1.0) : 0.0;
+		double dx = xj + t * ex - x, dy = yj + t * ey - y;
+		if (dx * dx + dy * dy <= margin * margin)
+			return true;
+	}
+	return inside;
+}
+
+std::string COutputFilter::describe() const
+{
+	std::string description;
+	for (const Box& box : boxes)
+		description += boost::str(boost::format("roi_box [%g %g %g %g %g %g]; ") % box.min[0] % box.min[1] % box.min[2] % box.max[0] % box.max[1] % box.max[2]);
+	if (!polygon.empty())
+	{
+		description += "roi_polygon [";
+		for (size_t i = 0; i < polygon.size(); i++)
+			description += boost::str(boost::format(i == 0 ? "%g" : " %g") % polygon[i]);
+		description += boost::str(boost::format("] z [%g %g]; ") % polygon_z[0] % polygon_z[1]);
+	}
+	if (min_peak_ppm > 0)
+		description += boost::str(boost::format("min_peak_ppm %g (sigma <= %g cm); ") % min_peak_ppm % max_sigma);
+	return description;
+}
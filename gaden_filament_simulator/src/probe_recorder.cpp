@@ -0,0 +1,214 @@
+/*---------------------------------------------------------------------------------------
+ * Concentration time series at fixed point and line probes.
+ * See probe_recorder.h
+ ---------------------------------------------------------------------------------------*/
+
+#include "filament_simulator/probe_recorder.h"
+#include <math.h>
+#include <algorithm>
+#include <gaden_common/GaussianKernel.h>
+
+static const char probesMagic[8] = { 'G', 'A', 'D', 'E', 'N', 'P', 'R', 'B' };
+
+CProbeRecorder::CProbeRecorder()
+{
+	environment = nullptr;
+	env = nullptr;
+	moles_of_gas = 0;
+	moles_all_gases_in_cm3 = 1;
+}
+
+CProbeRecorder::~CProbeRecorder()
+{
+	flush();
+}
+
+bool CProbeRecorder::configure(const CEnvironmentModel& environment_model, const std::vector<double>& points, const std::vector<double>& lines,
+	double filament_moles_of_gas, double num_moles_all_gases_in_cm3, const std::string& filename)
+{
+	environment = &environment_model;
+	env = &environment_model.base();
+	moles_of_gas = filament_moles_of_gas;
+	moles_all_gases_in_cm3 = num_moles_all_gases_in_cm3;
+	probes.clear();
+	samples.clear();
+
+	auto add_probe = [&](int type, const double* start, const double* end) {
+		Probe probe;
+		probe.type = type;
+		probe.first_sample = samples.size();
+		for (int axis = 0; axis < 3; axis++)
+		{
+			probe.start[axis] = start[axis];
+			probe.end[axis] = end[axis];
+			probe.bbox_min[axis] = std::min(start[axis], end[axis]);
+			probe.bbox_max[axis] = std::max(start[axis], end[axis]);
+		}
+
+		// Lines are integrated with the midpoint rule, with pieces no longer than half a cell
+		double length = sqrt(pow(end[0] - start[0], 2) + pow(end[1] - start[1], 2) + pow(end[2] - start[2], 2));
+		int num_samples = type == 0 ? 1 : std::max((int)ceil(length / (env->cell_size / 2)), 1);
+		for (int i = 0; i < num_samples; i++)
+		{
+			double t = (i + 0.5) / num_samples;
+			Sample sample;
+			sample.x = start[0] + t * (end[0] - start[0]);
+			sample.y = start[1] + t * (end[1] - start[1]);
+			sample.z = start[2] + t * (end[2] - start[2]);
+			sample.weight = type == 0 ? 1 : length / num_samples;
+			sample.free = environment->occupancy(sample.x, sample.y, sample.z) == 0;
+			sample.cell = 0;
+			if (sample.free)
+			{
+				Gaden::Vector3i cell((sample.x - env->min_coord.x) / env->cell_size, (sample.y - env->min_coord.y) / env->cell_size,
+					(sample.z - env->min_coord.z) / env->cell_size);
+				sample.cell = Gaden::indexFrom3D(cell, env->num_cells);
+			}
+			samples.push_back(sample);
+		}
+		probe.last_sample = samples.size();
+		probes.push_back(probe);
+	};
+
+	for (size_t i = 0; i + 2 < points.size(); i += 3)
+		add_probe(0, &points[i], &points[i]);
+	for (size_t i = 0; i + 5 < lines.size(); i += 6)
+		add_probe(1, &lines[i], &lines[i + 3]);
+
+	times.clear();
+	columns.assign(probes.size(), std::vector<double>());
+	latest.assign(probes.size(), 0.0);
+	if (probes.empty())
+		return true;
+
+	file.open(filename, std::ios_base::binary | std::ios_base::trunc);
+	if (!file.is_open())
+	{
+		probes.clear();
+		return false;
+	}
+
+	int version = 1;
+	int num_probes = probes.size();
+	file.write(probesMagic, sizeof(probesMagic));
+	file.write((char*)&version, sizeof(int));
+	file.write((char*)&num_probes, sizeof(int));
+	for (const Probe& probe : probes)
+	{
+		file.write((char*)&probe.type, sizeof(int));
+		file.write((char*)probe.start, 3 * sizeof(double));
+		file.write((char*)probe.end, 3 * sizeof(double));
+	}
+	file.flush();
+	return true;
+}
+
+bool CProbeRecorder::enabled() const
+{
+	return !probes.empty();
+}
+
+size_t CProbeRecorder::num_probes() const
+{
+	return probes.size();
+}
+
+const std::vector<double>& CProbeRecorder::last_values() const
+{
+	return latest;
+}
+
+void CProbeRecorder::record(const std::vector<CFilament>& filaments, int num_filaments, const std::vector<Gaden::Real>* far_field, double sim_time)
+{
+	active.clear();
+	for (int i = 0; i < num_filaments; i++)
+	{
+		const CFilament& filament = filaments[i];
+		if (!filament.valid)
+			continue;
+		ActiveFilament a;
+		a.x = filament.pose_x;
+		a.y = filament.pose_y;
+		a.z = filament.pose_z;
+		a.sigma = filament.sigma;
+		a.cutoff = cutoff_sigmas * filament.sigma / 100;
+		active.push_back(a);
+	}
+
+	times.push_back(sim_time);
+	for (size_t p = 0; p < probes.size(); p++)
+		columns[p].push_back(0);
+
+	// Called from within the task graph of the main loop (see update_filaments_location)
+	#pragma omp taskloop
+	for (size_t p = 0; p < probes.size(); p++)
+		columns[p].back() = evaluate(probes[p], far_field);
+	for (size_t p = 0; p < probes.size(); p++)
+		latest[p] = columns[p].back();
+
+	if (times.size() >= block_rows)
+		flush();
+}
+
+// Each filament is tested against the bounding box of the probe first, so only the nearby ones reach the samples.
+// Those are evaluated against each sample all at once (see GaussianKernel.h)
+double CProbeRecorder::evaluate(const Probe& probe, const std::vector<Gaden::Real>* far_field) const
+{
+	thread_local std::vector<double> x, y, z, sigma, concentration;
+	x.clear();
+	y.clear();
+	z.clear();
+	sigma.clear();
+	for (const ActiveFilament& filament : active)
+	{
+		if (filament.x < probe.bbox_min[0] - filament.cutoff || filament.x > probe.bbox_max[0] + filament.cutoff ||
+			filament.y < probe.bbox_min[1] - filament.cutoff || filament.y > probe.bbox_max[1] + filament.cutoff ||
+			filament.z < probe.bbox_min[2] - filament.cutoff || filament.z > probe.bbox_max[2] + filament.cutoff)
+			continue;
+		x.push_back(filament.x);
+		y.push_back(filament.y);
+		z.push_back(filament.z);
+		sigma.push_back(filament.sigma);
+	}
+	concentration.resize(x.size());
+
+	double total = 0; //[moles/cm3], or [moles/cm3 * m] for lines
+	double cell_volume = pow(env->cell_size * 100, 3); //[cm3]
+	for (size_t s = probe.first_sample; s < probe.last_sample; s++)
+	{
+		const Sample& sample = samples[s];
+		if (!sample.free)
+			continue;
+
+		// the far field is uniform within each cell
+		if (far_field)
+			total += sample.weight * (*far_field)[sample.cell] / cell_volume;
+		if (x.empty())
+			continue;
+		Gaden::pointVsFilaments(sample.x, sample.y, sample.z, x.data(), y.data(), z.data(), sigma.data(), x.size(), moles_of_gas, cutoff_sigmas,
+			concentration.data());
+		for (size_t i = 0; i < x.size(); i++)
+		{
+			if (concentration[i] > 0 && !environment->obstructed(sample.x, sample.y, sample.z, x[i], y[i], z[i]))
+				total += sample.weight * concentration[i];
+		}
+	}
+	return total / moles_all_gases_in_cm3 * 1000000; //[ppm]
+}
+
+void CProbeRecorder::flush()
+{
+	if (times.empty() || !file.is_open())
+		return;
+
+	int num_rows = times.size();
+	file.write((char*)&num_rows, sizeof(int));
+	file.write((char*)times.data(), num_rows * sizeof(double));
+	for (std::vector<double>& column : columns)
+	{
+		file.write((char*)column.data(), num_rows * sizeof(double));
+		column.clear();
+	}
+	file.flush();
+	times.clear();
+}
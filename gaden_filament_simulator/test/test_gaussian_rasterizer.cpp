@@ -0,0 +1,220 @@
+/*---------------------------------------------------------------------------------------
+ * Accuracy of the sigma-binned rasterizer (gaden_common/GaussianRasterizer.h) against the
+ * evaluation of every filament that the simulator does (splatFilament, see
+ * filament_simulator/filament_kernels.h), with and without obstacles.
+ * In free space both are also compared with the exact integral of the gaussians over each
+ * cell, which sets the tolerances: the splat samples the gaussian at points, so it is not
+ * exact either, and the rasterizer must not be further from the exact grid than it is
+ ---------------------------------------------------------------------------------------*/
+
+#include <gtest/gtest.h>
+#include <gaden_common/GaussianRasterizer.h>
+#include "filament_simulator/filament_kernels.h"
+#include <math.h>
+#include <random>
+
+using Gaden::EnvironmentDescription;
+using Gaden::GaussianSource;
+
+// An environment without wind or refinement levels, as seen by the filaments of the simulator
+struct Domain
+{
+	EnvironmentDescription env;
+	Gaden::WindField wind;
+	std::vector<RefinementLevel> levels;
+	CEnvironmentModel model;
+
+	Domain(int n, double cell_size)
+	{
+		env.num_cells = Gaden::Vector3i(n, n, n);
+		env.min_coord = Gaden::Vector3(0, 0, 0);
+		env.max_coord = Gaden::Vector3(n * cell_size, n * cell_size, n * cell_size);
+		env.cell_size = cell_size;
+		env.Env.assign((size_t)n * n * n, 0);
+		model.configure(env, wind, levels);
+	}
+
+	void setObstacle(int i, int j, int k)
+	{
+		env.Env[Gaden::indexFrom3D(Gaden::Vector3i(i, j, k), env.num_cells)] = 1;
+	}
+};
+
+// The moles of gas in every cell, as computed by the simulator (update_gas_concentration_from_filament)
+static std::vector<double> splat(const Domain& domain, const std::vector<GaussianSource>& sources)
+{
+	std::vector<Gaden::Real> grid(domain.env.Env.size(), 0.0);
+	for (const GaussianSource& source : sources)
+	{
+		CFilament filament(source.x, source.y, source.z, source.sigma);
+		splatFilament(filament, source.moles, 1, domain.model, 0, splatPointsPerAxis(source.sigma, domain.env.cell_size), grid);
+	}
+	return std::vector<double>(grid.begin(), grid.end());
+}
+
+// The integral of every gaussian over each cell (free space only): a product of differences of erf along each axis
+static std::vector<double> exact(const EnvironmentDescription& env, const std::vector<GaussianSource>& sources)
+{
+	std::vector<double> grid(env.Env.size(), 0.0);
+	for (const GaussianSource& source : sources)
+	{
+		double sigma = source.sigma / 100;
+		double center[3] = { source.x, source.y, source.z };
+		double min_coord[3] = { env.min_coord.x, env.min_coord.y, env.min_coord.z };
+		int cells[3] = { env.num_cells.x, env.num_cells.y, env.num_cells.z };
+		std::vector<double> weights[3];
+		for (int axis = 0; axis < 3; axis++)
+		{
+			weights[axis].resize(cells[axis]);
+			for (int i = 0; i < cells[axis]; i++)
+			{
+				double from = min_coord[axis] + i * env.cell_size - center[axis];
+				double to = from + env.cell_size;
+				weights[axis][i] = 0.5 * (erf(to / (sqrt(2) * sigma)) - erf(from / (sqrt(2) * sigma)));
+			}
+		}
+		for (int k = 0; k < cells[2]; k++)
+			for (int j = 0; j < cells[1]; j++)
+				for (int i = 0; i < cells[0]; i++)
+					grid[Gaden::indexFrom3D(Gaden::Vector3i(i, j, k), env.num_cells)] += source.moles * weights[0][i] * weights[1][j] * weights[2][k];
+	}
+	return grid;
+}
+
+static std::vector<GaussianSource> randomSources(int count, double min_coord, double max_coord, double min_sigma, double max_sigma)
+{
+	std::mt19937 generator(42);
+	std::uniform_real_distribution<double> position(min_coord, max_coord);
+	std::uniform_real_distribution<double> sigma(min_sigma, max_sigma);
+	std::vector<GaussianSource> sources;
+	for (int n = 0; n < count; n++)
+		sources.push_back({ position(generator), position(generator), position(generator), sigma(generator), 1e-6 });
+	return sources;
+}
+
+static double total(const std::vector<double>& grid)
+{
+	double sum = 0;
+	for (double value : grid)
+		sum += value;
+	return sum;
+}
+
+// Sum of the absolute differences, relative to the gas in the reference
+static double relativeL1(const std::vector<double>& grid, const std::vector<double>& reference)
+{
+	double difference = 0;
+	for (size_t i = 0; i < grid.size(); i++)
+		difference += std::abs(grid[i] - reference[i]);
+	return difference / total(reference);
+}
+
+// Gas of a gaussian outside the cube of +-3 sigma, which the splat does not evaluate
+static const double GAS_BEYOND_3_SIGMA = 1 - pow(erf(3 / sqrt(2)), 3); // 0.8%
+
+// Extra L1 difference allowed next to obstacles over the one of the same filaments in free space. The separable passes
+// reach some cells around an obstacle that are not visible from the filaments (see GaussianRasterizer.h), and lose the gas
+// that meets a wall on a different path than the line of sight. About 2% in these cases
+static const double OBSTACLE_MARGIN = 0.03;
+
+TEST(GaussianRasterizer, ConservesTheGasAwayFromObstacles)
+{
+	Domain domain(30, 0.1);
+	std::vector<GaussianSource> sources = randomSources(200, 1.0, 2.0, 5, 25);
+
+	std::vector<double> grid;
+	Gaden::GaussianRasterizer(1.1).rasterize(domain.env, sources, grid);
+	EXPECT_NEAR(total(grid), 200 * 1e-6, 1e-9 * 200 * 1e-6);
+	for (double value : grid)
+		EXPECT_GE(value, 0.0);
+}
+
+TEST(GaussianRasterizer, IsAsAccurateAsTheSplatInFreeSpace)
+{
+	Domain domain(30, 0.1);
+	std::vector<GaussianSource> sources = randomSources(100, 1.0, 2.0, 5, 25);
+	std::vector<double> reference = exact(domain.env, sources);
+	std::vector<double> simulator = splat(domain, sources);
+	double splat_error = relativeL1(simulator, reference);
+
+	// The splat drops the gas beyond 3 sigma, the rasterizer keeps all of it
+	std::vector<double> grid;
+	Gaden::GaussianRasterizer(1.1).rasterize(domain.env, sources, grid);
+	EXPECT_NEAR(total(simulator), total(reference), GAS_BEYOND_3_SIGMA * total(reference));
+	EXPECT_NEAR(total(grid), total(simulator), GAS_BEYOND_3_SIGMA * total(reference));
+
+	// Neither is further from the exact grid than the splat, even with coarser bins
+	EXPECT_LT(relativeL1(grid, reference), splat_error);
+	Gaden::GaussianRasterizer(2.0).rasterize(domain.env, sources, grid);
+	EXPECT_LT(relativeL1(grid, reference), splat_error);
+}
+
+// Rasterizes the sources with and without the obstacles of domain, and checks the grid against the splat of the simulator.
+// Returns the grid with obstacles
+static std::vector<double> compareNextToObstacles(const Domain& domain, const std::vector<GaussianSource>& sources)
+{
+	Domain free_domain(domain.env.num_cells.x, domain.env.cell_size);
+	std::vector<double> free_grid, grid;
+	Gaden::GaussianRasterizer(1.1).rasterize(free_domain.env, sources, free_grid);
+	Gaden::GaussianRasterizer(1.1).rasterize(domain.env, sources, grid);
+	double free_difference = relativeL1(free_grid, splat(free_domain, sources));
+
+	// The gas that reaches the obstacles is lost, as in the simulator
+	std::vector<double> simulator = splat(domain, sources);
+	EXPECT_LT(total(grid), total(free_grid));
+	EXPECT_NEAR(total(grid), total(simulator), (GAS_BEYOND_3_SIGMA + OBSTACLE_MARGIN) * total(simulator));
+	EXPECT_LT(relativeL1(grid, simulator), free_difference + OBSTACLE_MARGIN);
+	return grid;
+}
+
+TEST(GaussianRasterizer, DoesNotLeakThroughWalls)
+{
+	// A wall across the whole domain at x = [1.5, 1.6) m, gas released on one side
+	Domain domain(30, 0.1);
+	for (int k = 0; k < 30; k++)
+		for (int j = 0; j < 30; j++)
+			domain.setObstacle(15, j, k);
+	std::vector<GaussianSource> sources = randomSources(100, 1.0, 1.45, 5, 25);
+	for (GaussianSource& source : sources)
+		source.y = source.z = 1.5;
+
+	std::vector<double> grid = compareNextToObstacles(domain, sources);
+	double behind = 0;
+	for (int k = 0; k < 30; k++)
+		for (int j = 0; j < 30; j++)
+			for (int i = 15; i < 30; i++)
+				behind += grid[Gaden::indexFrom3D(Gaden::Vector3i(i, j, k), domain.env.num_cells)];
+	EXPECT_EQ(behind, 0.0);
+}
+
+TEST(GaussianRasterizer, FollowsTheLineOfSightAroundAnObstacle)
+{
+	// A pillar of 4x4 cells next to the release. The cells right behind it are not visible from the filaments, but the
+	// separable passes can reach some of them going around it (see GaussianRasterizer.h)
+	Domain domain(30, 0.1);
+	for (int k = 0; k < 30; k++)
+		for (int j = 13; j < 17; j++)
+			for (int i = 13; i < 17; i++)
+				domain.setObstacle(i, j, k);
+	std::vector<GaussianSource> sources = randomSources(100, 1.0, 1.25, 5, 25);
+
+	std::vector<double> grid = compareNextToObstacles(domain, sources);
+	for (int k = 0; k < 30; k++)
+		for (int j = 13; j < 17; j++)
+			for (int i = 13; i < 17; i++)
+				EXPECT_EQ(grid[Gaden::indexFrom3D(Gaden::Vector3i(i, j, k), domain.env.num_cells)], 0.0);
+}
+
+TEST(GaussianRasterizer, GivesTheSameGridInsideAParallelRegion)
+{
+	// As called from the step loop of the simulator: the 1D passes become tasks of the team
+	Domain domain(30, 0.1);
+	std::vector<GaussianSource> sources = randomSources(200, 1.0, 2.0, 5, 25);
+
+	std::vector<double> grid, tasks_grid;
+	Gaden::GaussianRasterizer(1.1).rasterize(domain.env, sources, grid);
+	#pragma omp parallel
+	#pragma omp single
+	Gaden::GaussianRasterizer(1.1).rasterize(domain.env, sources, tasks_grid);
+	EXPECT_EQ(grid, tasks_grid);
+}
@@ -0,0 +1,183 @@
+/*---------------------------------------------------------------------------------------
+ * Deviation of the single precision build (GADEN_SINGLE_PRECISION, see gaden_common/Real.h)
+ * from double precision. Built twice: test_precision (Real = double, where the deviation
+ * must be zero) and test_precision_float.
+ * The filaments (CFilament), the wind (WindField) and the concentration grid are stored in
+ * Gaden::Real, and advected and grown by the kernel of the simulator (advectFilament, see
+ * filament_simulator/filament_kernels.h) over the environment it sees (CEnvironmentModel).
+ * The reference runs the same kernels on filaments, wind and grid of plain doubles.
+ ---------------------------------------------------------------------------------------*/
+
+#include <gtest/gtest.h>
+#include "filament_simulator/filament_kernels.h"
+#include <math.h>
+
+static const int nx = 40, ny = 20, nz = 10;
+static const double cell_size = 0.1;     //[m]
+static const double time_step = 0.1;     //[s]
+static const int num_steps = 200;        // 20 s
+static const int filaments_per_step = 5;
+static const double initial_variance = 25; //[cm²]
+static const double growth_gamma = 10;     //[cm²/s]
+static const double buoyancy_velocity = 0.002; //[m/s]
+static const double moles_per_filament = 1e-8;
+
+struct ReferenceWind
+{
+	double u, v, w;
+};
+
+// A wind that turns and shears, different in every cell
+static ReferenceWind windOfCell(int x, int y, int z)
+{
+	ReferenceWind wind;
+	wind.u = 0.8 + 0.3 * sin(M_PI * y / ny);
+	wind.v = 0.2 * cos(2 * M_PI * x / nx);
+	wind.w = 0.05 * sin(M_PI * z / nz) - 0.02;
+	return wind;
+}
+
+struct ReferenceFilament
+{
+	double pose_x, pose_y, pose_z, sigma;
+	bool valid;
+	double birth_time;
+	int id;
+};
+
+// The occupancy of the simulator, with the wind of windOfCell in double precision instead of the one of the WindField
+struct ReferenceEnvironment
+{
+	const CEnvironmentModel& model;
+
+	int occupancy(double x, double y, double z) const
+	{
+		return model.occupancy(x, y, z);
+	}
+
+	ReferenceWind wind_at(double x, double y, double z) const
+	{
+		return windOfCell(floor(x / cell_size), floor(y / cell_size), floor(z / cell_size));
+	}
+};
+
+// Releases filaments_per_step filaments around the source on every step, and advects them with the kernel of the simulator (a
+// move that leaves the domain is not applied, as with obstacles). Filament can be CFilament or ReferenceFilament.
+// The release points are away from the cell boundaries: one right on a boundary (0.3 m) can be rounded into the next cell
+// in single precision, and then follows the wind of that cell from the start
+template <typename Filament, typename Environment>
+static void simulate(std::vector<Filament>& filaments, const Environment& environment)
+{
+	for (int step = 0; step < num_steps; step++)
+	{
+		double sim_time = step * time_step;
+		for (int n = 0; n < filaments_per_step; n++)
+		{
+			Filament filament;
+			filament.pose_x = 0.33 + 0.011 * n;
+			filament.pose_y = 1.04 + 0.013 * n;
+			filament.pose_z = 0.47 - 0.007 * n;
+			filament.sigma = sqrt(initial_variance);
+			filament.valid = true;
+			filament.birth_time = sim_time;
+			filament.id = filaments.size();
+			filaments.push_back(filament);
+		}
+
+		AdvectionParameters parameters{ time_step, buoyancy_velocity, 0, initial_variance, growth_gamma, 1, 0, step };
+		for (Filament& filament : filaments)
+			advectFilament<true, false>(filament, sim_time, parameters, environment);
+	}
+}
+
+class Precision : public ::testing::Test
+{
+protected:
+	void SetUp() override
+	{
+		env.num_cells = Gaden::Vector3i(nx, ny, nz);
+		env.min_coord = Gaden::Vector3(0, 0, 0);
+		env.max_coord = Gaden::Vector3(nx * cell_size, ny * cell_size, nz * cell_size);
+		env.cell_size = cell_size;
+		env.Env.assign(nx * ny * nz, 0);
+		wind.build(Gaden::Vector3i(nx, ny, nz), [](size_t i) {
+			ReferenceWind reference = windOfCell(i % nx, (i / nx) % ny, i / (nx * ny));
+			Gaden::WindVector vector;
+			vector.u = reference.u;
+			vector.v = reference.v;
+			vector.w = reference.w;
+			return vector;
+		});
+		model.configure(env, wind, levels);
+
+		simulate(filaments, model);
+		simulate(reference, ReferenceEnvironment{ model });
+	}
+
+	// Moles of gas in every cell, as the simulator computes them (update_gas_concentration_from_filament)
+	template <typename Filament, typename T>
+	void splat(const std::vector<Filament>& filaments, std::vector<T>& grid)
+	{
+		grid.assign(env.Env.size(), 0.0);
+		for (const Filament& filament : filaments)
+			splatFilament(filament, moles_per_filament, 1, model, 0, splatPointsPerAxis(filament.sigma, cell_size), grid);
+	}
+
+	// Largest difference in the position of a filament [m]
+	double maxPositionDifference() const
+	{
+		double max_position = 0;
+		for (size_t i = 0; i < filaments.size(); i++)
+			max_position = std::max({ max_position, std::abs(filaments[i].pose_x - reference[i].pose_x), std::abs(filaments[i].pose_y - reference[i].pose_y),
+				std::abs(filaments[i].pose_z - reference[i].pose_z) });
+		return max_position;
+	}
+
+	Gaden::EnvironmentDescription env;
+	Gaden::WindField wind;
+	std::vector<RefinementLevel> levels;
+	CEnvironmentModel model;
+
+	std::vector<CFilament> filaments;
+	std::vector<ReferenceFilament> reference;
+};
+
+TEST_F(Precision, FilamentsStayWithinTolerance)
+{
+	ASSERT_EQ(filaments.size(), reference.size());
+	double max_position = maxPositionDifference(), max_sigma = 0;
+	for (size_t i = 0; i < filaments.size(); i++)
+		max_sigma = std::max(max_sigma, std::abs(filaments[i].sigma - reference[i].sigma) / reference[i].sigma);
+	if (sizeof(Gaden::Real) == sizeof(double))
+	{
+		EXPECT_EQ(max_position, 0.0);
+		EXPECT_EQ(max_sigma, 0.0);
+	}
+	EXPECT_LT(max_position, 1e-5); //[m]
+	EXPECT_LT(max_sigma, 1e-6);    // relative
+}
+
+TEST_F(Precision, ConcentrationStaysWithinTolerance)
+{
+	std::vector<Gaden::Real> grid;
+	std::vector<double> reference_grid;
+	splat(filaments, grid);
+	splat(reference, reference_grid);
+
+	double difference = 0, total = 0;
+	for (size_t i = 0; i < grid.size(); i++)
+	{
+		difference += std::abs(grid[i] - reference_grid[i]);
+		total += reference_grid[i];
+	}
+	ASSERT_GT(total, 0.0);
+	if (sizeof(Gaden::Real) == sizeof(double))
+	{
+		EXPECT_EQ(difference, 0.0);
+	}
+
+	// L1, relative to the gas in the grid. The splat adds the gas at points that move with the filament, so a filament that is
+	// off by d moves the points within d of a cell face (a fraction of about 3 d / cell_size) to the next cell, and each
+	// of them counts twice. Plus the rounding of the sums in the cells
+	EXPECT_LT(difference / total, 6 * maxPositionDifference() / cell_size + 1e-5);
+}
@@ -110,17 +110,38 @@ void Player::run()
 	// Loop
 	rclcpp::Rate r(100); // Set max rate at 100Hz (for handling services - Top Speed!!)
 	int iteration_counter = initial_iteration;
+	double playback_time = -1; // Simulated time being played (only if the logs store it)
 	auto shared_this = shared_from_this();
 	while (rclcpp::ok())
 	{
 		if ((now() - time_last_loaded_file).seconds() >= 1 / player_freq)
 		{
-			if (verbose)
-				RCLCPP_INFO(get_logger(), "Playing simulation iteration %i", iteration_counter);
-			// Read Gas and Wind data from log_files
-			load_all_data_from_logfiles(iteration_counter); // On the first time, we configure gas type, source pos, etc.
-			display_current_gas_distribution();             // Rviz visualization
-			iteration_counter++;
+			if (playback_time < 0)
+			{
+				if (verbose)
+					RCLCPP_INFO(get_logger(), "Playing simulation iteration %i", iteration_counter);
+				// Read Gas and Wind data from log_files
+				load_all_data_from_logfiles(iteration_counter); // On the first time, we configure gas type, source pos, etc.
+				display_current_gas_distribution();             // Rviz visualization
+
+				// If the logs store the simulation time, play them by time from now on
+				if (!start_timed_playback(iteration_counter, playback_time))
+					iteration_counter++;
+			}
+			else
+			{
+				// Each iteration is held until the simulated time reaches the next one. The simulator might have skipped
+				// saving while the plume did not change, so the iterations are not necessarily evenly spaced, and each
+				// simulation follows its own (see sim_obj::play_until). The loop bounds are iterations of the first one
+				playback_time += playback_time_step;
+				for (int i = 0; i < num_simulators; i++)
+				{
+					if (player_instances[i].play_until(playback_time) && verbose)
+						RCLCPP_INFO(get_logger(), "Playing iteration %i of instance %i (t = %.2f s)", player_instances[i].playing_iteration, i, playback_time);
+				}
+				iteration_counter = player_instances[0].playing_iteration;
+				display_current_gas_distribution();
+			}
 
 			// Looping?
 			if (allow_looping)
@@ -128,6 +149,7 @@ void Player::run()
 				if (iteration_counter >= loop_to_iteration)
 				{
 					iteration_counter = loop_from_iteration;
+					playback_time = -1;
 					if (verbose)
 						RCLCPP_INFO(get_logger(), "Looping");
 				}
@@ -179,6 +201,43 @@ void Player::loadNodeParameters()
 	allow_looping = declare_parameter<bool>("allow_looping", false);
 	loop_from_iteration = declare_parameter<int>("loop_from_iteration", 1);
 	loop_to_iteration = declare_parameter<int>("loop_to_iteration", 1);
+
+	// Memory budget (MB) for keeping the decoded wind snapshots. 0 = disabled
+	wind_cache_size_mb = declare_parameter<int>("wind_cache_size_mb", 0);
+
+	// Compute a concentration grid when each iteration is loaded, instead of adding up the filaments at every query
+	rasterize_filaments = declare_parameter<bool>("rasterize_filaments", false);
+	rasterizer_sigma_bin_ratio = declare_parameter<double>("rasterizer_sigma_bin_ratio", 1.1);
+
+	// Simulated time advanced on each update (logs that store the simulation time). 0 = the time between the first two iterations
+	playback_time_step = declare_parameter<double>("playback_time_step", 0.0);
+}
+
+// Logs with the simulation time are played by time (see run), if all of them store it. The playback starts at the earliest
+// time of their current iteration. Works out playback_time_step if it was not given
+bool Player::start_timed_playback(int iteration, double& start_time)
+{
+	double time, next_time, first_time = 0;
+	start_time = DBL_MAX;
+	for (size_t i = 0; i < player_instances.size(); i++)
+	{
+		if (!player_instances[i].get_iteration_time(iteration, time))
+			return false;
+		if (i == 0)
+			first_time = time;
+		start_time = std::min(start_time, time);
+	}
+	if (playback_time_step <= 0)
+	{
+		if (!player_instances[0].get_iteration_time(iteration + 1, next_time) || next_time <= first_time)
+			return false;
+		playback_time_step = next_time - first_time;
+		if (verbose)
+			RCLCPP_INFO(get_logger(), "Playing %.2f s of simulation per update", playback_time_step);
+	}
+	for (sim_obj& instance : player_instances)
+		instance.playing_iteration = iteration;
+	return true;
 }
 
 // Init
@@ -188,6 +247,7 @@ void Player::init_all_simulation_instances()
 
 	// At least one instance is needed which loads the wind field data!
 	sim_obj so(simulation_data[0], true, get_logger(), occupancyFile);
+	so.wind_cache.setBudget((size_t)std::max(wind_cache_size_mb, 0) * 1024 * 1024);
 	player_instances.push_back(so);
 
 	// Create other instances, but do not save wind information! It is the same for all instances
@@ -197,6 +257,12 @@ void Player::init_all_simulation_instances()
 		player_instances.push_back(so);
 	}
 
+	for (sim_obj& instance : player_instances)
+	{
+		instance.rasterize_filaments = rasterize_filaments;
+		instance.rasterizer = Gaden::GaussianRasterizer(rasterizer_sigma_bin_ratio);
+	}
+
 	// Set size for service responses
 }
 
@@ -238,13 +304,37 @@ sim_obj::sim_obj(std::string filepath, bool load_wind_info, rclcpp::Logger logge
 	load_wind_data = load_wind_info;
 	first_reading = true;
 	filament_log = false;
+	sim_time = -1;
 
+	// "live:<name>" reads the state of a running simulator from shared memory (see gaden_common/LiveExchange.h)
+	if (simulation_filename.rfind("live:", 0) == 0)
+	{
+		live_exchange_name = simulation_filename.substr(5);
+		live = std::make_shared<Gaden::LiveExchangeReader>();
+		filament_log = true;
+		return;
+	}
 
 	if (!std::filesystem::exists(simulation_filename))
 	{
 		RCLCPP_ERROR(logger, "Simulation folder does not exist: %s", simulation_filename.c_str());
 		exit(-1);
 	}
+
+	// The results can be a single archive (either given directly, or inside the results folder)
+	std::string archive_filename = simulation_filename;
+	if (std::filesystem::is_directory(simulation_filename))
+		archive_filename = simulation_filename + "/simulation.gaden";
+	if (std::filesystem::is_regular_file(archive_filename))
+	{
+		archive = std::make_shared<Gaden::ArchiveReader>();
+		if (!archive->open(archive_filename))
+		{
+			RCLCPP_ERROR(logger, "Could not read the simulation archive %s", archive_filename.c_str());
+			exit(-1);
+		}
+		filament_log = true;
+	}
 }
 
 sim_obj::~sim_obj() {}
@@ -283,9 +373,10 @@ void sim_obj::read_concentration_line(std::string line)
 	C[indexFrom3D(x, y, z)] = conc / 1000;
 	if (load_wind_data)
 	{
-		U[indexFrom3D(x, y, z)] = u / 1000;
-		V[indexFrom3D(x, y, z)] = v / 1000;
-		W[indexFrom3D(x, y, z)] = w / 1000;
+		Gaden::WindVector& wind_vector = wind.mutableAt(x, y, z);
+		wind_vector.u = u / 1000;
+		wind_vector.v = v / 1000;
+		wind_vector.w = w / 1000;
 	}
 }
 
@@ -360,6 +451,18 @@ void sim_obj::read_headers(std::stringstream& inbuf, std::string& line)
 // Load a new file with Gas+Wind data
 void sim_obj::load_data_from_logfile(int sim_iteration)
 {
+	if (live)
+	{
+		load_from_live();
+		return;
+	}
+
+	if (archive)
+	{
+		load_from_archive(sim_iteration);
+		return;
+	}
+
 	std::string filename = fmt::format("{}/iteration_{}", simulation_filename, sim_iteration);
 	FILE* fileCheck;
 	if ((fileCheck = fopen(filename.c_str(), "rb")) == NULL)
@@ -377,19 +480,84 @@ void sim_obj::load_data_from_logfile(int sim_iteration)
 	std::stringstream decompressed;
 	boost::iostreams::copy(inbuf, decompressed);
 
-	// if the file starts with a 1, the contents are in binary
+	// if the file starts with a 1, 2 or 3 (format version), the contents are in binary
 	int check = 0;
 	decompressed.read((char*)&check, sizeof(int));
-	if (check == 1)
+	if (check >= 1 && check <= 3)
 	{
 		filament_log = true;
-		load_binary_file(decompressed);
+		load_binary_file(decompressed, check);
+		load_far_field(sim_iteration);
 	}
 	else
 		load_ascii_file(decompressed);
 	infile.close();
 }
 
+// Simulation time of an iteration, without loading it (only the header is decompressed).
+// False if the iteration does not exist (yet) or its format does not store the time
+bool sim_obj::get_iteration_time(int iteration, double& time)
+{
+	if (live) // there is only the current state
+		return false;
+
+	auto cached = iteration_times.find(iteration);
+	if (cached != iteration_times.end())
+	{
+		time = cached->second;
+		return true;
+	}
+
+	if (archive)
+	{
+		auto it = archive->getIterations().find(iteration);
+		if (it == archive->getIterations().end())
+		{
+			archive->refresh();
+			it = archive->getIterations().find(iteration);
+			if (it == archive->getIterations().end())
+				return false;
+		}
+		time = it->second.header.sim_time;
+	}
+	else
+	{
+		std::ifstream infile(fmt::format("{}/iteration_{}", simulation_filename, iteration), std::ios_base::binary);
+		if (!infile.is_open())
+			return false;
+		boost::iostreams::filtering_istream decompressed;
+		decompressed.push(boost::iostreams::zlib_decompressor());
+		decompressed.push(infile);
+
+		int version = 0;
+		decompressed.read((char*)&version, sizeof(int));
+		if (!decompressed || version < 2 || version > 3)
+			return false;
+		decompressed.ignore(14 * sizeof(double) + 5 * sizeof(int)); // rest of the header, including the wind index
+		decompressed.read((char*)&time, sizeof(double));
+		if (!decompressed)
+			return false;
+	}
+	iteration_times[iteration] = time;
+	return true;
+}
+
+// Timed playback (see Player::run): loads the last iteration of this simulation saved at or before time. The simulations
+// played together can save at different times (e.g. with results_policy "on_change"), so each one keeps its own.
+// True if a new iteration was loaded
+bool sim_obj::play_until(double time)
+{
+	int iteration = playing_iteration;
+	double next_time;
+	while (get_iteration_time(iteration + 1, next_time) && next_time <= time + 1e-6)
+		iteration++;
+	if (iteration == playing_iteration)
+		return false;
+	playing_iteration = iteration;
+	load_data_from_logfile(iteration);
+	return true;
+}
+
 void sim_obj::load_ascii_file(std::stringstream& decompressed)
 {
 	std::string line;
@@ -418,7 +586,7 @@ void sim_obj::load_ascii_file(std::stringstream& decompressed)
 	} while (std::getline(decompressed, line));
 }
 
-void sim_obj::load_binary_file(std::stringstream& decompressed)
+void sim_obj::load_binary_file(std::stringstream& decompressed, int version)
 {
 
 	if (first_reading)
@@ -457,7 +625,23 @@ void sim_obj::load_binary_file(std::stringstream& decompressed)
 
 	int wind_index;
 	decompressed.read((char*)&wind_index, sizeof(int));
+	if (version >= 2)
+		decompressed.read((char*)&sim_time, sizeof(double));
+	if (version >= 3)
+	{
+		// description of the filters applied when saving
+		int filters_length;
+		decompressed.read((char*)&filters_length, sizeof(int));
+		output_filters.resize(filters_length);
+		decompressed.read(&output_filters[0], filters_length);
+	}
+
+	load_filaments(decompressed);
+	load_wind_file(wind_index);
+}
 
+void sim_obj::load_filaments(std::stringstream& decompressed)
+{
 	activeFilaments.clear();
 	int filament_index;
 	double x, y, z, stdDev;
@@ -473,8 +657,188 @@ void sim_obj::load_binary_file(std::stringstream& decompressed)
 		std::pair<int, Filament> pair(filament_index, Filament(x, y, z, stdDev));
 		activeFilaments.insert(pair);
 	}
+	update_filament_arrays();
 
-	load_wind_file(wind_index);
+	if (rasterize_filaments)
+		rasterize_concentration();
+}
+
+// Copy of the active filaments, one array per coordinate, for the gaussian kernel (see get_gas_concentration)
+void sim_obj::update_filament_arrays()
+{
+	filament_x.clear();
+	filament_y.clear();
+	filament_z.clear();
+	filament_sigma.clear();
+	for (auto it = activeFilaments.begin(); it != activeFilaments.end(); it++)
+	{
+		filament_x.push_back(it->second.x);
+		filament_y.push_back(it->second.y);
+		filament_z.push_back(it->second.z);
+		filament_sigma.push_back(it->second.sigma);
+	}
+	filament_concentration.resize(filament_x.size());
+}
+
+// Fill C with the concentration [ppm] of every cell, from the active filaments
+void sim_obj::rasterize_concentration()
+{
+	std::vector<Gaden::GaussianSource> sources;
+	sources.reserve(activeFilaments.size());
+	for (auto it = activeFilaments.begin(); it != activeFilaments.end(); it++)
+		sources.push_back({ it->second.x, it->second.y, it->second.z, it->second.sigma, total_moles_in_filament });
+	rasterizer.rasterize(envDesc, sources, C);
+
+	double cell_volume_cm3 = pow(envDesc.cell_size * 100, 3);
+	for (Gaden::Real& c : C)
+		c = c / cell_volume_cm3 / num_moles_all_gases_in_cm3 * 1000000;
+}
+
+// Environment and gas constants stored in the archive header (or in the live exchange)
+void sim_obj::configure_from_header(const Gaden::ArchiveHeader& header)
+{
+	envDesc.min_coord = Gaden::Vector3(header.min_coord[0], header.min_coord[1], header.min_coord[2]);
+	envDesc.max_coord = Gaden::Vector3(header.max_coord[0], header.max_coord[1], header.max_coord[2]);
+	envDesc.num_cells = Gaden::Vector3i(header.num_cells[0], header.num_cells[1], header.num_cells[2]);
+	envDesc.cell_size = header.cell_size;
+	source_pos_x = header.source_position[0];
+	source_pos_y = header.source_position[1];
+	source_pos_z = header.source_position[2];
+	gas_type = gasTypesByCode[header.gas_type];
+	total_moles_in_filament = header.filament_moles_of_gas;
+	num_moles_all_gases_in_cm3 = header.num_moles_all_gases_in_cm3;
+}
+
+void sim_obj::load_from_archive(int sim_iteration)
+{
+	if (first_reading)
+	{
+		configure_from_header(archive->getHeader());
+		archive->readMetadata(output_filters);
+		if (output_filters != "")
+			RCLCPP_INFO(m_logger, "Simulation %s was saved with output filters: %s", simulation_filename.c_str(), output_filters.c_str());
+
+		configure_environment();
+		first_reading = false;
+	}
+
+	Gaden::ChunkHeader chunk;
+	std::stringstream decompressed;
+	if (!archive->readIteration(sim_iteration, chunk, decompressed))
+	{
+		// the simulation might still be running
+		archive->refresh();
+		if (!archive->readIteration(sim_iteration, chunk, decompressed))
+		{
+			RCLCPP_ERROR(m_logger, "Iteration %i is not in the archive %s\n", sim_iteration, simulation_filename.c_str());
+			return;
+		}
+	}
+
+	sim_time = chunk.sim_time;
+	load_filaments(decompressed);
+	load_wind_file(chunk.wind_idx);
+	load_far_field(sim_iteration);
+}
+
+// Gas of the far field of the simulator (if it was enabled), saved along each iteration. See filament_simulator/far_field.h
+void sim_obj::load_far_field(int sim_iteration)
+{
+	far_field.clear();
+	std::stringstream decompressed;
+	if (archive)
+	{
+		if (!archive->readFarField(sim_iteration, decompressed))
+			return;
+	}
+	else
+	{
+		std::ifstream infile(fmt::format("{}/far_field_{}", simulation_filename, sim_iteration), std::ios_base::binary);
+		if (!infile.is_open())
+			return;
+		boost::iostreams::filtering_streambuf<boost::iostreams::input> inbuf;
+		inbuf.push(boost::iostreams::zlib_decompressor());
+		inbuf.push(infile);
+		boost::iostreams::copy(inbuf, decompressed);
+	}
+
+	int format;
+	double time;
+	Gaden::Vector3i num_cells;
+	decompressed.read((char*)&format, sizeof(int));
+	decompressed.read((char*)&time, sizeof(double));
+	decompressed.read((char*)&num_cells.x, sizeof(int));
+	decompressed.read((char*)&num_cells.y, sizeof(int));
+	decompressed.read((char*)&num_cells.z, sizeof(int));
+	if (!decompressed || format != 1 || num_cells.x != envDesc.num_cells.x || num_cells.y != envDesc.num_cells.y || num_cells.z != envDesc.num_cells.z)
+	{
+		RCLCPP_ERROR(m_logger, "The far field of iteration %i does not match the environment, ignoring it\n", sim_iteration);
+		return;
+	}
+
+	std::vector<double> moles((size_t)num_cells.x * num_cells.y * num_cells.z);
+	decompressed.read((char*)moles.data(), sizeof(double) * moles.size());
+	set_far_field(moles);
+}
+
+// moles in every cell -> far_field [ppm]
+void sim_obj::set_far_field(const std::vector<double>& moles)
+{
+	double to_ppm = 1000000 / pow(envDesc.cell_size * 100, 3) / num_moles_all_gases_in_cm3;
+	far_field.resize(moles.size());
+	for (size_t i = 0; i < moles.size(); i++)
+		far_field[i] = moles[i] * to_ppm;
+
+	// C was rasterized from the filaments only
+	if (rasterize_filaments)
+	{
+		for (size_t i = 0; i < far_field.size(); i++)
+			C[i] += far_field[i];
+	}
+}
+
+// Copy the current state of a running simulator. Nothing changes if it has not advanced since the last call
+void sim_obj::load_from_live()
+{
+	if (!live->is_open())
+	{
+		if (!live->open(live_exchange_name))
+		{
+			RCLCPP_WARN_ONCE(m_logger, "Waiting for a simulator to publish in the shared memory segment '%s'", live_exchange_name.c_str());
+			return;
+		}
+		RCLCPP_INFO(m_logger, "Playing the live simulation '%s'", live_exchange_name.c_str());
+	}
+
+	// A simulator started again under the same name creates a new segment, while this one keeps the last state of the old
+	// one. So when nothing new arrives for a while, check whether there is a new segment (its environment can be different)
+	else if (live->stalled() && live->reopen_if_replaced())
+	{
+		RCLCPP_INFO(m_logger, "The live simulation '%s' was started again, playing the new one", live_exchange_name.c_str());
+		first_reading = true;
+	}
+
+	if (first_reading)
+	{
+		configure_from_header(live->getInfo());
+		configure_environment();
+		first_reading = false;
+	}
+
+	int wind_idx;
+	bool wind_changed;
+	if (!live->read(sim_time, wind_idx, live_filaments, live_far_field, load_wind_data ? &wind : nullptr, wind_changed))
+		return;
+	last_wind_idx = wind_idx;
+
+	activeFilaments.clear();
+	for (const Gaden::LiveFilament& filament : live_filaments)
+		activeFilaments.emplace(filament.id, Filament(filament.x, filament.y, filament.z, filament.sigma));
+	update_filament_arrays();
+
+	if (rasterize_filaments)
+		rasterize_concentration();
+	set_far_field(live_far_field);
 }
 
 void sim_obj::load_wind_file(int wind_index)
@@ -483,11 +847,37 @@ void sim_obj::load_wind_file(int wind_index)
 		return;
 	last_wind_idx = wind_index;
 
+	if (wind_cache.get(wind_index, wind))
+		return;
+
+	if (archive)
+	{
+		std::stringstream decompressed;
+		if (!archive->readWind(wind_index, decompressed))
+		{
+			RCLCPP_ERROR(m_logger, "Wind snapshot %i is not in the archive %s\n", wind_index, simulation_filename.c_str());
+			return;
+		}
+		for (std::vector<double>& component : wind_buffer)
+		{
+			component.resize(wind.size());
+			decompressed.read((char*)component.data(), sizeof(double) * component.size());
+		}
+		wind.buildFromComponents(envDesc.num_cells, wind_buffer);
+		wind_cache.put(wind_index, wind);
+		return;
+	}
+
+	// the file stores each component separately, convert them to the interleaved (bricked) layout once
 	std::ifstream infile(fmt::format("{}/wind/wind_iteration_{}", simulation_filename, wind_index), std::ios_base::binary);
-	infile.read((char*)U.data(), sizeof(double) * U.size());
-	infile.read((char*)V.data(), sizeof(double) * U.size());
-	infile.read((char*)W.data(), sizeof(double) * U.size());
+	for (std::vector<double>& component : wind_buffer)
+	{
+		component.resize(wind.size());
+		infile.read((char*)component.data(), sizeof(double) * component.size());
+	}
 	infile.close();
+	wind.buildFromComponents(envDesc.num_cells, wind_buffer);
+	wind_cache.put(wind_index, wind);
 }
 
 // Get Gas concentration at lcoation (x,y,z)
@@ -505,18 +895,30 @@ double sim_obj::get_gas_concentration(float x, float y, float z)
 		return 0;
 	}
 	double gas_conc = 0;
-	if (filament_log)
+	if (filament_log && rasterize_filaments)
 	{
-		for (auto it = activeFilaments.begin(); it != activeFilaments.end(); it++)
+		xx = std::clamp((int)floor((x - envDesc.min_coord.x) / envDesc.cell_size), 0, envDesc.num_cells.x - 1);
+		yy = std::clamp((int)floor((y - envDesc.min_coord.y) / envDesc.cell_size), 0, envDesc.num_cells.y - 1);
+		zz = std::clamp((int)floor((z - envDesc.min_coord.z) / envDesc.cell_size), 0, envDesc.num_cells.z - 1);
+		gas_conc = C[indexFrom3D(xx, yy, zz)];
+	}
+	else if (filament_log)
+	{
+		// Every filament within 5 sigma of the point (evaluated all at once), if it is in line of sight
+		Gaden::pointVsFilaments(x, y, z, filament_x.data(), filament_y.data(), filament_z.data(), filament_sigma.data(), filament_x.size(),
+			total_moles_in_filament, 5, filament_concentration.data());
+		for (size_t i = 0; i < filament_concentration.size(); i++)
 		{
-			Filament fil = it->second;
-			double distSQR = (x - fil.x) * (x - fil.x) + (y - fil.y) * (y - fil.y) + (z - fil.z) * (z - fil.z);
-
-			double limitDistance = fil.sigma * 5 / 100;
-			if (distSQR < limitDistance * limitDistance && check_environment_for_obstacle(x, y, z, fil.x, fil.y, fil.z))
-			{
-				gas_conc += concentration_from_filament(x, y, z, fil);
-			}
+			if (filament_concentration[i] > 0 && check_environment_for_obstacle(x, y, z, filament_x[i], filament_y[i], filament_z[i]))
+				gas_conc += filament_concentration[i];
+		}
+		gas_conc = gas_conc / num_moles_all_gases_in_cm3 * 1000000; // parts of target gas per million
+		if (!far_field.empty())
+		{
+			xx = std::clamp((int)floor((x - envDesc.min_coord.x) / envDesc.cell_size), 0, envDesc.num_cells.x - 1);
+			yy = std::clamp((int)floor((y - envDesc.min_coord.y) / envDesc.cell_size), 0, envDesc.num_cells.y - 1);
+			zz = std::clamp((int)floor((z - envDesc.min_coord.z) / envDesc.cell_size), 0, envDesc.num_cells.z - 1);
+			gas_conc += far_field[indexFrom3D(xx, yy, zz)];
 		}
 	}
 	else
@@ -529,21 +931,6 @@ double sim_obj::get_gas_concentration(float x, float y, float z)
 	return gas_conc;
 }
 
-double sim_obj::concentration_from_filament(float x, float y, float z, Filament filament)
-{
-	// calculate how much gas concentration does one filament contribute to the queried location
-	double sigma = filament.sigma;
-	double distance_cm = 100 * sqrt(pow(x - filament.x, 2) + pow(y - filament.y, 2) + pow(z - filament.z, 2));
-
-	double num_moles_target_cm3 = (total_moles_in_filament /
-		(sqrt(8 * pow(M_PI, 3)) * pow(sigma, 3))) *
-		exp(-pow(distance_cm, 2) / (2 * pow(sigma, 2)));
-
-	double ppm = num_moles_target_cm3 / num_moles_all_gases_in_cm3 * 1000000; // parts of target gas per million
-
-	return ppm;
-}
-
 bool sim_obj::check_environment_for_obstacle(double start_x, double start_y, double start_z,
 	double end_x, double end_y, double end_z)
 {
@@ -627,10 +1014,11 @@ void sim_obj::get_wind_value(float x, float y, float z, double& u, double& v, do
 			return;
 		}
 
-		// Set wind vectors from that cell
-		u = U[indexFrom3D(xx, yy, zz)];
-		v = V[indexFrom3D(xx, yy, zz)];
-		w = W[indexFrom3D(xx, yy, zz)];
+		// Set wind vectors from that cell (the check above lets through the index one past the last cell)
+		const Gaden::WindVector& wind_vector = wind.at(std::min(xx, envDesc.num_cells.x - 1), std::min(yy, envDesc.num_cells.y - 1), std::min(zz, envDesc.num_cells.z - 1));
+		u = wind_vector.u;
+		v = wind_vector.v;
+		w = wind_vector.w;
 	}
 	else
 	{
@@ -647,10 +1035,7 @@ void sim_obj::configure_environment()
 	// Resize Wind info container (if necessary)
 	if (load_wind_data)
 	{
-
-		U.resize(envDesc.num_cells.x * envDesc.num_cells.y * envDesc.num_cells.z);
-		V.resize(envDesc.num_cells.x * envDesc.num_cells.y * envDesc.num_cells.z);
-		W.resize(envDesc.num_cells.x * envDesc.num_cells.y * envDesc.num_cells.z);
+		wind.configure(envDesc.num_cells);
 	}
 
 	Gaden::ReadResult result = Gaden::readEnvFile(occupancyFile, envDesc);
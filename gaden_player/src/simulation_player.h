@@ -9,6 +9,7 @@
 
 #include <cstdlib>
 #include <math.h>
+#include <float.h>
 #include <stdio.h>
 #include <vector>
 #include <fstream>
@@ -21,11 +22,18 @@
 #include <boost/iostreams/copy.hpp>
 
 #include <gaden_common/ReadEnvironment.h>
+#include <gaden_common/Real.h>
+#include <gaden_common/Wind.h>
+#include <gaden_common/WindCache.h>
+#include <gaden_common/SimulationArchive.h>
+#include <gaden_common/GaussianRasterizer.h>
+#include <gaden_common/LiveExchange.h>
+#include <gaden_common/GaussianKernel.h>
 
 struct Filament
 {
 public:
-	double x, y, z, sigma;
+	Gaden::Real x, y, z, sigma;
 	Filament(double a, double b, double c, double d)
 	{
 		x = a;
@@ -56,6 +64,10 @@ private:
 	int initial_iteration, loop_from_iteration, loop_to_iteration;
 	bool allow_looping;
 	std::string occupancyFile;
+	int wind_cache_size_mb;
+	bool rasterize_filaments;
+	double rasterizer_sigma_bin_ratio;
+	double playback_time_step;
 
 	// Visualization
 	rclcpp::Publisher<visualization_msgs::msg::Marker>::SharedPtr marker_pub;
@@ -65,6 +77,7 @@ private:
 	void init_all_simulation_instances();
 	void load_all_data_from_logfiles(int sim_iteration);
 	void display_current_gas_distribution();
+	bool start_timed_playback(int iteration, double& start_time);
 
 	gaden_player::msg::GasInCell get_all_gases_single_cell(float x, float y, float z, const std::vector<std::string>& gas_types);
 	bool get_gas_value_srv(gaden_player::srv::GasPosition::Request::SharedPtr req, gaden_player::srv::GasPosition::Response::SharedPtr res);
@@ -86,24 +99,47 @@ public:
 	double source_pos_x, source_pos_y, source_pos_z;
 
 	bool load_wind_data;
-	std::vector<double> C; // 3D Gas concentration
-	std::vector<double> U; // 3D Wind U
-	std::vector<double> V; // 3D Wind V
-	std::vector<double> W; // 3D Wind W
+	std::vector<Gaden::Real> C;      // 3D Gas concentration
+	Gaden::WindField wind;              // 3D Wind (U,V,W interleaved, in bricks)
+	std::vector<double> wind_buffer[3]; // Scratch arrays (U, V, W) to convert the (planar) wind files
+	Gaden::WindCache wind_cache;     // Decoded wind snapshots (when looping, each file is read only once)
 	bool first_reading;
 
 	bool filament_log;
+	double sim_time;            // simulation time of the current iteration (only stored in filament logs with version >= 2)
+	std::string output_filters; // filters applied by the simulator when saving (empty = all the filaments were saved)
 	double total_moles_in_filament;
 	double num_moles_all_gases_in_cm3;
 	std::map<int, Filament> activeFilaments;
+	std::vector<double> filament_x, filament_y, filament_z, filament_sigma; // activeFilaments, one array per field (see update_filament_arrays)
+	std::vector<double> filament_concentration;                           // scratch for get_gas_concentration
+	std::vector<Gaden::Real> far_field; // [ppm] per cell, gas handed off by the simulator to its far field grid (empty = none)
+	std::map<int, double> iteration_times; // simulation time of each iteration (see get_iteration_time)
+	int playing_iteration = -1;            // iteration loaded by the timed playback (see play_until)
+	std::shared_ptr<Gaden::ArchiveReader> archive; // Set if the results are stored in a single archive file
+	std::shared_ptr<Gaden::LiveExchangeReader> live; // Set if playing a running simulation ("live:<name>")
+	std::string live_exchange_name;
+	std::vector<Gaden::LiveFilament> live_filaments;
+	std::vector<double> live_far_field; // moles per cell (empty if the simulator has no far field)
+	bool rasterize_filaments = false;               // Keep C up to date from the filaments (see rasterize_concentration)
+	Gaden::GaussianRasterizer rasterizer;
 
 	// methods
 	void configure_environment();
 	void load_data_from_logfile(int sim_iteration);
 	void load_ascii_file(std::stringstream& decompressed);
-	void load_binary_file(std::stringstream& decompressed);
+	void load_binary_file(std::stringstream& decompressed, int version);
+	void load_filaments(std::stringstream& decompressed);
+	void configure_from_header(const Gaden::ArchiveHeader& header);
+	void load_from_archive(int sim_iteration);
+	void load_from_live();
+	void load_far_field(int sim_iteration);
+	void set_far_field(const std::vector<double>& moles);
+	bool get_iteration_time(int iteration, double& time);
+	bool play_until(double time);
+	void update_filament_arrays();
+	void rasterize_concentration();
 	double get_gas_concentration(float x, float y, float z);
-	double concentration_from_filament(float x, float y, float z, Filament fil);
 	bool check_environment_for_obstacle(double start_x, double start_y, double start_z,
 		double end_x, double end_y, double end_z);
 	int check_pose_with_environment(double pose_x, double pose_y, double pose_z);
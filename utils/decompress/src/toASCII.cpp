@@ -29,7 +29,8 @@ int main(int argc, char* argv[])
 	double bufferD;
 	int bufferInt;
 
-	decompressed.read((char*)&bufferInt, sizeof(int));
+	int version;
+	decompressed.read((char*)&version, sizeof(int));
 	decompressed.read((char*)&bufferD, sizeof(double));
 	outFile << "env_min " << bufferD;
 	decompressed.read((char*)&bufferD, sizeof(double));
@@ -80,6 +81,20 @@ int main(int argc, char* argv[])
 	decompressed.read((char*)&bufferInt, sizeof(int));
 	outFile << bufferInt << "\n";
 
+	if (version >= 2)
+	{
+		decompressed.read((char*)&bufferD, sizeof(double));
+		outFile << "SimTime " << bufferD << "\n";
+	}
+
+	if (version >= 3)
+	{
+		decompressed.read((char*)&bufferInt, sizeof(int));
+		std::string filters(bufferInt, '\0');
+		decompressed.read(&filters[0], bufferInt);
+		outFile << "OutputFilters " << filters << "\n";
+	}
+
 	while (decompressed.peek() != EOF)
 	{
 